@@ -8,6 +8,10 @@
 -- @module fcitx
 local fcitx = require("fcitx.core")
 
+--- Text utilities that count characters instead of bytes.
+-- @see text.trim
+fcitx.text = require("fcitx.text")
+
 --- Call a global function by its name.
 -- @param function_name name of the function
 -- @param ... the arguments forwarded to the function.
@@ -23,31 +27,33 @@ end
 -- @table KeyState
 local KeyState = {
     None = 0,
-    Shift = 1 << 0,
-    CapsLock = 1 << 1,
-    Ctrl = 1 << 2,
-    Alt = 1 << 3,
-    NumLock = 1 << 4,
-    Mod3 = 1 << 5,
-    Super = 1 << 6,
-    Mod5 = 1 << 7,
-    MousePressed = 1 << 8,
-    HandledMask = 1 << 24,
-    IgnoredMask = 1 << 25,
-    Super2 = 1 << 26,
-    Hyper = 1 << 27,
-    Meta = 1 << 28,
+    Shift = 0x1, -- 1 << 0
+    CapsLock = 0x2, -- 1 << 1
+    Ctrl = 0x4, -- 1 << 2
+    Alt = 0x8, -- 1 << 3
+    NumLock = 0x10, -- 1 << 4
+    Mod3 = 0x20, -- 1 << 5
+    Super = 0x40, -- 1 << 6
+    Mod5 = 0x80, -- 1 << 7
+    MousePressed = 0x100, -- 1 << 8
+    HandledMask = 0x1000000, -- 1 << 24
+    IgnoredMask = 0x2000000, -- 1 << 25
+    Super2 = 0x4000000, -- 1 << 26
+    Hyper = 0x8000000, -- 1 << 27
+    Meta = 0x10000000, -- 1 << 28
     UsedMask = 0x5c001fff,
 }
 
+-- Avoid bitwise operators here, so this file can be loaded by LuaJIT as well.
+-- All the combined flags below are distinct bits.
 KeyState.Mod1 = KeyState.Alt
-KeyState.Alt_Shift = KeyState.Alt | KeyState.Shift
-KeyState.Ctrl_Shift = KeyState.Ctrl | KeyState.Shift
-KeyState.Ctrl_Alt = KeyState.Ctrl | KeyState.Alt
-KeyState.Ctrl_Alt_Shift = KeyState.Ctrl | KeyState.Alt | KeyState.Shift
+KeyState.Alt_Shift = KeyState.Alt + KeyState.Shift
+KeyState.Ctrl_Shift = KeyState.Ctrl + KeyState.Shift
+KeyState.Ctrl_Alt = KeyState.Ctrl + KeyState.Alt
+KeyState.Ctrl_Alt_Shift = KeyState.Ctrl + KeyState.Alt + KeyState.Shift
 KeyState.Mod2 = KeyState.NumLock
 KeyState.Mod4 = KeyState.Super
-KeyState.SimpleMask = KeyState.Ctrl_Alt_Shift | KeyState.Super | KeyState.Super2 | KeyState.Hyper | KeyState.Meta
+KeyState.SimpleMask = KeyState.Ctrl_Alt_Shift + KeyState.Super + KeyState.Super2 + KeyState.Hyper + KeyState.Meta
 
 fcitx.KeyState = KeyState
 
@@ -79,51 +85,85 @@ fcitx.QuickPhraseAction = {
     AutoCommit = 6,
 }
 
-local function dump(o)
-   if type(o) == 'table' then
-      local s = '{ '
-      for _k,v in pairs(o) do
-         local k = _k
-         if type(k) ~= 'number' then k = '"'..k..'"' end
-         s = s .. '['..k..'] = ' .. dump(v) .. ','
-      end
-      return s .. '} '
-   else
-      return tostring(o)
-   end
-end
-
-fcitx.dump = dump
-
 --- The lua version of fcitx::EventType. It represent the value of different
 -- type of events.
 -- @table EventType
 local EventType = {
-    ContextCreated = 0x0001000 | 0x1,
-    ContextDestroyed = 0x0001000 | 0x2,
-    FocusIn = 0x0001000 | 0x3,
-    FocusOut = 0x0001000 | 0x4,
-    KeyEvent = 0x0001000 | 0x5,
-    SurroundingTextUpdated = 0x0001000 | 0x7,
-    CursorRectChanged = 0x0001000 | 0x9,
-    SwitchInputMethod = 0x0001000 | 0xA,
-    InputMethodActivated = 0x0001000 | 0xB,
-    InputMethodDeactivated = 0x0001000 | 0xC,
-
-    CommitString = 0x0002000 | 0x2,
-    UpdatePreedit = 0x0002000 | 0x4,
+    ContextCreated = 0x0001001,
+    ContextDestroyed = 0x0001002,
+    FocusIn = 0x0001003,
+    FocusOut = 0x0001004,
+    KeyEvent = 0x0001005,
+    SurroundingTextUpdated = 0x0001007,
+    CursorRectChanged = 0x0001009,
+    SwitchInputMethod = 0x000100A,
+    InputMethodActivated = 0x000100B,
+    InputMethodDeactivated = 0x000100C,
+
+    CommitString = 0x0002002,
+    UpdatePreedit = 0x0002004,
 }
 
 fcitx.EventType = EventType
 
-local oldsetCurrentInputMethod=fcitx.setCurrentInputMethod
-local function setCurrentInputMethod(name,local_im)
-    if(local_im == nil) then
-        local_im = false
-    end    
-    oldsetCurrentInputMethod(name,local_im)
+--- Iterate over the recent commits of the current input context, from the
+-- most recent one.
+-- @int[opt] limit maximum number of commits to iterate.
+-- @return iterator of index and commit string.
+-- @see commitHistory
+function fcitx.recentCommits(limit)
+    local i = 0
+    return function()
+        i = i + 1
+        if limit ~= nil and i > limit then
+            return nil
+        end
+        local text = fcitx.commitHistory(i)
+        if text == nil then
+            return nil
+        end
+        return i, text
+    end
+end
+
+local oldwatchEvent = fcitx.watchEvent
+local function watchEvent(event, function_name, options)
+    if options ~= nil and options.coalesce then
+        return fcitx.watchEventCoalesced(event, function_name, options.interval)
+    end
+    if options ~= nil and options.object then
+        return fcitx.watchEventObject(event, function_name)
+    end
+    if options ~= nil and options.delta then
+        if event ~= fcitx.EventType.SurroundingTextUpdated then
+            error("Only SurroundingTextUpdated can be watched with delta")
+        end
+        return fcitx.watchSurroundingTextDelta(function_name)
+    end
+    return oldwatchEvent(event, function_name)
+end
+
+fcitx.watchEvent = watchEvent
+
+local oldaddQuickPhraseHandler = fcitx.addQuickPhraseHandler
+local function addQuickPhraseHandler(function_name, options)
+    if options == nil then
+        return oldaddQuickPhraseHandler(function_name)
+    end
+    return oldaddQuickPhraseHandler(function_name, options.prefixes,
+                                    options.minLength)
+end
+
+fcitx.addQuickPhraseHandler = addQuickPhraseHandler
+
+local oldsetErrorPolicy = fcitx.setErrorPolicy
+local function setErrorPolicy(policy)
+    oldsetErrorPolicy(policy.maxConsecutiveFailures,
+                      policy.maxErrorPercent,
+                      policy.backoff,
+                      policy.maxBackoff)
 end
 
-fcitx.setCurrentInputMethod = setCurrentInputMethod
+fcitx.setErrorPolicy = setErrorPolicy
 
 return fcitx
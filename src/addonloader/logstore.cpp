@@ -0,0 +1,320 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "logstore.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+namespace fcitx {
+
+namespace {
+
+constexpr char kMagic[8] = {'F', 'C', 'X', 'L', 'S', 'T', 'O', 'R'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = sizeof(kMagic) + sizeof(uint32_t);
+constexpr uint32_t kDeleted = 0xffffffff;
+// Key length, value length and checksum.
+constexpr size_t kRecordOverhead = sizeof(uint32_t) * 3;
+
+// FNV-1a, only used to detect a partially written record.
+uint32_t checksum(std::string_view data) {
+    uint32_t hash = 2166136261U;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 16777619U;
+    }
+    return hash;
+}
+
+void appendInteger(std::string &out, uint32_t value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+uint32_t readInteger(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+size_t recordSize(std::string_view key, std::string_view value) {
+    return kRecordOverhead + key.size() + value.size();
+}
+
+// Append a record, value is nullopt if the key is deleted.
+void appendRecord(std::string &out, std::string_view key,
+                  std::optional<std::string_view> value) {
+    const auto start = out.size();
+    appendInteger(out, key.size());
+    appendInteger(out, value ? value->size() : kDeleted);
+    out.append(key);
+    if (value) {
+        out.append(*value);
+    }
+    appendInteger(out, checksum(std::string_view(out).substr(start)));
+}
+
+bool writeAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        auto n = ::write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// Sync the directory of path, so a file created or renamed in it stays
+// there after a crash.
+bool syncDirectory(const std::string &path) {
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool success = fsync(fd) == 0;
+    close(fd);
+    return success;
+}
+
+} // namespace
+
+LogStore::LogStore(std::string path) : path_(std::move(path)) {}
+
+LogStore::~LogStore() {
+    flush();
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+std::shared_ptr<LogStore> LogStore::open(const std::string &path) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<LogStore>> stores;
+
+    std::lock_guard lock(mutex);
+    if (auto iter = stores.find(path); iter != stores.end()) {
+        if (auto store = iter->second.lock()) {
+            return store;
+        }
+    }
+    std::shared_ptr<LogStore> store(new LogStore(path));
+    store->load();
+    std::erase_if(stores,
+                  [](const auto &item) { return item.second.expired(); });
+    stores[path] = store;
+    return store;
+}
+
+void LogStore::load() {
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open store: " + path_);
+    }
+    std::string data;
+    char buffer[64 * 1024];
+    while (true) {
+        auto n = ::read(fd_, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error("Failed to read store: " + path_);
+        }
+        if (n == 0) {
+            break;
+        }
+        data.append(buffer, n);
+    }
+
+    if (data.empty()) {
+        std::string header(kMagic, sizeof(kMagic));
+        appendInteger(header, kVersion);
+        if (!writeAll(fd_, header) || fdatasync(fd_) != 0 ||
+            !syncDirectory(path_)) {
+            throw std::runtime_error("Failed to write store: " + path_);
+        }
+        logSize_ = kHeaderSize;
+        return;
+    }
+    if (data.size() < kHeaderSize ||
+        std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0 ||
+        readInteger(data.data() + sizeof(kMagic)) != kVersion) {
+        throw std::runtime_error("Invalid store: " + path_);
+    }
+
+    size_t offset = kHeaderSize;
+    while (data.size() - offset >= kRecordOverhead) {
+        const char *record = data.data() + offset;
+        const auto keyLength = readInteger(record);
+        const auto valueLength = readInteger(record + sizeof(uint32_t));
+        const size_t payload =
+            static_cast<size_t>(keyLength) +
+            (valueLength == kDeleted ? 0 : static_cast<size_t>(valueLength));
+        if (data.size() - offset - kRecordOverhead < payload) {
+            break;
+        }
+        const size_t size = kRecordOverhead + payload;
+        const std::string_view body(record, size - sizeof(uint32_t));
+        if (readInteger(record + body.size()) != checksum(body)) {
+            break;
+        }
+        std::string_view key(record + sizeof(uint32_t) * 2, keyLength);
+        auto iter = entries_.find(key);
+        if (iter != entries_.end()) {
+            liveSize_ -= recordSize(iter->first, iter->second);
+        }
+        if (valueLength == kDeleted) {
+            if (iter != entries_.end()) {
+                entries_.erase(iter);
+            }
+        } else {
+            std::string_view value(key.data() + key.size(), valueLength);
+            if (iter == entries_.end()) {
+                iter = entries_.emplace(std::string(key), std::string()).first;
+            }
+            iter->second.assign(value);
+            liveSize_ += recordSize(key, value);
+        }
+        offset += size;
+    }
+    if (offset != data.size() && ftruncate(fd_, offset) != 0) {
+        throw std::runtime_error("Failed to truncate store: " + path_);
+    }
+    logSize_ = offset;
+}
+
+std::optional<std::string> LogStore::get(std::string_view key) const {
+    std::lock_guard lock(mutex_);
+    if (auto iter = entries_.find(key); iter != entries_.end()) {
+        return iter->second;
+    }
+    return std::nullopt;
+}
+
+void LogStore::put(std::string_view key, std::string_view value) {
+    std::lock_guard lock(mutex_);
+    auto iter = entries_.find(key);
+    if (iter == entries_.end()) {
+        iter = entries_.emplace(std::string(key), std::string()).first;
+    } else if (iter->second == value) {
+        return;
+    } else {
+        liveSize_ -= recordSize(iter->first, iter->second);
+    }
+    iter->second.assign(value);
+    liveSize_ += recordSize(key, value);
+    appendRecord(pending_, key, value);
+}
+
+bool LogStore::remove(std::string_view key) {
+    std::lock_guard lock(mutex_);
+    auto iter = entries_.find(key);
+    if (iter == entries_.end()) {
+        return false;
+    }
+    liveSize_ -= recordSize(iter->first, iter->second);
+    entries_.erase(iter);
+    appendRecord(pending_, key, std::nullopt);
+    return true;
+}
+
+std::optional<std::pair<std::string, std::string>>
+LogStore::next(std::string_view prefix, const std::string *after) const {
+    std::lock_guard lock(mutex_);
+    auto iter = after ? entries_.upper_bound(*after)
+                      : entries_.lower_bound(prefix);
+    if (iter == entries_.end() || !iter->first.starts_with(prefix)) {
+        return std::nullopt;
+    }
+    return *iter;
+}
+
+size_t LogStore::size() const {
+    std::lock_guard lock(mutex_);
+    return entries_.size();
+}
+
+bool LogStore::flush() {
+    std::lock_guard flushLock(flushMutex_);
+    std::unique_lock lock(mutex_);
+    if (pending_.empty() || fd_ < 0) {
+        return true;
+    }
+    const auto size = logSize_ + pending_.size();
+    if (size > kStoreCompactMinSize && size > 2 * (kHeaderSize + liveSize_)) {
+        return compact(lock);
+    }
+    // The store may be changed while the records are written.
+    auto records = std::exchange(pending_, {});
+    lock.unlock();
+    const bool success = writeAll(fd_, records) && fdatasync(fd_) == 0;
+    lock.lock();
+    if (!success) {
+        // Drop the partially written record, otherwise it would end the log
+        // and hide the records appended after it.
+        [[maybe_unused]] auto rv = ftruncate(fd_, logSize_);
+        pending_.insert(0, records);
+        return false;
+    }
+    logSize_ += records.size();
+    return true;
+}
+
+bool LogStore::compact(std::unique_lock<std::mutex> &lock) {
+    std::string data(kMagic, sizeof(kMagic));
+    appendInteger(data, kVersion);
+    data.reserve(kHeaderSize + liveSize_);
+    for (const auto &[key, value] : entries_) {
+        appendRecord(data, key, value);
+    }
+    // Changes made while the snapshot is written stay pending.
+    auto records = std::exchange(pending_, {});
+    lock.unlock();
+
+    const auto tempPath = path_ + ".compact";
+    int fd = ::open(tempPath.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    const bool renamed = fd >= 0 && writeAll(fd, data) && fsync(fd) == 0 &&
+                         rename(tempPath.c_str(), path_.c_str()) == 0;
+    const bool success = renamed && syncDirectory(path_);
+    if (!renamed && fd >= 0) {
+        close(fd);
+        unlink(tempPath.c_str());
+    }
+
+    lock.lock();
+    if (renamed) {
+        close(std::exchange(fd_, fd));
+        logSize_ = data.size();
+    }
+    if (!success) {
+        // Writing the records again is harmless if only the directory sync
+        // failed, the later record of a key wins.
+        pending_.insert(0, records);
+    }
+    return success;
+}
+
+} // namespace fcitx
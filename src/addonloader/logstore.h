@@ -0,0 +1,96 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LOGSTORE_H_
+#define _FCITX5_LUA_ADDONLOADER_LOGSTORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace fcitx {
+
+// Delay between a change and writing it to disk, so the changes made in a
+// burst are written and synced together.
+inline constexpr uint64_t kStoreFlushDelay = 1000000;
+// The log is not compacted until it is larger than this.
+inline constexpr size_t kStoreCompactMinSize = 64 * 1024;
+
+// Persistent key value store backed by an append only log. All entries are
+// kept in memory, and changes are appended to the log by flush. The log is
+// rewritten with only the live entries once more than half of it is
+// garbage.
+//
+// On disk layout of the log, all integers are in native byte order.
+//
+// Header:
+//   char[8]  magic "FCXLSTOR"
+//   uint32_t version
+// Records:
+//   uint32_t key length
+//   uint32_t value length, 0xffffffff if the key is deleted
+//   Key and value bytes
+//   uint32_t checksum of the record before it
+//
+// A truncated or corrupted record, e.g. written partially before a crash,
+// ends the log, and is discarded with anything after it.
+class LogStore {
+public:
+    ~LogStore();
+
+    // Open or create the store at given path. The same path is only opened
+    // once per process and shared by every caller until all references are
+    // gone. Throw std::runtime_error if it can't be opened.
+    static std::shared_ptr<LogStore> open(const std::string &path);
+
+    std::optional<std::string> get(std::string_view key) const;
+    void put(std::string_view key, std::string_view value);
+    // Return whether the key existed.
+    bool remove(std::string_view key);
+    // Return the first entry starting with prefix and after the key after,
+    // or the first entry starting with prefix if after is nullptr.
+    std::optional<std::pair<std::string, std::string>>
+    next(std::string_view prefix, const std::string *after) const;
+    size_t size() const;
+
+    // Append the pending changes to the log and sync it, or compact the log
+    // if it has too much garbage. Return false if it fails, the changes are
+    // kept to be written again by the next flush. It may be called from
+    // another thread, and the store can be used while it writes.
+    bool flush();
+
+private:
+    explicit LogStore(std::string path);
+
+    void load();
+    // Rewrite the log with the live entries, lock holds mutex_ and is
+    // released while writing.
+    bool compact(std::unique_lock<std::mutex> &lock);
+
+    const std::string path_;
+    // Held by flush, so only one flush writes at a time. fd_ and logSize_
+    // are only changed with both mutexes held.
+    std::mutex flushMutex_;
+    mutable std::mutex mutex_;
+    std::map<std::string, std::string, std::less<>> entries_;
+    // Records not written to the log yet.
+    std::string pending_;
+    int fd_ = -1;
+    // Size of the log on disk, and the size of records of the live entries.
+    size_t logSize_ = 0;
+    size_t liveSize_ = 0;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LOGSTORE_H_
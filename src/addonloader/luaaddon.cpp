@@ -6,38 +6,296 @@
  */
 #include "luaaddon.h"
 #include "config.h"
+#include "luaaddonloader.h"
 #include "luaaddonstate.h"
 #include "luahelper.h"
+#include <chrono>
+#include <cstdint>
+#include <ctime>
 #include <exception>
 #include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/standardpaths.h>
 #include <fcitx/addoninfo.h>
 #include <fcitx/inputcontext.h>
+#include <filesystem>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 namespace fcitx {
 
-LuaAddon::LuaAddon(LibraryPtr luaLibrary, const AddonInfo &info,
+namespace {
+
+// Interval of checking whether a sandboxed addon is loaded in usec.
+constexpr uint64_t kPendingStatePollInterval = 10000;
+
+} // namespace
+
+LuaAddon::LuaAddon(LuaAddonLoader *loader, const AddonInfo &info,
                    AddonManager *manager)
     : instance_(manager->instance()), name_(info.uniqueName()),
-      library_(info.library()), state_(std::make_unique<LuaAddonState>(
-                                    luaLibrary, name_, library_, manager)),
-      luaLibrary_(luaLibrary) {}
+      library_(info.library()),
+      sandboxed_(loader->sandboxOptions(name_).has_value()), loader_(loader),
+      luaLibrary_(loader->luaLibrary()) {
+    dispatcher_.attach(&instance_->eventLoop());
+    loader_->addAddon(this);
+    lazy_ = isLazy();
+    if (lazy_) {
+        return;
+    }
+    // Lua states share nothing with each other, so loading the lua source can
+    // run in parallel. Only the handlers to fcitx are registered in the main
+    // thread, at the latest when the event loop starts.
+    pendingState_ = loader->threadPool().submit(
+        [luaLibrary = luaLibrary_, name = name_, library = library_,
+         manager, sandbox = loader->sandboxOptions(name_),
+         commitHistory = loader->commitHistory(),
+         fileIO = loader->fileIO()]() {
+            return std::make_unique<LuaAddonState>(luaLibrary, name, library,
+                                                   manager, true, sandbox,
+                                                   commitHistory, fileIO);
+        });
+    deferEvent_ = instance_->eventLoop().addDeferEvent([this](EventSource *) {
+        state();
+        return true;
+    });
+}
+
+LuaAddon::~LuaAddon() {
+    loader_->removeAddon(this);
+    if (pendingState_.valid()) {
+        pendingState_.wait();
+    }
+}
+
+LuaAddonState *LuaAddon::state() {
+    if (pendingState_.valid() && sandboxed_ &&
+        pendingState_.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready) {
+        // A sandboxed addon may run until its load deadline, which is never
+        // waited by the main loop. It is not called until it is loaded.
+        pollPendingState();
+    } else if (pendingState_.valid()) {
+        pendingStateEvent_.reset();
+        try {
+            state_ = pendingState_.get();
+            state_->registerDeferredHandlers();
+            loader_->reportStartup(name_, state_->startupTiming());
+            updateProfiler();
+        } catch (const std::exception &e) {
+            FCITX_LUA_ERROR() << "Loading lua addon " << name_
+                              << " failed: " << e.what();
+        }
+    } else if (lazy_ && !state_ && !lazyLoadFailed_) {
+        try {
+            state_ = createState();
+            updateProfiler();
+        } catch (const std::exception &e) {
+            // Don't retry on every call, until the addon is reloaded.
+            lazyLoadFailed_ = true;
+            FCITX_LUA_ERROR() << "Loading lua addon " << name_
+                              << " failed: " << e.what();
+        }
+    }
+    if (lazy_ && state_) {
+        scheduleIdleUnload();
+    }
+    return state_.get();
+}
+
+void LuaAddon::pollPendingState() {
+    const auto time = now(CLOCK_MONOTONIC) + kPendingStatePollInterval;
+    if (pendingStateEvent_) {
+        pendingStateEvent_->setTime(time);
+    } else {
+        pendingStateEvent_ = instance_->eventLoop().addTimeEvent(
+            CLOCK_MONOTONIC, time, 0, [this](EventSourceTime *, uint64_t) {
+                state();
+                return true;
+            });
+    }
+    pendingStateEvent_->setOneShot();
+}
+
+std::unique_ptr<LuaAddonState> LuaAddon::createState() {
+    return std::make_unique<LuaAddonState>(
+        luaLibrary_, name_, library_, &instance_->addonManager(), false,
+        loader_->sandboxOptions(name_), loader_->commitHistory(),
+        loader_->fileIO());
+}
+
+bool LuaAddon::isLazy() const { return loader_->isLazyAddon(name_); }
+
+void LuaAddon::scheduleIdleUnload() {
+    const auto timeout = *loader_->config().lazyIdleTimeout;
+    if (!timeout) {
+        idleEvent_.reset();
+        return;
+    }
+    const auto time =
+        now(CLOCK_MONOTONIC) + static_cast<uint64_t>(timeout) * 1000000;
+    if (idleEvent_) {
+        idleEvent_->setTime(time);
+    } else {
+        idleEvent_ = instance_->eventLoop().addTimeEvent(
+            CLOCK_MONOTONIC, time, 1000000,
+            [this](EventSourceTime *, uint64_t) {
+                // Keep the samples until the profiler is stopped, and never
+                // drop what the addon registered. Check again later.
+                if (state_ &&
+                    (state_->profiling() || state_->hasRegistrations())) {
+                    scheduleIdleUnload();
+                    return true;
+                }
+                FCITX_LUA_DEBUG() << "Unload idle lua addon " << name_;
+                state_.reset();
+                return true;
+            });
+    }
+    idleEvent_->setOneShot();
+}
 
 void LuaAddon::reloadConfig() {
+    if (pendingState_.valid()) {
+        // Bounded by the load deadline in sandbox.
+        pendingState_.wait();
+        state();
+    }
+    lazy_ = isLazy();
+    lazyLoadFailed_ = false;
+    if (lazy_) {
+        // Created again with the new config on next call.
+        idleEvent_.reset();
+        state_.reset();
+        return;
+    }
     try {
-        auto newState = std::make_unique<LuaAddonState>(
-            luaLibrary_, name_, library_, &instance_->addonManager());
-        state_ = std::move(newState);
+        state_ = createState();
+        updateProfiler();
     } catch (const std::exception &e) {
         FCITX_LUA_ERROR() << e.what();
     }
 }
 
+void LuaAddon::updateProfiler() {
+    if (!state_) {
+        return;
+    }
+    const bool enabled = loader_->isProfiledAddon(name_);
+    if (enabled && !state_->profiling()) {
+        state_->startProfiler(*loader_->config().profilerInterval);
+    } else if (!enabled && state_->profiling()) {
+        stopProfiler();
+    }
+}
+
 RawConfig LuaAddon::invokeLuaFunction(InputContext *ic, const std::string &name,
                                       const RawConfig &config) {
-    return state_->invokeLuaFunction(ic, name, config);
+    auto *state = this->state();
+    if (!state) {
+        return {};
+    }
+    return state->invokeLuaFunction(ic, name, config);
+}
+
+LuaValue LuaAddon::invokeLuaFunctionTyped(InputContext *ic,
+                                          const std::string &name,
+                                          const std::vector<LuaValue> &args) {
+    auto *state = this->state();
+    if (!state) {
+        return {};
+    }
+    return state->invokeLuaFunctionTyped(ic, name, args);
+}
+
+std::future<RawConfig>
+LuaAddon::invokeLuaFunctionAsync(const std::string &name,
+                                 const RawConfig &config) {
+    AsyncCall call{name, config, {}};
+    auto future = call.promise.get_future();
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex_);
+        asyncCalls_.push_back(std::move(call));
+        schedule = !std::exchange(asyncScheduled_, true);
+    }
+    if (schedule) {
+        dispatcher_.schedule([this]() { runAsyncCalls(); });
+    }
+    return future;
+}
+
+void LuaAddon::runAsyncCalls() {
+    std::vector<AsyncCall> calls;
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex_);
+        calls.swap(asyncCalls_);
+        asyncScheduled_ = false;
+    }
+    for (auto &call : calls) {
+        call.promise.set_value(
+            invokeLuaFunction(nullptr, call.name, call.config));
+    }
+}
+
+void LuaAddon::startProfiler(int interval) {
+    if (auto *state = this->state()) {
+        state->startProfiler(interval > 0 ? interval
+                                          : kProfilerDefaultInterval);
+    }
+}
+
+std::string LuaAddon::stopProfiler() {
+    if (pendingState_.valid()) {
+        state();
+    }
+    if (!state_) {
+        return {};
+    }
+    auto profiler = state_->stopProfiler();
+    if (!profiler) {
+        return {};
+    }
+    const auto path =
+        std::filesystem::path("fcitx5/lua/profile") / (name_ + ".folded");
+    const auto folded = profiler->folded();
+    if (!StandardPaths::global().safeSave(
+            StandardPathsType::Cache, path, [&folded](int fd) {
+                return fs::safeWrite(fd, folded.data(), folded.size()) ==
+                       static_cast<ssize_t>(folded.size());
+            })) {
+        FCITX_LUA_ERROR() << "Failed to save the profile of " << name_;
+        return {};
+    }
+    auto fullPath =
+        StandardPaths::global().userDirectory(StandardPathsType::Cache) / path;
+    FCITX_LUA_INFO() << "Saved " << profiler->samples() << " samples of "
+                     << name_ << " to " << fullPath;
+    return fullPath.string();
+}
+
+RawConfig LuaAddon::stats() {
+    RawConfig config;
+    // Don't create the state of a lazy addon just for stats.
+    auto *state = lazy_ ? state_.get() : this->state();
+    config.setValueByPath("Loaded", state ? "True" : "False");
+    if (state) {
+        config.setValueByPath("HeapSize", std::to_string(state->heapSize()));
+        config.setValueByPath("GCCount", std::to_string(state->gcCount()));
+        config.setValueByPath("Degraded",
+                              state->degraded() ? "True" : "False");
+        for (const auto &[name, info] : state->moduleLoadInfo()) {
+            auto &module = config["Modules"][name];
+            module.setValueByPath("LoadTime", std::to_string(info.time));
+            module.setValueByPath("Cached", info.cached ? "True" : "False");
+        }
+    }
+    return config;
 }
 
 } // namespace fcitx
@@ -15,32 +15,96 @@
 #include <fcitx/addoninfo.h>
 #include <fcitx/addoninstance.h>
 #include <fcitx/addonmanager.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/eventdispatcher.h>
 #include <fcitx/instance.h>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace fcitx {
 
 class AddonManager;
+class LuaAddonLoader;
 
 class LuaAddon : public AddonInstance {
 public:
-    LuaAddon(LibraryPtr luaLibrary, const AddonInfo &info,
+    LuaAddon(LuaAddonLoader *loader, const AddonInfo &info,
              AddonManager *manager);
+    ~LuaAddon();
 
     void reloadConfig() override;
 
+    // Start or stop the profiler if the addon is added to or removed from
+    // ProfiledAddons, the profile is saved once stopped. A state that is not
+    // created yet is started with the profiler once created.
+    void updateProfiler();
+
 private:
     RawConfig invokeLuaFunction(InputContext *ic, const std::string &name,
                                 const RawConfig &config);
     FCITX_ADDON_EXPORT_FUNCTION(LuaAddon, invokeLuaFunction);
+    LuaValue invokeLuaFunctionTyped(InputContext *ic, const std::string &name,
+                                    const std::vector<LuaValue> &args);
+    FCITX_ADDON_EXPORT_FUNCTION(LuaAddon, invokeLuaFunctionTyped);
+    std::future<RawConfig> invokeLuaFunctionAsync(const std::string &name,
+                                                  const RawConfig &config);
+    FCITX_ADDON_EXPORT_FUNCTION(LuaAddon, invokeLuaFunctionAsync);
+    RawConfig stats();
+    FCITX_ADDON_EXPORT_FUNCTION(LuaAddon, stats);
+    void startProfiler(int interval);
+    FCITX_ADDON_EXPORT_FUNCTION(LuaAddon, startProfiler);
+    std::string stopProfiler();
+    FCITX_ADDON_EXPORT_FUNCTION(LuaAddon, stopProfiler);
+
+    // Wait for the state constructed in the thread pool, and register its
+    // handlers on first call. A lazy addon creates the state here instead.
+    LuaAddonState *state();
+    // Check again later whether the state constructed in the thread pool is
+    // ready.
+    void pollPendingState();
+    // Create the state in the main thread.
+    std::unique_ptr<LuaAddonState> createState();
+    // Whether the state is only created on first call, which is opt-in by
+    // listing the addon in LazyAddons.
+    bool isLazy() const;
+    // Unload the state of a lazy addon once it is not called for a while,
+    // unless it has registrations that would be lost.
+    void scheduleIdleUnload();
+    // Run the calls queued by invokeLuaFunctionAsync.
+    void runAsyncCalls();
+
+    struct AsyncCall {
+        std::string name;
+        RawConfig config;
+        std::promise<RawConfig> promise;
+    };
 
     Instance *instance_;
     const std::string name_;
     const std::string library_;
+    // Whether the addon runs in sandbox on startup.
+    const bool sandboxed_;
+    LuaAddonLoader *loader_;
+    bool lazy_ = false;
+    bool lazyLoadFailed_ = false;
 
+    std::future<std::unique_ptr<LuaAddonState>> pendingState_;
+    std::unique_ptr<EventSource> deferEvent_;
+    std::unique_ptr<EventSourceTime> pendingStateEvent_;
     std::unique_ptr<LuaAddonState> state_;
     LibraryPtr luaLibrary_;
+    std::unique_ptr<EventSourceTime> idleEvent_;
+
+    std::mutex asyncMutex_;
+    std::vector<AsyncCall> asyncCalls_;
+    // Whether runAsyncCalls is scheduled, so a burst of calls only wakes up
+    // the main thread once.
+    bool asyncScheduled_ = false;
+    // Destroyed first, so no scheduled call runs on a destroyed addon.
+    EventDispatcher dispatcher_;
 };
 
 } // namespace fcitx
@@ -7,10 +7,66 @@
 #ifndef _FCITX5_LUA_ADDONLOADER_LUAADDON_PUBLIC_H_
 #define _FCITX5_LUA_ADDONLOADER_LUAADDON_PUBLIC_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <fcitx-config/rawconfig.h>
 #include <fcitx-utils/metastring.h>
 #include <fcitx/addoninstance.h>
 #include <fcitx/inputcontext.h>
+#include <future>
+#include <map>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace fcitx {
+
+class LuaValue;
+using LuaValueArray = std::vector<LuaValue>;
+using LuaValueMap = std::map<std::string, LuaValue>;
+
+/// A lua value passed to invokeLuaFunctionTyped without conversion to string.
+/// Lua sequences are mapped to LuaValueArray, other tables to LuaValueMap with
+/// integer keys converted to string. Functions and userdata become nil. The
+/// call returns nil if a table has a key of other types.
+class LuaValue {
+public:
+    using Variant = std::variant<std::monostate, bool, int64_t, double,
+                                 std::string, LuaValueArray, LuaValueMap>;
+
+    LuaValue() = default;
+    LuaValue(std::nullptr_t) {}
+    LuaValue(bool value) : value_(value) {}
+    LuaValue(int value) : value_(static_cast<int64_t>(value)) {}
+    LuaValue(int64_t value) : value_(value) {}
+    LuaValue(double value) : value_(value) {}
+    LuaValue(const char *value) : value_(std::string(value)) {}
+    LuaValue(std::string value) : value_(std::move(value)) {}
+    LuaValue(LuaValueArray value) : value_(std::move(value)) {}
+    LuaValue(LuaValueMap value) : value_(std::move(value)) {}
+
+    bool isNil() const {
+        return std::holds_alternative<std::monostate>(value_);
+    }
+    template <typename T>
+    bool is() const {
+        return std::holds_alternative<T>(value_);
+    }
+    /// Return nullptr if the value is not of type T.
+    template <typename T>
+    const T *get() const {
+        return std::get_if<T>(&value_);
+    }
+    const Variant &variant() const { return value_; }
+
+    bool operator==(const LuaValue &other) const = default;
+
+private:
+    Variant value_;
+};
+
+} // namespace fcitx
 
 /// Trigger quickphrase, with following format:
 /// description_text prefix_text
@@ -18,6 +74,49 @@ FCITX_ADDON_DECLARE_FUNCTION(LuaAddon, invokeLuaFunction,
                              fcitx::RawConfig(fcitx::InputContext *ic,
                                               const std::string &text,
                                               const fcitx::RawConfig &config));
+/// Call a global lua function with native lua values as arguments, and return
+/// its first result. Nil is returned if the call fails.
+FCITX_ADDON_DECLARE_FUNCTION(
+    LuaAddon, invokeLuaFunctionTyped,
+    fcitx::LuaValue(fcitx::InputContext *ic, const std::string &name,
+                    const std::vector<fcitx::LuaValue> &args));
+/// Call a global lua function like invokeLuaFunction without input context.
+/// It can be called from any thread, as long as the addon is alive. The call
+/// runs in the main thread, and the future becomes ready once it returns.
+FCITX_ADDON_DECLARE_FUNCTION(LuaAddon, invokeLuaFunctionAsync,
+                             std::future<fcitx::RawConfig>(
+                                 const std::string &name,
+                                 const fcitx::RawConfig &config));
+/// Return the memory statistics of the lua addon, with following format:
+/// HeapSize=bytes used by the lua state
+/// GCCount=number of garbage collection cycles finished
+/// Modules/name/LoadTime=usec to load the module name with require
+/// Modules/name/Cached=whether the compiled module was reused from the cache
+/// Degraded=whether the addon is disabled for missing the sandbox deadline
+/// Loaded=whether the state of the addon exists, a lazy addon creates it on
+/// first call and may unload it when idle
+FCITX_ADDON_DECLARE_FUNCTION(LuaAddon, stats, fcitx::RawConfig());
+/// Start sampling the lua call stack of the addon every interval lua
+/// instructions, 10000 if interval is not positive. It is cheap enough to
+/// keep running for a few minutes. Except with LuaJIT, coroutines created
+/// before it is started are not sampled. Listing the addon in ProfiledAddons
+/// of the loader config does the same without a C++ caller, and removing it
+/// calls stopProfiler.
+FCITX_ADDON_DECLARE_FUNCTION(LuaAddon, startProfiler, void(int interval));
+/// Stop the profiler and save the samples in folded stack format, which can
+/// be rendered by flamegraph.pl, to fcitx5/lua/profile/name.folded under the
+/// cache directory. Return the path of the file, or an empty string if the
+/// profiler is not started or the file can't be saved.
+FCITX_ADDON_DECLARE_FUNCTION(LuaAddon, stopProfiler, std::string());
+/// Return the time spent to load the lua addons, with following format:
+/// LoaderInit=usec to initialize the loader, including resolving lua library
+/// Addons/name/{CreateState,OpenLibs,LoadBase,LoadFile,Execute,Register}=usec
+/// spent in each phase of loading the addon name
+/// Addons/name/Total=usec to load the addon name
+/// Addons/name/HeapSize=bytes used by the lua state after loading
+/// Addons/name/Slow=whether loading is slower than SlowStartupThreshold
+FCITX_ADDON_DECLARE_FUNCTION(LuaAddonLoaderAddon, startupReport,
+                             fcitx::RawConfig());
 FCITX_ADDON_DECLARE_FUNCTION(LuaInputMethod, invokeLuaFunction,
                              fcitx::RawConfig(fcitx::InputContext *ic,
                                               const std::string &text,
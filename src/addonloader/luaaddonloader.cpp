@@ -8,16 +8,142 @@
 #include "luaaddon.h"
 #include "luahelper.h"
 #include "luastate.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <ctime>
 #include <exception>
+#include <fcitx-config/iniparser.h>
+#include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/fs.h>
 #include <fcitx/addoninfo.h>
 #include <fcitx/addoninstance.h>
 #include <fcitx/addonmanager.h>
+#include <fcitx/event.h>
+#include <fcitx/inputcontext.h>
+#include <fcntl.h>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 namespace fcitx {
 
+namespace {
+
+constexpr char kConfigFile[] = "conf/luaaddonloader.conf";
+// Recorded data is written once it is larger than this.
+constexpr size_t kRecorderBufferSize = 4096;
+
+bool isSensitive(InputContext *ic) {
+    const auto flags = ic->capabilityFlags();
+    return flags.test(CapabilityFlag::Password) ||
+           flags.test(CapabilityFlag::Sensitive);
+}
+
+} // namespace
+
+KeyStreamRecorder::KeyStreamRecorder(Instance *instance,
+                                     const std::string &path)
+    : fd_(UnixFD::own(open(path.data(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))),
+      start_(now(CLOCK_MONOTONIC)) {
+    // An existing file keeps its mode on open.
+    if (!fd_.isValid() || fchmod(fd_.fd(), 0600) != 0) {
+        FCITX_LUA_ERROR() << "Failed to open " << path << " for recording.";
+        fd_.reset();
+        return;
+    }
+    FCITX_LUA_INFO() << "Recording input stream to " << path;
+    writeKeyStreamHeader(out_);
+    flush();
+    watchers_.push_back(instance->watchEvent(
+        EventType::InputContextKeyEvent, EventWatcherPhase::PreInputMethod,
+        [this](Event &event) {
+            auto &keyEvent = static_cast<KeyEvent &>(event);
+            if (isSensitive(keyEvent.inputContext())) {
+                return;
+            }
+            KeyStreamRecord record;
+            record.type = KeyStreamRecordType::Key;
+            record.sym = keyEvent.rawKey().sym();
+            record.states = keyEvent.rawKey().states();
+            record.release = keyEvent.isRelease();
+            this->record(record);
+        }));
+    watchers_.push_back(instance->watchEvent(
+        EventType::InputContextCommitString, EventWatcherPhase::Default,
+        [this](Event &event) {
+            auto &commitEvent = static_cast<CommitStringEvent &>(event);
+            if (isSensitive(commitEvent.inputContext())) {
+                return;
+            }
+            KeyStreamRecord record;
+            record.type = KeyStreamRecordType::Commit;
+            record.text = commitEvent.text();
+            this->record(record);
+        }));
+    watchers_.push_back(instance->watchEvent(
+        EventType::InputContextFocusIn, EventWatcherPhase::Default,
+        [this](Event &event) {
+            auto &icEvent = static_cast<InputContextEvent &>(event);
+            // Not even when or where a password field is focused.
+            if (isSensitive(icEvent.inputContext())) {
+                return;
+            }
+            KeyStreamRecord record;
+            record.type = KeyStreamRecordType::FocusIn;
+            record.text = icEvent.inputContext()->program();
+            this->record(record);
+        }));
+    watchers_.push_back(instance->watchEvent(
+        EventType::InputContextFocusOut, EventWatcherPhase::Default,
+        [this](Event &event) {
+            auto &icEvent = static_cast<InputContextEvent &>(event);
+            if (!isSensitive(icEvent.inputContext())) {
+                KeyStreamRecord record;
+                record.type = KeyStreamRecordType::FocusOut;
+                this->record(record);
+            }
+            // Make sure the data is on disk when user switch away.
+            flush();
+        }));
+}
+
+KeyStreamRecorder::~KeyStreamRecorder() { flush(); }
+
+void KeyStreamRecorder::record(KeyStreamRecord &record) {
+    record.time = now(CLOCK_MONOTONIC) - start_;
+    writeKeyStreamRecord(out_, record);
+    if (static_cast<size_t>(out_.tellp()) >= kRecorderBufferSize) {
+        flush();
+    }
+}
+
+void KeyStreamRecorder::flush() {
+    auto data = out_.str();
+    out_.str({});
+    if (!fd_.isValid() || data.empty()) {
+        return;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        auto n = fs::safeWrite(fd_.fd(), data.data() + written,
+                               data.size() - written);
+        if (n <= 0) {
+            FCITX_LUA_ERROR() << "Failed to write the recorded input stream.";
+            fd_.reset();
+            return;
+        }
+        written += n;
+    }
+}
+
 LuaAddonLoader::LuaAddonLoader() {
+    auto start = now(CLOCK_MONOTONIC);
 #ifdef USE_DLOPEN
     luaLibrary_ = std::make_unique<Library>(LUA_LIBRARY_PATH);
     luaLibrary_->load(
@@ -26,8 +152,8 @@ LuaAddonLoader::LuaAddonLoader() {
         FCITX_LUA_ERROR() << "Failed to load lua library: "
                           << luaLibrary_->error();
     }
-    _fcitx_lua_getglobal = reinterpret_cast<decltype(_fcitx_lua_getglobal)>(
-        luaLibrary_->resolve("lua_getglobal"));
+    _fcitx_lua_getfield = reinterpret_cast<decltype(_fcitx_lua_getfield)>(
+        luaLibrary_->resolve("lua_getfield"));
     _fcitx_lua_touserdata = reinterpret_cast<decltype(_fcitx_lua_touserdata)>(
         luaLibrary_->resolve("lua_touserdata"));
     _fcitx_lua_settop = reinterpret_cast<decltype(_fcitx_lua_settop)>(
@@ -37,20 +163,23 @@ LuaAddonLoader::LuaAddonLoader() {
     _fcitx_luaL_newstate = reinterpret_cast<decltype(_fcitx_luaL_newstate)>(
         luaLibrary_->resolve("luaL_newstate"));
 #else
-    _fcitx_lua_getglobal = &::lua_getglobal;
+    _fcitx_lua_getfield = &::lua_getfield;
     _fcitx_lua_touserdata = &::lua_touserdata;
     _fcitx_lua_settop = &::lua_settop;
     _fcitx_lua_close = &::lua_close;
     _fcitx_luaL_newstate = &::luaL_newstate;
 #endif
 
-    if (!_fcitx_lua_getglobal || !_fcitx_lua_touserdata || !_fcitx_lua_settop ||
+    if (!_fcitx_lua_getfield || !_fcitx_lua_touserdata || !_fcitx_lua_settop ||
         !_fcitx_lua_close || !_fcitx_luaL_newstate) {
         throw std::runtime_error("Failed to resolve lua functions.");
     }
 
     // Create test state to ensure the function can be resolved.
     LuaState testState(luaLibrary());
+    initTime_ = now(CLOCK_MONOTONIC) - start;
+    FCITX_LUA_INFO() << "Lua addon loader initialized in " << initTime_
+                     << "us.";
 }
 
 AddonInstance *LuaAddonLoader::load(const AddonInfo &info,
@@ -60,10 +189,22 @@ AddonInstance *LuaAddonLoader::load(const AddonInfo &info,
         return nullptr;
     }
 #endif
+    if (!recorder_) {
+        if (const char *path = getenv("FCITX_LUA_RECORD"); path && *path) {
+            recorder_ =
+                std::make_unique<KeyStreamRecorder>(manager->instance(), path);
+        }
+    }
+    if (!commitHistory_) {
+        commitHistory_ =
+            std::make_unique<LuaCommitHistory>(manager->instance());
+    }
+    if (!fileIO_) {
+        fileIO_ = std::make_unique<LuaFileIO>(manager->instance());
+    }
     if (info.category() == AddonCategory::Module) {
         try {
-            auto addon =
-                std::make_unique<LuaAddon>(luaLibrary(), info, manager);
+            auto addon = std::make_unique<LuaAddon>(this, info, manager);
             return addon.release();
         } catch (const std::exception &e) {
             FCITX_LUA_ERROR() << "Loading lua addon " << info.uniqueName()
@@ -74,9 +215,109 @@ AddonInstance *LuaAddonLoader::load(const AddonInfo &info,
     return nullptr;
 }
 
+ThreadPool &LuaAddonLoader::threadPool() {
+    if (!threadPool_) {
+        threadPool_ =
+            std::make_unique<ThreadPool>(std::thread::hardware_concurrency());
+    }
+    return *threadPool_;
+}
+
+void LuaAddonLoader::setConfig(const RawConfig &config) {
+    config_.load(config, true);
+    safeSaveAsIni(config_, kConfigFile);
+    updateProfilers();
+}
+
+void LuaAddonLoader::reloadConfig() {
+    readAsIni(config_, kConfigFile);
+    updateProfilers();
+}
+
+std::optional<LuaSandboxOptions>
+LuaAddonLoader::sandboxOptions(const std::string &name) const {
+    const auto &addons = *config_.sandboxedAddons;
+    if (std::find(addons.begin(), addons.end(), name) == addons.end()) {
+        return std::nullopt;
+    }
+    LuaSandboxOptions options;
+    options.deadline = static_cast<uint64_t>(*config_.sandboxDeadline) * 1000;
+    options.loadDeadline =
+        static_cast<uint64_t>(*config_.sandboxLoadDeadline) * 1000;
+    options.memoryLimit = static_cast<size_t>(*config_.sandboxMemoryLimit)
+                          << 20;
+    return options;
+}
+
+bool LuaAddonLoader::isLazyAddon(const std::string &name) const {
+    const auto &addons = *config_.lazyAddons;
+    return std::find(addons.begin(), addons.end(), name) != addons.end();
+}
+
+bool LuaAddonLoader::isProfiledAddon(const std::string &name) const {
+    const auto &addons = *config_.profiledAddons;
+    return std::find(addons.begin(), addons.end(), name) != addons.end();
+}
+
+void LuaAddonLoader::addAddon(LuaAddon *addon) { addons_.push_back(addon); }
+
+void LuaAddonLoader::removeAddon(LuaAddon *addon) {
+    addons_.erase(std::remove(addons_.begin(), addons_.end(), addon),
+                  addons_.end());
+}
+
+void LuaAddonLoader::updateProfilers() {
+    for (auto *addon : addons_) {
+        addon->updateProfiler();
+    }
+}
+
+void LuaAddonLoader::reportStartup(const std::string &name,
+                                   const LuaStartupTiming &timing) {
+    startupTiming_[name] = timing;
+    FCITX_LUA_INFO() << "Lua addon " << name << " loaded in "
+                     << timing.total() << "us: create state "
+                     << timing.createState << "us, open libs "
+                     << timing.openLibs << "us, load base "
+                     << timing.loadBase << "us, load file " << timing.loadFile
+                     << "us, execute " << timing.execute << "us, register "
+                     << timing.registerHandlers << "us, heap "
+                     << timing.heapSize << " bytes.";
+    const uint64_t threshold = *config_.slowStartupThreshold * 1000ULL;
+    if (threshold && timing.total() > threshold) {
+        FCITX_LUA_WARN() << "Lua addon " << name << " is slow to load, took "
+                         << timing.total() / 1000 << "ms.";
+    }
+}
+
+RawConfig LuaAddonLoader::startupReport() const {
+    RawConfig report;
+    report.setValueByPath("LoaderInit", std::to_string(initTime_));
+    const uint64_t threshold = *config_.slowStartupThreshold * 1000ULL;
+    for (const auto &[name, timing] : startupTiming_) {
+        auto &addon = report["Addons"][name];
+        addon.setValueByPath("CreateState",
+                             std::to_string(timing.createState));
+        addon.setValueByPath("OpenLibs", std::to_string(timing.openLibs));
+        addon.setValueByPath("LoadBase", std::to_string(timing.loadBase));
+        addon.setValueByPath("LoadFile", std::to_string(timing.loadFile));
+        addon.setValueByPath("Execute", std::to_string(timing.execute));
+        addon.setValueByPath("Register",
+                             std::to_string(timing.registerHandlers));
+        addon.setValueByPath("Total", std::to_string(timing.total()));
+        addon.setValueByPath("HeapSize", std::to_string(timing.heapSize));
+        addon.setValueByPath(
+            "Slow", threshold && timing.total() > threshold ? "True" : "False");
+    }
+    return report;
+}
+
 LuaAddonLoaderAddon::LuaAddonLoaderAddon(AddonManager *manager)
     : manager_(manager) {
-    manager->registerLoader(std::make_unique<LuaAddonLoader>());
+    auto loader = std::make_unique<LuaAddonLoader>();
+    loader_ = loader.get();
+    loader_->reloadConfig();
+    manager->registerLoader(std::move(loader));
 }
 
 LuaAddonLoaderAddon::~LuaAddonLoaderAddon() {
@@ -8,32 +8,142 @@
 #define _FCITX5_LUA_ADDONLOADER_LUAADDONLOADER_H_
 
 #include "config.h"
+#include "luaaddon_public.h"
+#include "luaaddonstate.h"
+#include "luacommithistory.h"
+#include "luafileio.h"
+#include "luakeystream.h"
+#include "threadpool.h"
+#include <cstdint>
+#include <fcitx-config/configuration.h>
+#include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/handlertable.h>
+#include <fcitx-utils/i18n.h>
+#include <fcitx-utils/unixfd.h>
 #include <fcitx/addonfactory.h>
 #include <fcitx/addoninfo.h>
 #include <fcitx/addoninstance.h>
 #include <fcitx/addonloader.h>
-#include <string>
-
-#ifdef USE_DLOPEN
+#include <fcitx/instance.h>
+#include <map>
 #include <memory>
-#endif
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
 
 namespace fcitx {
 
+class LuaAddon;
+
+FCITX_CONFIGURATION(
+    LuaAddonLoaderConfig,
+    Option<std::vector<std::string>> sandboxedAddons{
+        this, "SandboxedAddons", _("Addons running in sandbox")};
+    Option<int, IntConstrain> sandboxDeadline{
+        this, "SandboxDeadline",
+        _("Time limit of each call in sandbox (ms)"), 100,
+        IntConstrain(1, 10000)};
+    Option<int, IntConstrain> sandboxLoadDeadline{
+        this, "SandboxLoadDeadline",
+        _("Time limit of loading an addon in sandbox (ms)"), 1000,
+        IntConstrain(1, 60000)};
+    Option<int, IntConstrain> sandboxMemoryLimit{
+        this, "SandboxMemoryLimit", _("Memory limit of sandbox (MB)"), 64,
+        IntConstrain(1, 4096)};
+    Option<int, IntConstrain> slowStartupThreshold{
+        this, "SlowStartupThreshold",
+        _("Warn about addons loading slower than (ms)"), 100,
+        IntConstrain(0, 60000)};
+    Option<std::vector<std::string>> lazyAddons{
+        this, "LazyAddons", _("Addons loaded on first call")};
+    Option<int, IntConstrain> lazyIdleTimeout{
+        this, "LazyIdleTimeout",
+        _("Unload lazily loaded addons after being idle for (s)"), 300,
+        IntConstrain(0, 86400)};
+    Option<std::vector<std::string>> profiledAddons{
+        this, "ProfiledAddons",
+        _("Addons being profiled, the profile is saved once removed")};
+    Option<int, IntConstrain> profilerInterval{
+        this, "ProfilerInterval",
+        _("Lua instructions between two profiler samples"),
+        kProfilerDefaultInterval,
+        IntConstrain(kProfilerMinInterval, 10000000)};);
+
+// Record the key, commit and focus stream of the instance to a file in the
+// format of luakeystream.h, to be replayed by fcitx5-lua-replay. Enabled by
+// setting FCITX_LUA_RECORD to the path of the file. The file contains
+// everything typed, so it is only meant for collecting test data. It is only
+// readable by the user, and nothing about password or sensitive fields is
+// recorded, including their focus changes.
+class KeyStreamRecorder {
+public:
+    KeyStreamRecorder(Instance *instance, const std::string &path);
+    ~KeyStreamRecorder();
+
+private:
+    void record(KeyStreamRecord &record);
+    void flush();
+
+    UnixFD fd_;
+    // Records not written to fd_ yet.
+    std::ostringstream out_;
+    uint64_t start_;
+    std::vector<std::unique_ptr<HandlerTableEntry<EventHandler>>> watchers_;
+};
+
 class LuaAddonLoader : public AddonLoader {
 public:
     LuaAddonLoader();
     std::string type() const override { return "Lua"; }
     AddonInstance *load(const AddonInfo &info, AddonManager *manager) override;
 
+    // Thread pool used to construct lua addon states.
+    ThreadPool &threadPool();
+    LuaCommitHistory *commitHistory() const { return commitHistory_.get(); }
+    LuaFileIO *fileIO() const { return fileIO_.get(); }
+
+    const LuaAddonLoaderConfig &config() const { return config_; }
+    void setConfig(const RawConfig &config);
+    void reloadConfig();
+    // Limits of the addon if it should run in sandbox.
+    std::optional<LuaSandboxOptions>
+    sandboxOptions(const std::string &name) const;
+    // Whether the addon is listed in LazyAddons.
+    bool isLazyAddon(const std::string &name) const;
+    // Whether the addon is listed in ProfiledAddons.
+    bool isProfiledAddon(const std::string &name) const;
+
+    // Called by the lua addons when they are created and destroyed, so the
+    // change of ProfiledAddons is applied to them.
+    void addAddon(LuaAddon *addon);
+    void removeAddon(LuaAddon *addon);
+
+    // Log the time spent to load the addon, called once it is ready.
+    void reportStartup(const std::string &name, const LuaStartupTiming &timing);
+    RawConfig startupReport() const;
+
 #ifdef USE_DLOPEN
     LibraryPtr luaLibrary() const { return luaLibrary_.get(); }
+#else
+    LibraryPtr luaLibrary() const { return nullptr; }
+#endif
 
 private:
+    // Start or stop the profilers of the addons by ProfiledAddons.
+    void updateProfilers();
+
+#ifdef USE_DLOPEN
     std::unique_ptr<Library> luaLibrary_;
-#else
-    LibraryPtr luaLibrary() const { return nullptr; }
 #endif
+    std::unique_ptr<ThreadPool> threadPool_;
+    std::unique_ptr<KeyStreamRecorder> recorder_;
+    std::unique_ptr<LuaCommitHistory> commitHistory_;
+    std::unique_ptr<LuaFileIO> fileIO_;
+    LuaAddonLoaderConfig config_;
+    uint64_t initTime_ = 0;
+    std::map<std::string, LuaStartupTiming> startupTiming_;
+    std::vector<LuaAddon *> addons_;
 };
 
 class LuaAddonLoaderAddon : public AddonInstance {
@@ -41,8 +151,21 @@ public:
     LuaAddonLoaderAddon(AddonManager *manager);
     ~LuaAddonLoaderAddon();
 
+    const Configuration *getConfig() const override {
+        return &loader_->config();
+    }
+    void setConfig(const RawConfig &config) override {
+        loader_->setConfig(config);
+    }
+    void reloadConfig() override { loader_->reloadConfig(); }
+
 private:
+    RawConfig startupReport() { return loader_->startupReport(); }
+    FCITX_ADDON_EXPORT_FUNCTION(LuaAddonLoaderAddon, startupReport);
+
     AddonManager *manager_;
+    // Owned by addon manager.
+    LuaAddonLoader *loader_;
 };
 
 class LuaAddonLoaderFactory : public AddonFactory {
@@ -7,26 +7,44 @@
 #include "luaaddonstate.h"
 #include "base.lua.h"
 #include "luahelper.h"
+#include "luamodulecache.h"
 #include "luastate.h"
 #include "quickphrase_public.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <exception>
 #include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/event.h>
 #include <fcitx-utils/handlertable.h>
 #include <fcitx-utils/standardpaths.h>
 #include <fcitx-utils/stringutils.h>
 #include <fcitx-utils/trackableobject.h>
 #include <fcitx-utils/utf8.h>
 #include <fcitx/addonmanager.h>
+#include <fcitx/candidatelist.h>
 #include <fcitx/event.h>
 #include <fcitx/inputcontext.h>
+#include <fcitx/inputcontextmanager.h>
+#include <fcitx/inputcontextproperty.h>
+#include <fcitx/inputpanel.h>
 #include <fcitx/instance.h>
+#include <fcitx/surroundingtext.h>
+#include <fcitx/text.h>
+#include <fcitx/userinterface.h>
 #include <fcntl.h>
 #include <filesystem>
+#include <fstream>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -119,15 +137,518 @@ void luaToRawConfig(LuaState *state, RawConfig &config) {
     }
 }
 
+// Tables nested deeper than this are converted to nil, which also stops the
+// conversion of self referencing tables.
+constexpr int kMaxLuaValueDepth = 32;
+
+void luaValueToLua(LuaState *state, const LuaValue &value, int depth = 0) {
+    if (const auto *boolean = value.get<bool>()) {
+        lua_pushboolean(state, *boolean);
+    } else if (const auto *integer = value.get<int64_t>()) {
+        lua_pushinteger(state, *integer);
+    } else if (const auto *number = value.get<double>()) {
+        lua_pushnumber(state, *number);
+    } else if (const auto *str = value.get<std::string>()) {
+        lua_pushlstring(state, str->data(), str->size());
+    } else if (depth >= kMaxLuaValueDepth || !lua_checkstack(state, 3)) {
+        lua_pushnil(state);
+    } else if (const auto *array = value.get<LuaValueArray>()) {
+        lua_createtable(state, array->size(), 0);
+        for (size_t i = 0; i < array->size(); i++) {
+            luaValueToLua(state, (*array)[i], depth + 1);
+            lua_rawseti(state, -2, i + 1);
+        }
+    } else if (const auto *map = value.get<LuaValueMap>()) {
+        lua_createtable(state, 0, map->size());
+        for (const auto &[key, item] : *map) {
+            lua_pushlstring(state, key.data(), key.size());
+            luaValueToLua(state, item, depth + 1);
+            lua_rawset(state, -3);
+        }
+    } else {
+        lua_pushnil(state);
+    }
+}
+
+LuaValue luaToLuaValue(LuaState *state, int index, int depth = 0) {
+    switch (lua_type(state, index)) {
+    case LUA_TBOOLEAN:
+        return static_cast<bool>(lua_toboolean(state, index));
+    case LUA_TNUMBER:
+        if (lua_isinteger(state, index)) {
+            return static_cast<int64_t>(lua_tointeger(state, index));
+        }
+        return static_cast<double>(lua_tonumber(state, index));
+    case LUA_TSTRING: {
+        size_t len;
+        const char *str = lua_tolstring(state, index, &len);
+        return std::string(str, len);
+    }
+    case LUA_TTABLE:
+        break;
+    default:
+        return {};
+    }
+    if (depth >= kMaxLuaValueDepth || !lua_checkstack(state, 3)) {
+        return {};
+    }
+    if (index < 0) {
+        index = lua_gettop(state) + index + 1;
+    }
+
+    // A table is a sequence if all of its keys are 1..n.
+    size_t count = 0;
+    lua_pushnil(state);
+    while (lua_next(state, index) != 0) {
+        ++count;
+        lua_pop(state, 1);
+    }
+    if (count == lua_rawlen(state, index)) {
+        LuaValueArray array;
+        array.reserve(count);
+        for (size_t i = 1; i <= count; i++) {
+            lua_rawgeti(state, index, i);
+            if (lua_type(state, -1) == LUA_TNIL) {
+                lua_pop(state, 1);
+                break;
+            }
+            array.push_back(luaToLuaValue(state, -1, depth + 1));
+            lua_pop(state, 1);
+        }
+        if (array.size() == count) {
+            return array;
+        }
+    }
+
+    LuaValueMap map;
+    lua_pushnil(state);
+    while (lua_next(state, index) != 0) {
+        std::string key;
+        if (lua_type(state, -2) == LUA_TSTRING) {
+            size_t len;
+            const char *str = lua_tolstring(state, -2, &len);
+            key.assign(str, len);
+        } else if (lua_isinteger(state, -2)) {
+            // Don't use lua_tolstring here, it would change the key in place
+            // and confuse lua_next.
+            key = std::to_string(
+                static_cast<int64_t>(lua_tointeger(state, -2)));
+        } else {
+            // Float, boolean and other keys have no string form that maps
+            // back to the same key, don't drop them silently.
+            throw std::runtime_error(
+                "Table key must be a string or an integer.");
+        }
+        map.emplace(std::move(key), luaToLuaValue(state, -1, depth + 1));
+        lua_pop(state, 1);
+    }
+    return map;
+}
+
+int writeBytecode(lua_State * /*unused*/, const void *data, size_t size,
+                  void *bytecode) {
+    static_cast<std::string *>(bytecode)->append(
+        static_cast<const char *>(data), size);
+    return 0;
+}
+
+// Number of instructions between the checks of the sandbox deadline.
+constexpr int kSandboxHookCount = 1000;
+
+// Remove everything that may load native code, binary chunks, access files or
+// affect the whole process, and the searchers of package.path and
+// package.cpath. pcall and friends rethrow the error of a missed deadline, so
+// the sandbox can't keep running by catching it. The function telling whether
+// the deadline is missed is passed as the argument.
+constexpr char kSandboxSetup[] = R"(
+local expired = ...
+local searchers = package.searchers or package.loaders
+for i = #searchers, 3, -1 do
+    searchers[i] = nil
+end
+package.loadlib = nil
+package.cpath = ""
+for name in pairs(package.loaded) do
+    if name == "ffi" or name == "debug" or name:match("^jit") then
+        package.loaded[name] = nil
+    end
+end
+package.preload.ffi = nil
+jit = nil
+debug = nil
+string.dump = nil
+os.exit = nil
+os.execute = nil
+os.remove = nil
+os.rename = nil
+os.tmpname = nil
+io.open = nil
+io.popen = nil
+io.lines = nil
+io.input = nil
+io.output = nil
+
+local rawload, rawloadfile = load, loadfile
+load = function(chunk, chunkname, _, ...)
+    return rawload(chunk, chunkname, "t", ...)
+end
+if loadstring then
+    loadstring = load
+end
+loadfile = function(filename, _, ...)
+    return rawloadfile(filename, "t", ...)
+end
+dofile = function(filename)
+    return assert(loadfile(filename))()
+end
+
+local function rethrowExpired(success, ...)
+    if not success and expired() then
+        error((...), 0)
+    end
+    return success, ...
+end
+local rawpcall, rawxpcall, rawresume = pcall, xpcall, coroutine.resume
+pcall = function(...)
+    return rethrowExpired(rawpcall(...))
+end
+xpcall = function(...)
+    return rethrowExpired(rawxpcall(...))
+end
+coroutine.resume = function(...)
+    return rethrowExpired(rawresume(...))
+end
+)";
+
+void *sandboxAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    auto *allocator = static_cast<LuaSandboxAllocator *>(ud);
+    // osize is the type of object when ptr is null.
+    const size_t oldSize = ptr ? osize : 0;
+    if (allocator->enforced && nsize > oldSize &&
+        allocator->used - oldSize + nsize > allocator->limit) {
+        return nullptr;
+    }
+    void *result = allocator->alloc(allocator->ud, ptr, osize, nsize);
+    if (result || nsize == 0) {
+        allocator->used = allocator->used - oldSize + nsize;
+    }
+    return result;
+}
+
+constexpr char kUIMetatable[] = "fcitx.UI";
+constexpr char kGCSentinelMetatable[] = "fcitx.GCSentinel";
+constexpr char kBufferMetatable[] = "fcitx.Buffer";
+constexpr int kDefaultDumpDepth = 16;
+// Bound of the recursion of dump, which runs on the C stack.
+constexpr int kMaxDumpDepth = 1000;
+
+// Grow the buffer to hold size bytes, without raising a lua error. The
+// memory is charged to the allocator of sandbox, so buffers share the memory
+// limit with the lua state.
+bool reserveBuffer(LuaBuffer &buffer, size_t size,
+                   LuaSandboxAllocator *allocator) {
+    if (size <= buffer.data.capacity()) {
+        return true;
+    }
+    size_t capacity = std::max(size, buffer.data.capacity() * 2);
+    if (allocator && allocator->enforced) {
+        if (size > allocator->limit ||
+            allocator->used - buffer.charged > allocator->limit - size) {
+            return false;
+        }
+        // Grow less than usual near the limit.
+        capacity = std::min(capacity, allocator->limit - allocator->used +
+                                          buffer.charged);
+    }
+    try {
+        // Reserving on an empty string allocates the exact capacity.
+        std::string data;
+        data.reserve(capacity);
+        data.append(buffer.data);
+        buffer.data.swap(data);
+    } catch (const std::exception &) {
+        return false;
+    }
+    if (allocator) {
+        allocator->used =
+            allocator->used - buffer.charged + buffer.data.capacity();
+    }
+    buffer.charged = buffer.data.capacity();
+    return true;
+}
+
+// Output of dumpValue. Appending never raises a lua error, which would skip
+// the rest of the dump, so the failure is recorded and raised once the dump
+// returns.
+struct DumpOutput {
+    LuaBuffer *buffer;
+    LuaSandboxAllocator *allocator;
+    const char *error = nullptr;
+
+    void append(std::string_view str) {
+        if (error) {
+            return;
+        }
+        if (!reserveBuffer(*buffer, buffer->data.size() + str.size(),
+                           allocator)) {
+            error = "Not enough memory for dump";
+            return;
+        }
+        buffer->data.append(str);
+    }
+    void push_back(char c) { append(std::string_view(&c, 1)); }
+};
+
+void appendQuoted(DumpOutput &out, std::string_view str) {
+    out.push_back('"');
+    for (char c : str) {
+        switch (c) {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        case '\r':
+            out.append("\\r");
+            break;
+        case '\t':
+            out.append("\\t");
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+                char escaped[5];
+                snprintf(escaped, sizeof(escaped), "\\%03d",
+                         static_cast<unsigned char>(c));
+                out.append(escaped);
+            } else {
+                out.push_back(c);
+            }
+            break;
+        }
+    }
+    out.push_back('"');
+}
+
+// Key of a table being dumped, ordered by numbers, strings and then the
+// others in the order of traversal.
+struct DumpKey {
+    int rank;
+    lua_Number number;
+    std::string_view string;
+    // Position of the key and value in the temporary table.
+    int index;
+
+    bool operator<(const DumpKey &other) const {
+        if (rank != other.rank) {
+            return rank < other.rank;
+        }
+        if (rank == 0 && number != other.number) {
+            return number < other.number;
+        }
+        if (rank == 1 && string != other.string) {
+            return string < other.string;
+        }
+        return index < other.index;
+    }
+};
+
+// Tables being dumped, from the innermost one.
+struct DumpVisiting {
+    const void *table;
+    const DumpVisiting *parent;
+};
+
+// Everything that lives across the calls to lua is either kept in the lua
+// state or trivially destructible, since a lua error, e.g. running out of
+// memory, doesn't unwind the C++ stack.
+void dumpValue(LuaState *state, int index, int depth, DumpOutput &out,
+               const DumpVisiting *visiting) {
+    switch (lua_type(state, index)) {
+    case LUA_TNIL:
+        out.append("nil");
+        return;
+    case LUA_TBOOLEAN:
+        out.append(lua_toboolean(state, index) ? "true" : "false");
+        return;
+    case LUA_TNUMBER: {
+        // Converting the number in place would break lua_next.
+        lua_pushvalue(state, index);
+        size_t length = 0;
+        const char *str = lua_tolstring(state, -1, &length);
+        out.append(std::string_view(str, length));
+        lua_pop(state, 1);
+        return;
+    }
+    case LUA_TSTRING: {
+        size_t length = 0;
+        const char *str = lua_tolstring(state, index, &length);
+        appendQuoted(out, std::string_view(str, length));
+        return;
+    }
+    case LUA_TTABLE:
+        break;
+    default: {
+        lua_getglobal(state, "tostring");
+        lua_pushvalue(state, index);
+        size_t length = 0;
+        const char *str = nullptr;
+        // __tostring may fail, which shouldn't fail the whole dump.
+        if (lua_pcall(state, 1, 1, 0) == LUA_OK &&
+            (str = lua_tolstring(state, -1, &length))) {
+            out.append(std::string_view(str, length));
+        } else {
+            out.append("<error>");
+        }
+        lua_pop(state, 1);
+        return;
+    }
+    }
+
+    const void *table = lua_topointer(state, index);
+    for (const auto *parent = visiting; parent; parent = parent->parent) {
+        if (parent->table == table) {
+            out.append("<cycle>");
+            return;
+        }
+    }
+    if (depth <= 0) {
+        out.append("{...}");
+        return;
+    }
+    if (!lua_checkstack(state, 8)) {
+        out.error = "Table is nested too deep";
+        return;
+    }
+    // Keep the keys and values in a temporary table, so they stay alive and
+    // can be pushed again in the sorted order.
+    lua_createtable(state, 0, 0);
+    const int entries = lua_gettop(state);
+    int size = 0;
+    lua_pushnil(state);
+    while (lua_next(state, index)) {
+        lua_rawseti(state, entries, size * 2 + 2);
+        lua_pushvalue(state, -1);
+        lua_rawseti(state, entries, size * 2 + 1);
+        ++size;
+    }
+    if (size == 0) {
+        out.append("{}");
+        lua_pop(state, 1);
+        return;
+    }
+
+    auto *keys = static_cast<DumpKey *>(
+        lua_newuserdata(state, sizeof(DumpKey) * size));
+    for (int i = 0; i < size; ++i) {
+        DumpKey key{2, 0, {}, i * 2 + 1};
+        lua_rawgeti(state, entries, key.index);
+        if (lua_type(state, -1) == LUA_TNUMBER) {
+            key.rank = 0;
+            key.number = lua_tonumber(state, -1);
+        } else if (lua_type(state, -1) == LUA_TSTRING) {
+            size_t length = 0;
+            const char *str = lua_tolstring(state, -1, &length);
+            key.rank = 1;
+            // The string is referenced by the temporary table.
+            key.string = std::string_view(str, length);
+        }
+        lua_pop(state, 1);
+        keys[i] = key;
+    }
+    std::sort(keys, keys + size);
+
+    const DumpVisiting current{table, visiting};
+    out.append("{ ");
+    for (int i = 0; i < size && !out.error; ++i) {
+        if (i != 0) {
+            out.append(", ");
+        }
+        out.push_back('[');
+        lua_rawgeti(state, entries, keys[i].index);
+        dumpValue(state, lua_gettop(state), depth - 1, out, &current);
+        out.append("] = ");
+        lua_rawgeti(state, entries, keys[i].index + 1);
+        dumpValue(state, lua_gettop(state), depth - 1, out, &current);
+        lua_pop(state, 2);
+    }
+    out.append(" }");
+    lua_pop(state, 2);
+}
+
+class LuaCandidateWord : public CandidateWord {
+public:
+    LuaCandidateWord(TrackableObjectReference<LuaAddonState> state,
+                     std::string text,
+                     std::function<void(LuaAddonState *, InputContext *,
+                                        const std::string &)>
+                         callback)
+        : CandidateWord(Text(text)), state_(std::move(state)),
+          text_(std::move(text)), callback_(std::move(callback)) {}
+
+    void select(InputContext *inputContext) const override {
+        if (auto *state = state_.get()) {
+            callback_(state, inputContext, text_);
+        }
+    }
+
+private:
+    TrackableObjectReference<LuaAddonState> state_;
+    std::string text_;
+    std::function<void(LuaAddonState *, InputContext *, const std::string &)>
+        callback_;
+};
+
 } // namespace
 
+void EventWatcher::addPending(InputContext *ic) {
+    for (const auto &pending : pending_) {
+        if (pending.get() == ic) {
+            return;
+        }
+    }
+    pending_.push_back(ic->watch());
+    if (!flushEvent_ || flushEvent_->isEnabled()) {
+        return;
+    }
+    if (interval_) {
+        static_cast<EventSourceTime *>(flushEvent_.get())
+            ->setTime(now(CLOCK_MONOTONIC) + interval_);
+    }
+    flushEvent_->setOneShot();
+}
+
 LuaAddonState::LuaAddonState(LibraryPtr luaLibrary, const std::string &name,
-                             const std::string &library, AddonManager *manager)
-    : instance_(manager->instance()),
-      state_(std::make_unique<LuaState>(luaLibrary)) {
+                             const std::string &library, AddonManager *manager,
+                             bool deferRegistration,
+                             std::optional<LuaSandboxOptions> sandbox,
+                             LuaCommitHistory *commitHistory,
+                             LuaFileIO *fileIO)
+    : name_(name), instance_(manager->instance()),
+      commitHistory_(commitHistory),
+      fileIO_(fileIO),
+      deferRegistration_(deferRegistration), sandbox_(sandbox) {
+    auto phaseStart = now(CLOCK_MONOTONIC);
+    // Return the time since the last phase ended.
+    auto endPhase = [&phaseStart]() {
+        auto current = now(CLOCK_MONOTONIC);
+        return current - std::exchange(phaseStart, current);
+    };
+    state_ = std::make_unique<LuaState>(luaLibrary);
     if (!state_) {
         throw std::runtime_error("Failed to create lua state.");
     }
+    if (sandbox_) {
+        allocator_ = std::make_unique<LuaSandboxAllocator>();
+        allocator_->alloc = lua_getallocf(state_, &allocator_->ud);
+        allocator_->used = heapSize();
+        allocator_->limit = sandbox_->memoryLimit;
+        lua_setallocf(state_, &sandboxAlloc, allocator_.get());
+    }
+    startupTiming_.createState = endPhase();
 
     auto path = StandardPaths::global().locate(
         StandardPathsType::PkgData,
@@ -138,21 +659,33 @@ LuaAddonState::LuaAddonState(LibraryPtr luaLibrary, const std::string &name,
     LuaAddonState **ppmodule = reinterpret_cast<LuaAddonState **>(
         lua_newuserdata(state_, sizeof(LuaAddonState *)));
     *ppmodule = this;
-    lua_setglobal(state_, kLuaModuleName);
+    lua_setfield(state_, LUA_REGISTRYINDEX, kLuaModuleName);
     luaL_openlibs(state_);
+    installModuleSearcher();
+    if (sandbox_) {
+        setupSandbox();
+    }
+    startupTiming_.openLibs = endPhase();
     auto open_fcitx_core = [](lua_State *state) {
         static const luaL_Reg fcitxlib[] = {
             {"version", &LuaAddonState::version},
             {"lastCommit", &LuaAddonState::lastCommit},
+            {"commitHistory", &LuaAddonState::commitHistory},
             {"splitString", &LuaAddonState::splitString},
             {"log", &LuaAddonState::log},
             {"watchEvent", &LuaAddonState::watchEvent},
+            {"watchEventCoalesced", &LuaAddonState::watchEventCoalesced},
+            {"watchEventObject", &LuaAddonState::watchEventObject},
+            {"watchSurroundingTextDelta",
+             &LuaAddonState::watchSurroundingTextDelta},
             {"unwatchEvent", &LuaAddonState::unwatchEvent},
             {"currentInputMethod", &LuaAddonState::currentInputMethod},
             {"setCurrentInputMethod", &LuaAddonState::setCurrentInputMethod},
             {"currentProgram", &LuaAddonState::currentProgram},
             {"addConverter", &LuaAddonState::addConverter},
             {"removeConverter", &LuaAddonState::removeConverter},
+            {"addPreeditFilter", &LuaAddonState::addPreeditFilter},
+            {"removePreeditFilter", &LuaAddonState::removePreeditFilter},
             {"addQuickPhraseHandler", &LuaAddonState::addQuickPhraseHandler},
             {"removeQuickPhraseHandler",
              &LuaAddonState::removeQuickPhraseHandler},
@@ -160,221 +693,1630 @@ LuaAddonState::LuaAddonState(LibraryPtr luaLibrary, const std::string &name,
             {"standardPathLocate", &LuaAddonState::standardPathLocate},
             {"UTF16ToUTF8", &LuaAddonState::UTF16ToUTF8},
             {"UTF8ToUTF16", &LuaAddonState::UTF8ToUTF16},
+            {"openDictionary", &LuaAddonState::openDictionary},
+            {"readFileAsync", &LuaAddonState::readFileAsync},
+            {"readLinesAsync", &LuaAddonState::readLinesAsync},
+            {"writeFileAsync", &LuaAddonState::writeFileAsync},
+            {"openStore", &LuaAddonState::openStore},
+            {"icData", &LuaAddonState::icData},
+            {"surroundingText", &LuaAddonState::surroundingText},
+            {"ui", &LuaAddonState::ui},
+            {"buffer", &LuaAddonState::buffer},
+            {"dump", &LuaAddonState::dump},
+            {"suspendedHandlers", &LuaAddonState::suspendedHandlers},
+            {"resumeHandler", &LuaAddonState::resumeHandler},
+            {"setErrorPolicy", &LuaAddonState::setErrorPolicy},
+            {nullptr, nullptr},
         };
         auto *addon = GetLuaAddonState(state);
         luaL_newlib(addon->state_, fcitxlib);
         return 1;
     };
+    auto open_fcitx_text = [](lua_State *state) {
+        static const luaL_Reg textlib[] = {
+            {"trim", &LuaAddonState::textTrim},
+            {"trimLeft", &LuaAddonState::textTrimLeft},
+            {"trimRight", &LuaAddonState::textTrimRight},
+            {"length", &LuaAddonState::textLength},
+            {"sub", &LuaAddonState::textSub},
+            {"width", &LuaAddonState::textWidth},
+            {"scan", &LuaAddonState::textScan},
+            {nullptr, nullptr},
+        };
+        auto *addon = GetLuaAddonState(state);
+        luaL_newlib(addon->state_, textlib);
+        return 1;
+    };
     auto open_fcitx = [](lua_State *state) {
         auto *s = GetLuaAddonState(state)->state_.get();
         if (int rv = luaL_loadstring(s, baseLua) ||
-                     lua_pcallk(s, 0, LUA_MULTRET, 0, 0, nullptr);
+                     lua_pcall(s, 0, LUA_MULTRET, 0);
             rv != LUA_OK) {
             LuaPError(rv, "luaL_loadbuffer() failed");
             LuaPrintError(GetLuaAddonState(state)->state_.get());
             return 0;
         }
         return 1;
-    };
-    luaL_requiref(state_, "fcitx.core", open_fcitx_core, false);
-    luaL_requiref(state_, "fcitx", open_fcitx, false);
-    if (int rv = luaL_loadfile(state_, path.string().c_str()); rv != 0) {
-        LuaPError(rv, "luaL_loadfilex() failed");
-        LuaPrintError(*this);
-        throw std::runtime_error("Failed to load lua source.");
+    };
+    luaL_requiref(state_, "fcitx.core", open_fcitx_core, false);
+    luaL_requiref(state_, "fcitx.text", open_fcitx_text, false);
+    luaL_requiref(state_, "fcitx", open_fcitx, false);
+    startupTiming_.loadBase = endPhase();
+    if (int rv = luaL_loadfilex(state_, path.string().c_str(), nullptr);
+        rv != 0) {
+        LuaPError(rv, "luaL_loadfilex() failed");
+        LuaPrintError(*this);
+        throw std::runtime_error("Failed to load lua source.");
+    }
+    startupTiming_.loadFile = endPhase();
+
+    // Loading may take long, so it has a deadline of its own.
+    if (sandbox_) {
+        allocator_->enforced = true;
+        deadline_ = now(CLOCK_MONOTONIC) + sandbox_->loadDeadline;
+    }
+    int rv = lua_pcall(state_, 0, 0, 0);
+    if (sandbox_) {
+        allocator_->enforced = false;
+        deadline_ = 0;
+        if (deadlineExceeded_) {
+            throw std::runtime_error(
+                "Lua addon missed the load deadline of sandbox.");
+        }
+    }
+    if (rv != 0) {
+        LuaPError(rv, "lua_pcall() failed");
+        LuaPrintError(*this);
+        throw std::runtime_error("Failed to run lua source.");
+    }
+
+    startupTiming_.execute = endPhase();
+    startupTiming_.heapSize = heapSize();
+
+    // Created after everything that may throw, so it is never finalized
+    // when the state is closed by a partially constructed object.
+    newGCSentinel();
+}
+
+LuaAddonState::~LuaAddonState() {
+    flushStores(true);
+    if (commitHistoryRef_) {
+        commitHistory_->unref();
+    }
+    // Sentinel finalizer would create a new one on the closing state.
+    luaL_getmetatable(state_, kGCSentinelMetatable);
+    lua_pushnil(state_);
+    lua_setfield(state_, -2, "__gc");
+    lua_pop(state_, 1);
+}
+
+bool LuaAddonState::hasRegistrations() const {
+    return !eventHandler_.empty() || !converter_.empty() ||
+           !preeditFilter_.empty() || !quickphraseHandler_.empty() ||
+           surroundingTextDeltaHandler_ || icDataFactory_ ||
+           !deferredHandlers_.empty() || pendingFileCallbacks_;
+}
+
+void LuaAddonState::registerHandler(std::function<void()> registration) {
+    if (deferRegistration_) {
+        deferredHandlers_.push_back(std::move(registration));
+    } else {
+        registration();
+    }
+}
+
+size_t LuaAddonState::heapSize() {
+    return static_cast<size_t>(lua_gc(state_, LUA_GCCOUNT, 0)) * 1024 +
+           lua_gc(state_, LUA_GCCOUNTB, 0);
+}
+
+void LuaAddonState::setupSandbox() {
+    // Before the jit module is removed by the sandbox.
+    setJitEnabled(false);
+    int rv = luaL_loadstring(state_, kSandboxSetup);
+    if (rv == LUA_OK) {
+        lua_pushcclosure(state_, &LuaAddonState::sandboxExpired, 0);
+        rv = lua_pcall(state_, 1, 0, 0);
+    }
+    if (rv != LUA_OK) {
+        LuaPError(rv, "Failed to setup sandbox");
+        LuaPrintError(*this);
+        throw std::runtime_error("Failed to setup sandbox.");
+    }
+    updateHook();
+}
+
+int LuaAddonState::sandboxExpired(lua_State *lua) {
+    auto *addon = GetLuaAddonState(lua);
+    lua_pushboolean(addon->state_, addon->deadline_ != 0 &&
+                                       addon->deadlineExceeded_);
+    return 1;
+}
+
+void LuaAddonState::updateHook() {
+    int count = sandbox_ ? kSandboxHookCount : 0;
+    if (profiler_ && (!count || profiler_->interval() < count)) {
+        count = profiler_->interval();
+    }
+    if (count) {
+        lua_sethook(state_, &LuaAddonState::countHook, LUA_MASKCOUNT, count);
+    } else {
+        lua_sethook(state_, nullptr, 0, 0);
+    }
+    hookCount_ = count;
+}
+
+void LuaAddonState::setJitEnabled(bool enabled) {
+#ifdef USE_LUAJIT
+    // Count hook is not called in the code compiled by LuaJIT, so it needs
+    // to be turned off for sandbox and profiler.
+    const char *code = enabled ? "jit.on()" : "jit.off() jit.flush()";
+    if (int rv = luaL_loadstring(state_, code) || lua_pcall(state_, 0, 0, 0);
+        rv != LUA_OK) {
+        LuaPError(rv, "Failed to change JIT mode");
+        LuaPrintError(*this);
+        lua_pop(state_, lua_gettop(state_));
+    }
+#else
+    FCITX_UNUSED(enabled);
+#endif
+}
+
+void LuaAddonState::startProfiler(int interval) {
+    // Sandbox keeps JIT off, and has no jit module to change it.
+    if (!profiler_ && !sandbox_) {
+        setJitEnabled(false);
+    }
+    profiler_ = std::make_unique<LuaProfiler>(interval);
+    updateHook();
+}
+
+std::unique_ptr<LuaProfiler> LuaAddonState::stopProfiler() {
+    auto profiler = std::move(profiler_);
+    if (profiler) {
+        updateHook();
+        // Sandbox keeps JIT off.
+        if (!sandbox_) {
+            setJitEnabled(true);
+        }
+    }
+    return profiler;
+}
+
+void LuaAddonState::countHook(lua_State *lua, lua_Debug * /*debug*/) {
+    auto *addon = GetLuaAddonState(lua);
+    auto &state = *addon->state_;
+    // updateHook only changes the main thread, a coroutine runs the hook of
+    // the time it was created until it is synced here.
+    const int count = state.lua_gethookcountOnThread(lua);
+    if (count != addon->hookCount_) {
+        if (addon->hookCount_) {
+            state.lua_sethookOnThread(lua, &LuaAddonState::countHook,
+                                      LUA_MASKCOUNT, addon->hookCount_);
+        } else {
+            state.lua_sethookOnThread(lua, nullptr, 0, 0);
+        }
+    }
+    if (addon->profiler_) {
+        addon->profiler_->tick(&state, lua, count);
+    }
+    if (!addon->deadline_ || now(CLOCK_MONOTONIC) < addon->deadline_) {
+        return;
+    }
+    addon->deadlineExceeded_ = true;
+    addon->state_->luaL_errorOnThread(lua, "Sandbox deadline exceeded");
+}
+
+int LuaAddonState::protectedCall(int nargs, int nresults) {
+    // Nested calls, e.g. a handler triggered by fcitx.commitString, share the
+    // deadline of the outermost call.
+    if (!sandbox_ || deadline_) {
+        return lua_pcall(state_, nargs, nresults, 0);
+    }
+    deadline_ = now(CLOCK_MONOTONIC) + sandbox_->deadline;
+    allocator_->enforced = true;
+    int rv = lua_pcall(state_, nargs, nresults, 0);
+    allocator_->enforced = false;
+    deadline_ = 0;
+    if (deadlineExceeded_ && !degraded_) {
+        degraded_ = true;
+        FCITX_LUA_ERROR() << "Lua addon missed the deadline of sandbox, it is "
+                             "disabled until reloaded.";
+    }
+    return rv;
+}
+
+void LuaAddonState::newGCSentinel() {
+    lua_newuserdata(state_, 0);
+    if (luaL_newmetatable(state_, kGCSentinelMetatable)) {
+        lua_pushcclosure(state_, &LuaAddonState::gcSentinel, 0);
+        lua_setfield(state_, -2, "__gc");
+    }
+    lua_setmetatable(state_, -2);
+    lua_pop(state_, 1);
+}
+
+int LuaAddonState::gcSentinel(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    ++state->gcCount_;
+    state->newGCSentinel();
+    return 0;
+}
+
+void LuaAddonState::installModuleSearcher() {
+    lua_getglobal(state_, "package");
+#ifdef USE_LUAJIT
+    lua_getfield(state_, -1, "loaders");
+#else
+    lua_getfield(state_, -1, "searchers");
+#endif
+    for (auto i = lua_rawlen(state_, -1); i >= 2; --i) {
+        lua_rawgeti(state_, -1, i);
+        lua_rawseti(state_, -2, i + 1);
+    }
+    lua_pushcclosure(state_, &LuaAddonState::searchModule, 0);
+    lua_rawseti(state_, -2, 2);
+    lua_pop(state_, 2);
+}
+
+int LuaAddonState::searchModule(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    size_t length = 0;
+    const char *name = luaL_checklstring(state->state_, 1, &length);
+    int nresults = state->loadModule(std::string_view(name, length));
+    if (nresults < 0) {
+        return lua_error(state->state_);
+    }
+    return nresults;
+}
+
+int LuaAddonState::loadModule(std::string_view name) {
+    auto start = now(CLOCK_MONOTONIC);
+    std::string file(name);
+    std::replace(file.begin(), file.end(), '.', '/');
+    std::filesystem::path path;
+    for (const char *suffix : {".lua", "/init.lua"}) {
+        path = StandardPaths::global().locate(
+            StandardPathsType::PkgData,
+            stringutils::joinPath("lua", file + suffix));
+        if (!path.empty()) {
+            break;
+        }
+    }
+    if (path.empty()) {
+        std::string error = "no module '" + std::string(name) +
+                            "' in fcitx lua directories";
+#ifdef USE_LUAJIT
+        // Lua 5.1 searchers need to format the message themselves.
+        error.insert(0, "\n\t");
+#endif
+        lua_pushlstring(state_, error.data(), error.size());
+        return 1;
+    }
+
+    auto chunkName = "@" + path.string();
+    bool cached = false;
+    std::string error;
+    // Called from the searcher, an exception must not leave this function.
+    LuaBytecode bytecode;
+    try {
+        bytecode = LuaModuleCache::global().get(
+            path,
+            [this, &path, &chunkName, &error]() -> LuaBytecode {
+                std::ifstream in(path, std::ios::binary);
+                if (!in) {
+                    error = "cannot open " + path.string();
+                    return nullptr;
+                }
+                std::string source{std::istreambuf_iterator<char>(in),
+                                   std::istreambuf_iterator<char>()};
+                // Compiled in a scratch state without the sandbox allocator.
+                // A lua error raised in state_, e.g. out of memory, would
+                // jump over the cache and leave the callers waiting for this
+                // module blocked forever.
+                LuaState compiler(state_->library());
+                if (compiler.luaL_loadbufferx(source.data(), source.size(),
+                                              chunkName.data(),
+                                              "t") != LUA_OK) {
+                    size_t length = 0;
+                    const char *message = compiler.lua_tolstring(-1, &length);
+                    error = message ? std::string(message, length)
+                                    : "cannot compile " + path.string();
+                    return nullptr;
+                }
+                auto bytecode = std::make_shared<std::string>();
+#ifdef USE_LUAJIT
+                compiler.lua_dump(&writeBytecode, bytecode.get());
+#else
+                compiler.lua_dump(&writeBytecode, bytecode.get(), 0);
+#endif
+                return bytecode;
+            },
+            cached);
+    } catch (const std::exception &e) {
+        error = e.what();
+    }
+    if (!bytecode) {
+        lua_pushlstring(state_, error.data(), error.size());
+        return -1;
+    }
+    if (luaL_loadbufferx(state_, bytecode->data(), bytecode->size(),
+                         chunkName.data(), "b") != LUA_OK) {
+        return -1;
+    }
+
+    auto &info = moduleLoadInfo_[std::string(name)];
+    info.time = now(CLOCK_MONOTONIC) - start;
+    info.cached = cached;
+    FCITX_LUA_DEBUG() << "Loaded module " << name << " from " << path
+                      << (cached ? " (cached)" : "") << " in " << info.time
+                      << "us";
+    lua_pushstring(state_, path.string().data());
+    return 2;
+}
+
+void LuaAddonState::registerDeferredHandlers() {
+    auto start = now(CLOCK_MONOTONIC);
+    deferRegistration_ = false;
+    auto handlers = std::move(deferredHandlers_);
+    for (const auto &handler : handlers) {
+        handler();
+    }
+    startupTiming_.registerHandlers = now(CLOCK_MONOTONIC) - start;
+}
+
+bool LuaAddonState::useCommitHistory() {
+    if (!commitHistory_) {
+        return false;
+    }
+    if (!commitHistoryRequested_) {
+        commitHistoryRequested_ = true;
+        registerHandler([this]() {
+            commitHistory_->ref();
+            commitHistoryRef_ = true;
+        });
+    }
+    return commitHistoryRef_;
+}
+
+std::tuple<std::string_view> LuaAddonState::lastCommitImpl() {
+    if (!commitHistory_) {
+        return {""};
+    }
+    return commitHistory_->lastCommit();
+}
+
+std::tuple<std::optional<std::string_view>>
+LuaAddonState::commitHistoryImpl(int64_t n) {
+    if (!useCommitHistory() || n < 1) {
+        return {std::nullopt};
+    }
+    if (const auto *text = commitHistory_->at(currentInputContext(), n)) {
+        return {*text};
+    }
+    return {std::nullopt};
+}
+
+std::tuple<> LuaAddonState::logImpl(std::string_view msg) {
+    FCITX_LUA_DEBUG() << msg;
+    return {};
+}
+
+template <typename T>
+std::unique_ptr<HandlerTableEntry<EventHandler>> LuaAddonState::watchEvent(
+    EventType type, int id,
+    std::function<int(std::unique_ptr<LuaState> &, T &)> pushArguments,
+    std::function<void(std::unique_ptr<LuaState> &, T &)> handleReturnValue) {
+    return instance_->watchEvent(
+        type, EventWatcherPhase::PreInputMethod,
+        [this, id, pushArguments, handleReturnValue](Event &event_) {
+            auto iter = eventHandler_.find(id);
+            int argc = 0;
+            if (iter == eventHandler_.end() || isHandlerSuspended(id)) {
+                return;
+            }
+            auto &event = static_cast<T &>(event_);
+            ScopedICSetter setter(inputContext_, event.inputContext()->watch());
+            ScopedSetter<Event *> eventSetter(currentEvent_, &event_);
+            ScopedSetter<uint64_t> serialSetter(currentEventSerial_,
+                                                ++eventSerial_);
+            lua_getglobal(state_, iter->second.function().data());
+            if (iter->second.eventObject()) {
+                argc = pushEventObject();
+            } else if (pushArguments) {
+                argc = pushArguments(state_, event);
+            }
+            int rv = callHandler(id, argc, 1);
+            if (rv == LUA_OK && lua_gettop(state_) >= 1) {
+                if (handleReturnValue) {
+                    handleReturnValue(state_, event);
+                }
+            }
+            lua_pop(state_, lua_gettop(state_));
+            flushUI();
+        });
+}
+
+std::tuple<int> LuaAddonState::addEventWatcher(int eventType,
+                                               std::string_view function,
+                                               bool eventObject) {
+    int newId = currentId_ + 1;
+    auto type = static_cast<EventType>(eventType);
+    std::function<std::unique_ptr<HandlerTableEntry<EventHandler>>()> watch;
+
+    switch (type) {
+    case EventType::InputContextCreated:
+    case EventType::InputContextDestroyed:
+    case EventType::InputContextFocusIn:
+    case EventType::InputContextFocusOut:
+    case EventType::InputContextSurroundingTextUpdated:
+    case EventType::InputContextCursorRectChanged:
+    case EventType::InputContextUpdatePreedit:
+        watch = [this, type, newId]() {
+            return watchEvent<InputContextEvent>(type, newId);
+        };
+        break;
+    case EventType::InputContextKeyEvent:
+        watch = [this, newId]() {
+            return watchEvent<KeyEvent>(
+                EventType::InputContextKeyEvent, newId,
+                [](std::unique_ptr<LuaState> &state, KeyEvent &event) -> int {
+                    lua_pushinteger(state, event.key().sym());
+                    lua_pushinteger(state, event.key().states());
+                    lua_pushboolean(state, event.isRelease());
+                    return 3;
+                },
+                [](std::unique_ptr<LuaState> &state, KeyEvent &event) {
+                    auto b = lua_toboolean(state, -1);
+                    if (b) {
+                        event.filterAndAccept();
+                    }
+                });
+        };
+        break;
+    case EventType::InputContextCommitString:
+        watch = [this, newId]() {
+            return watchEvent<CommitStringEvent>(
+                EventType::InputContextCommitString, newId,
+                [](std::unique_ptr<LuaState> &state,
+                   CommitStringEvent &event) -> int {
+                    lua_pushstring(state, event.text().c_str());
+                    return 1;
+                });
+        };
+        break;
+    case EventType::InputContextInputMethodActivated:
+    case EventType::InputContextInputMethodDeactivated:
+        watch = [this, type, newId]() {
+            return watchEvent<InputMethodNotificationEvent>(
+                type, newId,
+                [](std::unique_ptr<LuaState> &state,
+                   InputMethodNotificationEvent &event) -> int {
+                    lua_pushstring(state, event.name().c_str());
+                    return 1;
+                });
+        };
+        break;
+    case EventType::InputContextSwitchInputMethod:
+        watch = [this, type, newId]() {
+            return watchEvent<InputContextSwitchInputMethodEvent>(
+                type, newId,
+                [](std::unique_ptr<LuaState> &state,
+                   InputContextSwitchInputMethodEvent &event) -> int {
+                    lua_pushstring(state, event.oldInputMethod().c_str());
+                    return 1;
+                });
+        };
+        break;
+    default:
+        throw std::runtime_error("Invalid eventype");
+    }
+    currentId_++;
+    eventHandler_.emplace(
+        std::piecewise_construct, std::forward_as_tuple(newId),
+        std::forward_as_tuple(std::string(function), nullptr, eventObject));
+    registerHandler([this, newId, watch = std::move(watch)]() {
+        if (auto iter = eventHandler_.find(newId);
+            iter != eventHandler_.end()) {
+            iter->second.setHandler(watch());
+        }
+    });
+    return {newId};
+}
+
+std::tuple<int>
+LuaAddonState::watchSurroundingTextDeltaImpl(std::string_view function) {
+    int newId = ++currentId_;
+    eventHandler_.emplace(std::piecewise_construct,
+                          std::forward_as_tuple(newId),
+                          std::forward_as_tuple(std::string(function), nullptr,
+                                                false, true));
+    // All delta watchers share one handler, so the change is computed once
+    // per event.
+    registerHandler([this]() {
+        if (surroundingTextDeltaHandler_) {
+            return;
+        }
+        surroundingTextDeltaHandler_ = instance_->watchEvent(
+            EventType::InputContextSurroundingTextUpdated,
+            EventWatcherPhase::PreInputMethod, [this](Event &event) {
+                deliverSurroundingTextDelta(
+                    static_cast<InputContextEvent &>(event).inputContext());
+            });
+    });
+    return {newId};
+}
+
+void LuaAddonState::deliverSurroundingTextDelta(InputContext *ic) {
+    std::vector<int> ids;
+    for (const auto &[id, watcher] : eventHandler_) {
+        if (watcher.surroundingTextDelta()) {
+            ids.push_back(id);
+        }
+    }
+    if (ids.empty()) {
+        return;
+    }
+    std::sort(ids.begin(), ids.end());
+
+    static const std::string empty;
+    const auto &surrounding = ic->surroundingText();
+    const auto &text = surrounding.isValid() ? surrounding.text() : empty;
+    auto &last = inputContextData(ic)->deltaSurroundingText();
+    auto isContinuation = [](const std::string &str, size_t index) {
+        return index < str.size() &&
+               (static_cast<unsigned char>(str[index]) & 0xC0) == 0x80;
+    };
+    // Common prefix and suffix in bytes, moved to character boundary.
+    size_t prefix = 0;
+    const size_t maxPrefix = std::min(text.size(), last.size());
+    while (prefix < maxPrefix && text[prefix] == last[prefix]) {
+        ++prefix;
+    }
+    while (prefix > 0 &&
+           (isContinuation(text, prefix) || isContinuation(last, prefix))) {
+        --prefix;
+    }
+    size_t suffix = 0;
+    const size_t maxSuffix = maxPrefix - prefix;
+    while (suffix < maxSuffix &&
+           text[text.size() - suffix - 1] == last[last.size() - suffix - 1]) {
+        ++suffix;
+    }
+    while (suffix > 0 && isContinuation(text, text.size() - suffix)) {
+        --suffix;
+    }
+    const auto offset = utf8::length(text.begin(), text.begin() + prefix);
+    const auto removed =
+        utf8::length(last.begin() + prefix, last.end() - suffix);
+    const auto inserted = text.substr(prefix, text.size() - suffix - prefix);
+    const auto cursor = surrounding.isValid() ? surrounding.cursor() : 0;
+    const auto anchor = surrounding.isValid() ? surrounding.anchor() : 0;
+    last.replace(prefix, last.size() - suffix - prefix, inserted);
+
+    for (int id : ids) {
+        auto iter = eventHandler_.find(id);
+        if (iter == eventHandler_.end() || isHandlerSuspended(id)) {
+            continue;
+        }
+        ScopedICSetter setter(inputContext_, ic->watch());
+        lua_getglobal(state_, iter->second.function().data());
+        lua_pushinteger(state_, offset);
+        lua_pushinteger(state_, removed);
+        lua_pushlstring(state_, inserted.data(), inserted.size());
+        lua_pushinteger(state_, cursor);
+        lua_pushinteger(state_, anchor);
+        callHandler(id, 5, 1);
+        lua_pop(state_, lua_gettop(state_));
+        flushUI();
+    }
+}
+
+std::tuple<int>
+LuaAddonState::watchEventCoalescedImpl(int eventType, std::string_view function,
+                                       std::optional<int> intervalArg) {
+    auto type = static_cast<EventType>(eventType);
+    switch (type) {
+    case EventType::InputContextSurroundingTextUpdated:
+    case EventType::InputContextCursorRectChanged:
+    case EventType::InputContextUpdatePreedit:
+        break;
+    default:
+        throw std::runtime_error("Event type can not be coalesced");
+    }
+    int interval = intervalArg.value_or(0);
+    if (interval < 0) {
+        throw std::runtime_error("Invalid interval");
+    }
+    int newId = ++currentId_;
+    eventHandler_.emplace(std::piecewise_construct,
+                          std::forward_as_tuple(newId),
+                          std::forward_as_tuple(std::string(function), nullptr));
+    registerHandler([this, type, newId, interval]() {
+        auto iter = eventHandler_.find(newId);
+        if (iter == eventHandler_.end()) {
+            return;
+        }
+        std::unique_ptr<EventSource> flushEvent;
+        if (interval) {
+            flushEvent = instance_->eventLoop().addTimeEvent(
+                CLOCK_MONOTONIC, now(CLOCK_MONOTONIC), 0,
+                [this, newId](EventSourceTime *, uint64_t) {
+                    flushCoalescedEvent(newId);
+                    return true;
+                });
+        } else {
+            flushEvent = instance_->eventLoop().addDeferEvent(
+                [this, newId](EventSource *) {
+                    flushCoalescedEvent(newId);
+                    return true;
+                });
+        }
+        flushEvent->setEnabled(false);
+        iter->second.setFlushEvent(std::move(flushEvent),
+                                   static_cast<uint64_t>(interval) * 1000);
+        iter->second.setHandler(instance_->watchEvent(
+            type, EventWatcherPhase::PreInputMethod,
+            [this, newId](Event &event) {
+                auto watcher = eventHandler_.find(newId);
+                if (watcher == eventHandler_.end()) {
+                    return;
+                }
+                watcher->second.addPending(
+                    static_cast<InputContextEvent &>(event).inputContext());
+            }));
+    });
+    return {newId};
+}
+
+void LuaAddonState::flushCoalescedEvent(int id) {
+    auto iter = eventHandler_.find(id);
+    if (iter == eventHandler_.end()) {
+        return;
+    }
+    // The watcher may be removed by the lua function.
+    const auto function = iter->second.function();
+    const auto pending = iter->second.takePending();
+    for (const auto &icRef : pending) {
+        if (!icRef.isValid()) {
+            continue;
+        }
+        if (!eventHandler_.contains(id) || isHandlerSuspended(id)) {
+            break;
+        }
+        ScopedICSetter setter(inputContext_, icRef);
+        lua_getglobal(state_, function.data());
+        callHandler(id, 0, 1);
+        lua_pop(state_, lua_gettop(state_));
+        flushUI();
+    }
+}
+
+int LuaAddonState::pushEventObject() {
+    if (eventObjectRef_ == LUA_NOREF) {
+        lua_newuserdata(state_, 0);
+        if (luaL_newmetatable(state_, "fcitx.Event")) {
+            // Cache of the fields in current dispatch.
+            lua_newtable(state_);
+            lua_pushcclosure(state_, &LuaAddonState::eventObjectIndex, 1);
+            lua_setfield(state_, -2, "__index");
+        }
+        lua_setmetatable(state_, -2);
+        eventObjectRef_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(state_, LUA_REGISTRYINDEX, eventObjectRef_);
+    return 1;
+}
+
+int LuaAddonState::eventObjectIndex(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    if (!state->currentEvent_ || lua_type(s, 2) != LUA_TSTRING) {
+        lua_pushnil(s);
+        return 1;
+    }
+    const int cache = lua_upvalueindex(1);
+    if (state->cachedEventSerial_ != state->currentEventSerial_) {
+        lua_pushnil(s);
+        while (lua_next(s, cache) != 0) {
+            lua_pop(s, 1);
+            lua_pushvalue(s, -1);
+            lua_pushnil(s);
+            lua_rawset(s, cache);
+        }
+        state->cachedEventSerial_ = state->currentEventSerial_;
+    }
+    lua_pushvalue(s, 2);
+    lua_rawget(s, cache);
+    if (lua_type(s, -1) != LUA_TNIL) {
+        return 1;
+    }
+    lua_pop(s, 1);
+    size_t length = 0;
+    const char *field = lua_tolstring(s, 2, &length);
+    if (!state->pushEventField(std::string_view(field, length))) {
+        lua_pushnil(s);
+        return 1;
+    }
+    lua_pushvalue(s, 2);
+    lua_pushvalue(s, -2);
+    lua_rawset(s, cache);
+    return 1;
+}
+
+bool LuaAddonState::pushEventField(std::string_view field) {
+    auto *event = currentEvent_;
+    auto *ic = static_cast<InputContextEvent *>(event)->inputContext();
+    auto pushString = [this](const std::string &str) {
+        lua_pushlstring(state_, str.data(), str.size());
+        return true;
+    };
+    if (field == "type") {
+        lua_pushinteger(state_, static_cast<int>(event->type()));
+        return true;
+    }
+    if (field == "program") {
+        return pushString(ic->program());
+    }
+    if (field == "inputMethod") {
+        return pushString(instance_->inputMethod(ic));
+    }
+    if (field == "uuid") {
+        std::string uuid;
+        for (auto byte : ic->uuid()) {
+            constexpr char hex[] = "0123456789abcdef";
+            uuid.push_back(hex[byte >> 4]);
+            uuid.push_back(hex[byte & 0xf]);
+        }
+        return pushString(uuid);
+    }
+    if (field == "preedit") {
+        return pushString(ic->inputPanel().clientPreedit().toString());
+    }
+    if (field == "surroundingText" || field == "cursor" ||
+        field == "anchor") {
+        const auto &surrounding = ic->surroundingText();
+        if (!surrounding.isValid()) {
+            return false;
+        }
+        if (field == "surroundingText") {
+            return pushString(surrounding.text());
+        }
+        lua_pushinteger(state_, field == "cursor" ? surrounding.cursor()
+                                                  : surrounding.anchor());
+        return true;
+    }
+
+    switch (event->type()) {
+    case EventType::InputContextKeyEvent: {
+        auto *keyEvent = static_cast<KeyEvent *>(event);
+        if (field == "sym") {
+            lua_pushinteger(state_, keyEvent->key().sym());
+        } else if (field == "state") {
+            lua_pushinteger(state_, keyEvent->key().states());
+        } else if (field == "release") {
+            lua_pushboolean(state_, keyEvent->isRelease());
+        } else if (field == "key") {
+            return pushString(keyEvent->key().toString());
+        } else {
+            return false;
+        }
+        return true;
+    }
+    case EventType::InputContextCommitString:
+        if (field == "text") {
+            return pushString(static_cast<CommitStringEvent *>(event)->text());
+        }
+        break;
+    case EventType::InputContextInputMethodActivated:
+    case EventType::InputContextInputMethodDeactivated:
+        if (field == "name") {
+            return pushString(
+                static_cast<InputMethodNotificationEvent *>(event)->name());
+        }
+        break;
+    case EventType::InputContextSwitchInputMethod:
+        if (field == "oldInputMethod") {
+            return pushString(
+                static_cast<InputContextSwitchInputMethodEvent *>(event)
+                    ->oldInputMethod());
+        }
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+std::tuple<> LuaAddonState::unwatchEventImpl(int id) {
+    eventHandler_.erase(id);
+    handlerHealth_.erase(id);
+    return {};
+}
+
+std::tuple<std::string> LuaAddonState::currentInputMethodImpl() {
+    auto *ic = inputContext_.get();
+    if (ic) {
+        return {instance_->inputMethod(ic)};
+    }
+    return {""};
+}
+
+std::tuple<std::string_view> LuaAddonState::currentProgramImpl() {
+    auto *ic = inputContext_.get();
+    if (ic) {
+        return {ic->program()};
+    }
+    return {""};
+}
+
+std::tuple<>
+LuaAddonState::setCurrentInputMethodImpl(std::string_view name,
+                                         std::optional<bool> local) {
+    auto *ic = inputContext_.get();
+    if (ic) {
+        instance_->setCurrentInputMethod(ic, std::string(name),
+                                         local.value_or(false));
+    }
+    return {};
+}
+
+std::tuple<int> LuaAddonState::addConverterImpl(std::string_view function) {
+    int newId = ++currentId_;
+    converter_.emplace(
+        std::piecewise_construct, std::forward_as_tuple(newId),
+        std::forward_as_tuple(std::string(function), ScopedConnection()));
+    registerHandler([this, newId]() {
+        auto converter = converter_.find(newId);
+        if (converter == converter_.end()) {
+            return;
+        }
+        auto connection = instance_->connect<Instance::CommitFilter>(
+            [this, newId](InputContext *inputContext, std::string &orig) {
+                auto iter = converter_.find(newId);
+                if (iter == converter_.end() || isHandlerSuspended(newId)) {
+                    return;
+                }
+
+                ScopedICSetter setter(inputContext_, inputContext->watch());
+                lua_getglobal(state_, iter->second.function().data());
+                lua_pushstring(state_, orig.data());
+                if (int rv = callHandler(newId, 1, 1);
+                    rv == LUA_OK && lua_gettop(state_) >= 1) {
+                    const auto *s = lua_tostring(state_, -1);
+                    if (s) {
+                        orig = s;
+                    }
+                }
+                lua_pop(state_, lua_gettop(state_));
+                flushUI();
+            });
+        converter->second.setConnection(std::move(connection));
+    });
+    return {newId};
+}
+
+std::tuple<> LuaAddonState::removeConverterImpl(int id) {
+    converter_.erase(id);
+    handlerHealth_.erase(id);
+    return {};
+}
+
+std::tuple<int>
+LuaAddonState::addPreeditFilterImpl(std::string_view function) {
+    int newId = ++currentId_;
+    preeditFilter_.emplace(newId, function);
+    ++preeditFilterGeneration_;
+    // The application may drop its preedit by itself, so the next preedit
+    // is always sent.
+    watchShownStateReset();
+    registerHandler([this]() {
+        if (preeditFilterWatcher_ || preeditFilter_.empty()) {
+            return;
+        }
+        preeditFilterWatcher_ = instance_->watchEvent(
+            EventType::InputContextUpdatePreedit,
+            EventWatcherPhase::PostInputMethod, [this](Event &event) {
+                filterPreedit(static_cast<InputContextEvent &>(event));
+            });
+    });
+    return {newId};
+}
+
+std::tuple<> LuaAddonState::removePreeditFilterImpl(int id) {
+    if (!preeditFilter_.erase(id)) {
+        return {};
+    }
+    ++preeditFilterGeneration_;
+    handlerHealth_.erase(id);
+    if (preeditFilter_.empty()) {
+        preeditFilterWatcher_.reset();
+    }
+    return {};
+}
+
+void LuaAddonState::filterPreedit(InputContextEvent &event) {
+    // Preedit updated by a filter itself is sent as is.
+    if (filteringPreedit_) {
+        return;
+    }
+    auto *ic = event.inputContext();
+    auto &filter = inputContextData(ic)->preeditFilter();
+    const auto &clientPreedit = ic->inputPanel().clientPreedit();
+    auto input = clientPreedit.toString();
+    const int inputCursor = clientPreedit.cursor();
+
+    // The preedit is unchanged if it is the same as the last input, or if it
+    // is the last output sent again.
+    bool reusable =
+        filter.generation == preeditFilterGeneration_ &&
+        ((input == filter.input && inputCursor == filter.inputCursor) ||
+         (filter.shown && input == filter.output &&
+          inputCursor == filter.outputCursor));
+    for (const auto &[id, _] : preeditFilter_) {
+        reusable = reusable && !isHandlerSuspended(id);
+    }
+    bool unchanged = reusable && filter.shown;
+    if (!reusable) {
+        auto lastOutput = std::move(filter.output);
+        const int lastOutputCursor = filter.outputCursor;
+        filter.output = input;
+        filter.outputCursor = inputCursor;
+        bool complete = true;
+        ScopedICSetter setter(inputContext_, ic->watch());
+        ScopedSetter<bool> filteringSetter(filteringPreedit_, true);
+        // The event may be posted from a lua function, keep its arguments.
+        const int top = lua_gettop(state_);
+        for (const auto &[id, function] : preeditFilter_) {
+            if (input.empty()) {
+                break;
+            }
+            if (isHandlerSuspended(id)) {
+                complete = false;
+                continue;
+            }
+            lua_getglobal(state_, function.data());
+            lua_pushlstring(state_, filter.output.data(), filter.output.size());
+            lua_pushinteger(state_, filter.outputCursor);
+            size_t length = 0;
+            const char *text = nullptr;
+            if (callHandler(id, 2, 2) != LUA_OK) {
+                complete = false;
+            } else if ((text = lua_tolstring(state_, -2, &length))) {
+                int isInteger = 0;
+                auto cursor = lua_tointegerx(state_, -1, &isInteger);
+                const auto oldSize = filter.output.size();
+                filter.output.assign(text, length);
+                if (isInteger) {
+                    filter.outputCursor = static_cast<int>(std::clamp<int64_t>(
+                        cursor, -1, filter.output.size()));
+                } else if (filter.outputCursor >= 0) {
+                    // Keep the cursor at the end, or at the same position.
+                    filter.outputCursor = static_cast<int>(
+                        static_cast<size_t>(filter.outputCursor) == oldSize
+                            ? filter.output.size()
+                            : std::min<size_t>(filter.outputCursor,
+                                               filter.output.size()));
+                }
+            }
+            lua_settop(state_, top);
+        }
+        filter.generation = complete ? preeditFilterGeneration_ : 0;
+        filter.input = std::move(input);
+        filter.inputCursor = inputCursor;
+        unchanged = filter.shown && filter.output == lastOutput &&
+                    filter.outputCursor == lastOutputCursor;
+    }
+
+    filter.shown = filter.output != filter.input ||
+                   filter.outputCursor != filter.inputCursor;
+    if (filter.shown) {
+        if (clientPreedit.toString() != filter.output ||
+            clientPreedit.cursor() != filter.outputCursor) {
+            Text preedit;
+            preedit.append(filter.output, TextFormatFlag::Underline);
+            preedit.setCursor(filter.outputCursor);
+            ic->inputPanel().setClientPreedit(preedit);
+        }
+        if (unchanged) {
+            // The application is already showing the same preedit.
+            event.accept();
+        }
+    }
+    flushUI();
+}
+
+std::tuple<> LuaAddonState::commitStringImpl(std::string_view str) {
+    if (auto *ic = inputContext_.get()) {
+        ic->commitString(std::string(str));
+    }
+    return {};
+}
+
+std::string LuaAddonState::handlerFunction(int id) const {
+    if (auto iter = eventHandler_.find(id); iter != eventHandler_.end()) {
+        return iter->second.function();
+    }
+    if (auto iter = converter_.find(id); iter != converter_.end()) {
+        return iter->second.function();
+    }
+    if (auto iter = preeditFilter_.find(id); iter != preeditFilter_.end()) {
+        return iter->second;
+    }
+    if (auto iter = quickphraseHandler_.find(id);
+        iter != quickphraseHandler_.end()) {
+        return iter->second.function;
+    }
+    return {};
+}
+
+bool LuaAddonState::isHandlerSuspended(int id) const {
+    if (degraded_) {
+        return true;
+    }
+    auto iter = handlerHealth_.find(id);
+    return iter != handlerHealth_.end() && iter->second.suspendedUntil &&
+           iter->second.suspendedUntil > now(CLOCK_MONOTONIC);
+}
+
+int LuaAddonState::callHandler(int id, int nargs, int nresults) {
+    int rv = protectedCall(nargs, nresults);
+    if (rv == LUA_OK) {
+        if (auto iter = handlerHealth_.find(id); iter != handlerHealth_.end()) {
+            auto &health = iter->second;
+            health.history <<= 1;
+            health.calls = std::min(health.calls + 1, kHandlerHistorySize);
+            if (!health.history) {
+                // No failure in recent calls.
+                handlerHealth_.erase(iter);
+            } else {
+                health.consecutiveFailures = 0;
+                health.backoff = 0;
+            }
+        }
+        return rv;
+    }
+
+    auto &health = handlerHealth_[id];
+    const auto currentTime = now(CLOCK_MONOTONIC);
+    health.history = (health.history << 1) | 1;
+    health.calls = std::min(health.calls + 1, kHandlerHistorySize);
+    health.consecutiveFailures += 1;
+
+    std::string error;
+    if (lua_gettop(state_) > 0) {
+        if (const auto *str = lua_tostring(state_, -1)) {
+            error = str;
+        }
+    }
+    // Rate limit the identical error message from the same handler.
+    if (error != health.lastError ||
+        currentTime >= health.lastLogged + kErrorLogInterval) {
+        if (health.suppressedErrors) {
+            FCITX_LUA_ERROR() << "Last error of " << handlerFunction(id)
+                              << " repeated " << health.suppressedErrors
+                              << " times.";
+        }
+        LuaPError(rv, "lua_pcall() failed");
+        LuaPrintError(*this);
+        health.lastError = std::move(error);
+        health.lastLogged = currentTime;
+        health.suppressedErrors = 0;
+    } else {
+        health.suppressedErrors += 1;
+    }
+
+    const auto failures = std::popcount(health.history);
+    // A handler that failed right after resuming is suspended again.
+    const bool suspend =
+        health.backoff ||
+        (errorPolicy_.maxConsecutiveFailures > 0 &&
+         health.consecutiveFailures >= errorPolicy_.maxConsecutiveFailures) ||
+        (errorPolicy_.maxErrorPercent > 0 &&
+         health.calls == kHandlerHistorySize &&
+         failures * 100 >= errorPolicy_.maxErrorPercent * kHandlerHistorySize);
+    if (suspend) {
+        health.backoff =
+            health.backoff
+                ? std::min(health.backoff * 2, errorPolicy_.maxBackoff)
+                : errorPolicy_.backoff;
+        health.suspendedUntil = currentTime + health.backoff;
+        FCITX_LUA_WARN() << "Suspend " << handlerFunction(id) << " for "
+                         << health.backoff / 1000
+                         << "ms after repeated failures.";
+    }
+    return rv;
+}
+
+int LuaAddonState::suspendedHandlers(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    const auto currentTime = now(CLOCK_MONOTONIC);
+    std::vector<int> ids;
+    for (const auto &[id, health] : state->handlerHealth_) {
+        if (health.suspendedUntil > currentTime) {
+            ids.push_back(id);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    lua_createtable(s, ids.size(), 0);
+    for (size_t i = 0; i < ids.size(); i++) {
+        const auto &health = state->handlerHealth_[ids[i]];
+        const auto function = state->handlerFunction(ids[i]);
+        lua_createtable(s, 0, 5);
+        lua_pushinteger(s, ids[i]);
+        lua_setfield(s, -2, "id");
+        lua_pushlstring(s, function.data(), function.size());
+        lua_setfield(s, -2, "function");
+        lua_pushinteger(s, health.consecutiveFailures);
+        lua_setfield(s, -2, "failures");
+        lua_pushinteger(s, (health.suspendedUntil - currentTime) / 1000);
+        lua_setfield(s, -2, "remaining");
+        lua_pushlstring(s, health.lastError.data(), health.lastError.size());
+        lua_setfield(s, -2, "error");
+        lua_rawseti(s, -2, i + 1);
+    }
+    return 1;
+}
+
+std::tuple<bool> LuaAddonState::resumeHandlerImpl(int id) {
+    auto iter = handlerHealth_.find(id);
+    // The backoff may have expired already, which resumes nothing.
+    if (iter == handlerHealth_.end() ||
+        iter->second.suspendedUntil <= now(CLOCK_MONOTONIC)) {
+        return {false};
+    }
+    handlerHealth_.erase(iter);
+    return {true};
+}
+
+std::tuple<> LuaAddonState::setErrorPolicyImpl(
+    std::optional<int> maxConsecutiveFailures,
+    std::optional<int> maxErrorPercent, std::optional<int> backoff,
+    std::optional<int> maxBackoff) {
+    if (maxConsecutiveFailures && *maxConsecutiveFailures >= 0) {
+        errorPolicy_.maxConsecutiveFailures = *maxConsecutiveFailures;
+    }
+    if (maxErrorPercent && *maxErrorPercent >= 0) {
+        errorPolicy_.maxErrorPercent = *maxErrorPercent;
+    }
+    if (backoff && *backoff > 0) {
+        errorPolicy_.backoff = static_cast<uint64_t>(*backoff) * 1000;
+    }
+    if (maxBackoff && *maxBackoff > 0) {
+        errorPolicy_.maxBackoff = static_cast<uint64_t>(*maxBackoff) * 1000;
+    }
+    errorPolicy_.maxBackoff =
+        std::max(errorPolicy_.maxBackoff, errorPolicy_.backoff);
+    return {};
+}
+
+LuaInputContextData *LuaAddonState::inputContextData(InputContext *ic) {
+    if (!ic) {
+        return nullptr;
+    }
+    if (!icDataFactory_) {
+        // Property name need to be unique, and the old state may still be
+        // alive when the addon is reloaded.
+        static std::atomic<int> counter = 0;
+        icDataFactory_ = std::make_unique<
+            LambdaInputContextPropertyFactory<LuaInputContextData>>(
+            [this](InputContext &) {
+                return new LuaInputContextData(state_.get());
+            });
+        instance_->inputContextManager().registerProperty(
+            "luaICData" + std::to_string(++counter), icDataFactory_.get());
+    }
+    return ic->propertyFor(icDataFactory_.get());
+}
+
+void LuaInputContextData::pushSurroundingText(const std::string &text) {
+    if (surroundingTextRef_ != LUA_NOREF) {
+        lua_rawgeti(state_, LUA_REGISTRYINDEX, surroundingTextRef_);
+        size_t length = 0;
+        const char *cached = lua_tolstring(state_, -1, &length);
+        if (std::string_view(cached, length) == text) {
+            return;
+        }
+        lua_pop(state_, 1);
+        luaL_unref(state_, LUA_REGISTRYINDEX, surroundingTextRef_);
+    }
+    lua_pushlstring(state_, text.data(), text.size());
+    lua_pushvalue(state_, -1);
+    surroundingTextRef_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+}
+
+int LuaAddonState::surroundingText(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *ic = state->inputContext_.get();
+    if (!ic || !ic->surroundingText().isValid()) {
+        lua_pushnil(state->state_);
+        return 1;
     }
+    const auto &surrounding = ic->surroundingText();
+    state->inputContextData(ic)->pushSurroundingText(surrounding.text());
+    lua_pushinteger(state->state_, surrounding.cursor());
+    lua_pushinteger(state->state_, surrounding.anchor());
+    return 3;
+}
 
-    if (int rv = lua_pcall(state_, 0, 0, 0); rv != 0) {
-        LuaPError(rv, "lua_pcall() failed");
-        LuaPrintError(*this);
-        throw std::runtime_error("Failed to run lua source.");
+int LuaAddonState::icData(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    if (auto *data = state->currentInputContextData()) {
+        data->push();
+    } else {
+        lua_pushnil(state->state_);
     }
+    return 1;
+}
 
-    commitHandler_ = instance_->watchEvent(
-        EventType::InputContextCommitString, EventWatcherPhase::PreInputMethod,
-        [this](Event &event) {
-            auto &commitEvent = static_cast<CommitStringEvent &>(event);
-            lastCommit_ = commitEvent.text();
-        });
+int LuaAddonState::ui(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    if (state->uiObjectRef_ == LUA_NOREF) {
+        lua_newuserdata(s, 0);
+        if (luaL_newmetatable(s, kUIMetatable)) {
+            static const luaL_Reg methods[] = {
+                {"setPreedit", &LuaAddonState::uiSetPreedit},
+                {"setAuxUp", &LuaAddonState::uiSetAuxUp},
+                {"setAuxDown", &LuaAddonState::uiSetAuxDown},
+                {"setCandidates", &LuaAddonState::uiSetCandidates},
+                {"clear", &LuaAddonState::uiClear},
+                {nullptr, nullptr},
+            };
+            luaL_newlib(s, methods);
+            lua_setfield(s, -2, "__index");
+        }
+        lua_setmetatable(s, -2);
+        state->uiObjectRef_ = luaL_ref(s, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(s, LUA_REGISTRYINDEX, state->uiObjectRef_);
+    return 1;
 }
 
-std::tuple<> LuaAddonState::logImpl(const char *msg) {
-    FCITX_LUA_DEBUG() << msg;
-    return {};
+int LuaAddonState::uiSetPreedit(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    luaL_checkudata(s, 1, kUIMetatable);
+    size_t length = 0;
+    const char *text = luaL_checklstring(s, 2, &length);
+    int cursor = -1;
+    if (lua_gettop(s) >= 3) {
+        cursor = luaL_checkinteger(s, 3);
+        if (cursor < 0 || static_cast<size_t>(cursor) > length) {
+            return luaL_error(s, "Invalid cursor %d", cursor);
+        }
+    }
+    auto *ui = state->pendingUI();
+    if (!ui) {
+        return luaL_error(s, "No input context");
+    }
+    ui->preedit.assign(text, length);
+    ui->preeditCursor = cursor;
+    lua_pushvalue(s, 1);
+    return 1;
 }
 
-template <typename T>
-std::unique_ptr<HandlerTableEntry<EventHandler>> LuaAddonState::watchEvent(
-    EventType type, int id,
-    std::function<int(std::unique_ptr<LuaState> &, T &)> pushArguments,
-    std::function<void(std::unique_ptr<LuaState> &, T &)> handleReturnValue) {
-    return instance_->watchEvent(
-        type, EventWatcherPhase::PreInputMethod,
-        [this, id, pushArguments, handleReturnValue](Event &event_) {
-            auto iter = eventHandler_.find(id);
-            int argc = 0;
-            if (iter == eventHandler_.end()) {
-                return;
-            }
-            auto &event = static_cast<T &>(event_);
-            ScopedICSetter setter(inputContext_, event.inputContext()->watch());
-            lua_getglobal(state_, iter->second.function().data());
-            if (pushArguments) {
-                argc = pushArguments(state_, event);
-            }
-            int rv = lua_pcall(state_, argc, 1, 0);
-            if (rv != 0) {
-                LuaPError(rv, "lua_pcall() failed");
-                LuaPrintError(*this);
-            } else if (lua_gettop(state_) >= 1) {
-                if (handleReturnValue) {
-                    handleReturnValue(state_, event);
-                }
-            }
-            lua_pop(state_, lua_gettop(state_));
-        });
+int LuaAddonState::uiSetAuxUp(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    luaL_checkudata(s, 1, kUIMetatable);
+    size_t length = 0;
+    const char *text = luaL_checklstring(s, 2, &length);
+    auto *ui = state->pendingUI();
+    if (!ui) {
+        return luaL_error(s, "No input context");
+    }
+    ui->auxUp.assign(text, length);
+    lua_pushvalue(s, 1);
+    return 1;
 }
 
-std::tuple<int> LuaAddonState::watchEventImpl(int eventType,
-                                              const char *function) {
-    int newId = currentId_ + 1;
-    std::unique_ptr<HandlerTableEntry<EventHandler>> handler = nullptr;
+int LuaAddonState::uiSetAuxDown(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    luaL_checkudata(s, 1, kUIMetatable);
+    size_t length = 0;
+    const char *text = luaL_checklstring(s, 2, &length);
+    auto *ui = state->pendingUI();
+    if (!ui) {
+        return luaL_error(s, "No input context");
+    }
+    ui->auxDown.assign(text, length);
+    lua_pushvalue(s, 1);
+    return 1;
+}
 
-    switch (static_cast<EventType>(eventType)) {
-    case EventType::InputContextCreated:
-    case EventType::InputContextDestroyed:
-    case EventType::InputContextFocusIn:
-    case EventType::InputContextFocusOut:
-    case EventType::InputContextSurroundingTextUpdated:
-    case EventType::InputContextCursorRectChanged:
-    case EventType::InputContextUpdatePreedit:
-        handler = watchEvent<InputContextEvent>(
-            static_cast<EventType>(eventType), newId);
-        break;
-    case EventType::InputContextKeyEvent:
-        handler = watchEvent<KeyEvent>(
-            EventType::InputContextKeyEvent, newId,
-            [](std::unique_ptr<LuaState> &state, KeyEvent &event) -> int {
-                lua_pushinteger(state, event.key().sym());
-                lua_pushinteger(state, event.key().states());
-                lua_pushboolean(state, event.isRelease());
-                return 3;
-            },
-            [](std::unique_ptr<LuaState> &state, KeyEvent &event) {
-                auto b = lua_toboolean(state, -1);
-                if (b) {
-                    event.filterAndAccept();
-                }
-            });
-        break;
-    case EventType::InputContextCommitString:
-        handler = watchEvent<CommitStringEvent>(
-            EventType::InputContextCommitString, newId,
-            [](std::unique_ptr<LuaState> &state,
-               CommitStringEvent &event) -> int {
-                lua_pushstring(state, event.text().c_str());
-                return 1;
-            });
-        break;
-    case EventType::InputContextInputMethodActivated:
-    case EventType::InputContextInputMethodDeactivated:
-        handler = watchEvent<InputMethodNotificationEvent>(
-            static_cast<EventType>(eventType), newId,
-            [](std::unique_ptr<LuaState> &state,
-               InputMethodNotificationEvent &event) -> int {
-                lua_pushstring(state, event.name().c_str());
-                return 1;
-            });
-        break;
-    case EventType::InputContextSwitchInputMethod:
-        handler = watchEvent<InputContextSwitchInputMethodEvent>(
-            static_cast<EventType>(eventType), newId,
-            [](std::unique_ptr<LuaState> &state,
-               InputContextSwitchInputMethodEvent &event) -> int {
-                lua_pushstring(state, event.oldInputMethod().c_str());
-                return 1;
-            });
-        break;
-    default:
-        throw std::runtime_error("Invalid eventype");
+int LuaAddonState::uiSetCandidates(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    luaL_checkudata(s, 1, kUIMetatable);
+    if (lua_type(s, 2) != LUA_TTABLE) {
+        return luaL_error(s, "Candidates must be a table");
     }
-    currentId_++;
-    eventHandler_.emplace(std::piecewise_construct,
-                          std::forward_as_tuple(newId),
-                          std::forward_as_tuple(function, std::move(handler)));
-    return {newId};
+    auto *ui = state->pendingUI();
+    if (!ui) {
+        return luaL_error(s, "No input context");
+    }
+    ui->candidates.clear();
+    auto len = luaL_len(s, 2);
+    for (decltype(len) i = 1; i <= len; ++i) {
+        lua_rawgeti(s, 2, i);
+        size_t length = 0;
+        if (const char *text = lua_tolstring(s, -1, &length)) {
+            ui->candidates.emplace_back(text, length);
+        }
+        lua_pop(s, 1);
+    }
+    lua_pushvalue(s, 1);
+    return 1;
 }
 
-std::tuple<> LuaAddonState::unwatchEventImpl(int id) {
-    eventHandler_.erase(id);
-    return {};
+int LuaAddonState::uiClear(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    luaL_checkudata(s, 1, kUIMetatable);
+    auto *ui = state->pendingUI();
+    if (!ui) {
+        return luaL_error(s, "No input context");
+    }
+    *ui = LuaUIState();
+    lua_pushvalue(s, 1);
+    return 1;
 }
 
-std::tuple<std::string> LuaAddonState::currentInputMethodImpl() {
-    auto *ic = inputContext_.get();
-    if (ic) {
-        return {instance_->inputMethod(ic)};
+int LuaAddonState::buffer(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    new (lua_newuserdata(s, sizeof(LuaBuffer))) LuaBuffer();
+    if (luaL_newmetatable(s, kBufferMetatable)) {
+        static const luaL_Reg methods[] = {
+            {"add", &LuaAddonState::bufferAdd},
+            {"addf", &LuaAddonState::bufferAddf},
+            {"rep", &LuaAddonState::bufferRep},
+            {"clear", &LuaAddonState::bufferClear},
+            {"tostring", &LuaAddonState::bufferToString},
+            {nullptr, nullptr},
+        };
+        luaL_newlib(s, methods);
+        lua_setfield(s, -2, "__index");
+        lua_pushcclosure(s, &LuaAddonState::bufferToString, 0);
+        lua_setfield(s, -2, "__tostring");
+        lua_pushcclosure(s, &LuaAddonState::bufferLength, 0);
+        lua_setfield(s, -2, "__len");
+        lua_pushcclosure(s, &LuaAddonState::bufferGC, 0);
+        lua_setfield(s, -2, "__gc");
     }
-    return {""};
+    lua_setmetatable(s, -2);
+    return 1;
 }
 
-std::tuple<std::string> LuaAddonState::currentProgramImpl() {
-    auto *ic = inputContext_.get();
-    if (ic) {
-        return {ic->program()};
+LuaBuffer *LuaAddonState::checkBuffer(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    return static_cast<LuaBuffer *>(
+        luaL_checkudata(state->state_, 1, kBufferMetatable));
+}
+
+void LuaAddonState::appendBuffer(lua_State *lua, LuaBuffer *buffer,
+                                 std::string_view str, size_t count) {
+    auto *state = GetLuaAddonState(lua);
+    auto &data = buffer->data;
+    if (!str.empty() &&
+        (count > (data.max_size() - data.size()) / str.size())) {
+        luaL_error(state->state_, "Buffer is too large");
+    }
+    if (!reserveBuffer(*buffer, data.size() + str.size() * count,
+                       state->allocator_.get())) {
+        luaL_error(state->state_, "Not enough memory for buffer");
+    }
+    for (size_t i = 0; i < count; ++i) {
+        data.append(str);
     }
-    return {""};
 }
 
-std::tuple<> LuaAddonState::setCurrentInputMethodImpl(const char *str,
-                                                      bool local) {
-    auto *ic = inputContext_.get();
-    if (ic) {
-        instance_->setCurrentInputMethod(ic, str, local);
+int LuaAddonState::bufferAdd(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    auto *buffer = checkBuffer(lua);
+    const int top = lua_gettop(s);
+    for (int i = 2; i <= top; ++i) {
+        size_t length = 0;
+        const char *str = luaL_checklstring(s, i, &length);
+        appendBuffer(lua, buffer, std::string_view(str, length));
     }
-    return {};
+    lua_pushvalue(s, 1);
+    return 1;
 }
 
-std::tuple<int> LuaAddonState::addConverterImpl(const char *function) {
-    int newId = ++currentId_;
-    converter_.emplace(
-        std::piecewise_construct, std::forward_as_tuple(newId),
-        std::forward_as_tuple(
-            function,
-            instance_->connect<Instance::CommitFilter>(
-                [this, newId](InputContext *inputContext, std::string &orig) {
-                    auto iter = converter_.find(newId);
-                    if (iter == converter_.end()) {
-                        return;
-                    }
+int LuaAddonState::bufferAddf(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    auto *buffer = checkBuffer(lua);
+    luaL_checklstring(s, 2, nullptr);
+    const int top = lua_gettop(s);
+    lua_getglobal(s, "string");
+    lua_getfield(s, -1, "format");
+    for (int i = 2; i <= top; ++i) {
+        lua_pushvalue(s, i);
+    }
+    if (lua_pcall(s, top - 1, 1, 0) != LUA_OK) {
+        return lua_error(s);
+    }
+    size_t length = 0;
+    const char *str = lua_tolstring(s, -1, &length);
+    appendBuffer(lua, buffer, std::string_view(str, length));
+    lua_pushvalue(s, 1);
+    return 1;
+}
 
-                    ScopedICSetter setter(inputContext_, inputContext->watch());
-                    lua_getglobal(state_, iter->second.function().data());
-                    lua_pushstring(state_, orig.data());
-                    if (int rv = lua_pcall(state_, 1, 1, 0); rv != 0) {
-                        LuaPError(rv, "lua_pcall() failed");
-                        LuaPrintError(*this);
-                    } else if (lua_gettop(state_) >= 1) {
-                        const auto *s = lua_tostring(state_, -1);
-                        if (s) {
-                            orig = s;
-                        }
-                    }
-                    lua_pop(state_, lua_gettop(state_));
-                })));
-    return {newId};
+int LuaAddonState::bufferRep(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    auto *buffer = checkBuffer(lua);
+    size_t length = 0;
+    const char *str = luaL_checklstring(s, 2, &length);
+    auto count = luaL_checkinteger(s, 3);
+    if (count > 0) {
+        appendBuffer(lua, buffer, std::string_view(str, length), count);
+    }
+    lua_pushvalue(s, 1);
+    return 1;
 }
 
-std::tuple<> LuaAddonState::removeConverterImpl(int id) {
-    converter_.erase(id);
-    return {};
+int LuaAddonState::bufferClear(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    checkBuffer(lua)->data.clear();
+    lua_pushvalue(state->state_, 1);
+    return 1;
 }
 
-std::tuple<> LuaAddonState::commitStringImpl(const char *str) {
-    if (auto *ic = inputContext_.get()) {
-        ic->commitString(str);
+int LuaAddonState::bufferToString(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    const auto &data = checkBuffer(lua)->data;
+    lua_pushlstring(state->state_, data.data(), data.size());
+    return 1;
+}
+
+int LuaAddonState::bufferLength(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    lua_pushinteger(state->state_, checkBuffer(lua)->data.size());
+    return 1;
+}
+
+int LuaAddonState::bufferGC(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    // Only set on the buffer. The type isn't checked, since the check fails
+    // with LuaJIT when the state is being closed.
+    auto *buffer = static_cast<LuaBuffer *>(
+        state->state_->lua_touserdataOnThread(lua, 1));
+    if (auto *allocator = state->allocator_.get()) {
+        allocator->used -= buffer->charged;
     }
-    return {};
+    buffer->~LuaBuffer();
+    return 0;
+}
+
+int LuaAddonState::dump(lua_State *lua) {
+    auto *state = GetLuaAddonState(lua);
+    auto *s = state->state_.get();
+    int depth = kDefaultDumpDepth;
+    if (lua_gettop(s) >= 2 && lua_type(s, 2) != LUA_TNIL) {
+        depth = std::min<lua_Integer>(luaL_checkinteger(s, 2), kMaxDumpDepth);
+    }
+    lua_settop(s, 1);
+    // The output is kept in a buffer object, which is collected if a lua
+    // error is raised during the dump.
+    buffer(lua);
+    DumpOutput out{static_cast<LuaBuffer *>(lua_touserdata(s, 2)),
+                   state->allocator_.get()};
+    dumpValue(s, 1, depth, out, nullptr);
+    if (out.error) {
+        return luaL_error(s, "%s", out.error);
+    }
+    lua_pushlstring(s, out.buffer->data.data(), out.buffer->data.size());
+    return 1;
+}
+
+LuaUIState *LuaAddonState::pendingUI() {
+    auto *ic = inputContext_.get();
+    if (!ic) {
+        return nullptr;
+    }
+    if (pendingUI_ && pendingUIContext_.get() != ic) {
+        flushUI();
+    }
+    if (!pendingUI_) {
+        if (shownStateWatchers_.empty()) {
+            watchShownStateReset();
+        }
+        pendingUI_ = inputContextData(ic)->ui();
+        pendingUIContext_ = ic->watch();
+    }
+    return &*pendingUI_;
+}
+
+void LuaAddonState::watchShownStateReset() {
+    registerHandler([this]() {
+        if (!shownStateWatchers_.empty()) {
+            return;
+        }
+        for (auto type :
+             {EventType::InputContextFocusIn, EventType::InputContextFocusOut,
+              EventType::InputContextReset}) {
+            shownStateWatchers_.push_back(instance_->watchEvent(
+                type, EventWatcherPhase::PreInputMethod, [this](Event &event) {
+                    auto &icEvent = static_cast<InputContextEvent &>(event);
+                    inputContextData(icEvent.inputContext())
+                        ->resetShownState();
+                }));
+        }
+    });
+}
+
+void LuaAddonState::flushUI() {
+    if (!pendingUI_) {
+        return;
+    }
+    auto ui = std::move(*pendingUI_);
+    pendingUI_.reset();
+    auto *ic = pendingUIContext_.get();
+    pendingUIContext_.unwatch();
+    if (!ic) {
+        return;
+    }
+    auto &last = inputContextData(ic)->ui();
+    if (ui == last) {
+        return;
+    }
+    auto &inputPanel = ic->inputPanel();
+    if (ui.preedit != last.preedit || ui.preeditCursor != last.preeditCursor) {
+        Text preedit;
+        if (!ui.preedit.empty()) {
+            preedit.append(ui.preedit, TextFormatFlag::Underline);
+            preedit.setCursor(ui.preeditCursor < 0 ? ui.preedit.size()
+                                                   : ui.preeditCursor);
+        }
+        if (ic->capabilityFlags().test(CapabilityFlag::Preedit)) {
+            inputPanel.setClientPreedit(preedit);
+            ic->updatePreedit();
+        } else {
+            inputPanel.setPreedit(preedit);
+        }
+    }
+    if (ui.auxUp != last.auxUp) {
+        inputPanel.setAuxUp(Text(ui.auxUp));
+    }
+    if (ui.auxDown != last.auxDown) {
+        inputPanel.setAuxDown(Text(ui.auxDown));
+    }
+    if (ui.candidates != last.candidates) {
+        if (ui.candidates.empty()) {
+            inputPanel.setCandidateList(nullptr);
+        } else {
+            auto candidateList = std::make_unique<CommonCandidateList>();
+            for (const auto &candidate : ui.candidates) {
+                candidateList->append<LuaCandidateWord>(
+                    watch(), candidate,
+                    [](LuaAddonState *state, InputContext *ic,
+                       const std::string &text) {
+                        ic->commitString(text);
+                        state->clearUI(ic);
+                    });
+            }
+            candidateList->setGlobalCursorIndex(0);
+            inputPanel.setCandidateList(std::move(candidateList));
+        }
+    }
+    last = std::move(ui);
+    ic->updateUserInterface(UserInterfaceComponent::InputPanel);
+}
+
+void LuaAddonState::clearUI(InputContext *ic) {
+    ScopedICSetter setter(inputContext_, ic->watch());
+    if (auto *ui = pendingUI()) {
+        *ui = LuaUIState();
+    }
+    flushUI();
 }
 
 bool LuaAddonState::handleQuickPhrase(
@@ -382,14 +2324,18 @@ bool LuaAddonState::handleQuickPhrase(
     const QuickPhraseAddCandidateCallback &callback) {
     ScopedICSetter setter(inputContext_, ic->watch());
     bool flag = true;
-    for (auto &handler : quickphraseHandler_) {
-        lua_getglobal(state_, handler.second.data());
-        lua_pushstring(state_, input.data());
-        int rv = lua_pcall(state_, 1, 1, 0);
-        if (rv != 0) {
-            LuaPError(rv, "lua_pcall() failed");
-            LuaPrintError(*this);
-        } else if (lua_gettop(state_) >= 1) {
+    const auto length = utf8::length(input);
+    for (int id : matchQuickPhraseHandlers(input)) {
+        // Handler may be removed by the previous one.
+        auto handler = quickphraseHandler_.find(id);
+        if (handler == quickphraseHandler_.end() ||
+            length < handler->second.minLength || isHandlerSuspended(id)) {
+            continue;
+        }
+        lua_getglobal(state_, handler->second.function.data());
+        lua_pushlstring(state_, input.data(), input.size());
+        int rv = callHandler(id, 1, 1);
+        if (rv == LUA_OK && lua_gettop(state_) >= 1) {
             do {
                 int type = lua_type(state_, -1);
                 if (type != LUA_TTABLE) {
@@ -440,29 +2386,96 @@ bool LuaAddonState::handleQuickPhrase(
                 }
             } while (0);
         }
+        lua_pop(state_, lua_gettop(state_));
         if (!flag) {
-            return false;
+            break;
         }
-        lua_pop(state_, lua_gettop(state_));
     }
-    return true;
+    flushUI();
+    return flag;
+}
+
+std::vector<int>
+LuaAddonState::matchQuickPhraseHandlers(std::string_view input) const {
+    std::vector<int> ids = quickphraseAnyPrefix_;
+    const auto maxLength = std::min(input.size(), maxQuickPhrasePrefixLength_);
+    for (size_t length = 1; length <= maxLength; ++length) {
+        if (auto iter = quickphrasePrefixes_.find(input.substr(0, length));
+            iter != quickphrasePrefixes_.end()) {
+            ids.insert(ids.end(), iter->second.begin(), iter->second.end());
+        }
+    }
+    // Keep the order of registration.
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
 }
 
-std::tuple<int> LuaAddonState::addQuickPhraseHandlerImpl(const char *function) {
+std::tuple<int> LuaAddonState::addQuickPhraseHandlerImpl(
+    std::string_view function, std::optional<std::vector<std::string>> prefixes,
+    std::optional<int> minLength) {
+    if (minLength && *minLength < 0) {
+        throw std::runtime_error("Invalid minLength");
+    }
+    QuickPhraseHandler handler;
+    handler.function = function;
+    handler.minLength = minLength.value_or(0);
+    if (prefixes) {
+        handler.prefixes = std::move(*prefixes);
+    }
     int newId = ++currentId_;
-    quickphraseHandler_.emplace(newId, function);
-    if (!quickphraseCallback_ && quickphrase()) {
-        quickphraseCallback_ = quickphrase()->call<IQuickPhrase::addProvider>(
-            [this](InputContext *ic, const std::string &input,
-                   const QuickPhraseAddCandidateCallback &callback) {
-                return handleQuickPhrase(ic, input, callback);
-            });
+    // Empty prefix matches everything.
+    if (handler.prefixes.empty() ||
+        std::any_of(handler.prefixes.begin(), handler.prefixes.end(),
+                    [](const std::string &prefix) { return prefix.empty(); })) {
+        handler.prefixes.clear();
+        quickphraseAnyPrefix_.push_back(newId);
     }
+    for (const auto &prefix : handler.prefixes) {
+        quickphrasePrefixes_[prefix].push_back(newId);
+        maxQuickPhrasePrefixLength_ =
+            std::max(maxQuickPhrasePrefixLength_, prefix.size());
+    }
+    quickphraseHandler_.emplace(newId, std::move(handler));
+    registerHandler([this]() {
+        if (!quickphraseCallback_ && !quickphraseHandler_.empty() &&
+            quickphrase()) {
+            quickphraseCallback_ =
+                quickphrase()->call<IQuickPhrase::addProvider>(
+                    [this](InputContext *ic, const std::string &input,
+                           const QuickPhraseAddCandidateCallback &callback) {
+                        return handleQuickPhrase(ic, input, callback);
+                    });
+        }
+    });
     return {newId};
 }
 
 std::tuple<> LuaAddonState::removeQuickPhraseHandlerImpl(int id) {
-    quickphraseHandler_.erase(id);
+    auto iter = quickphraseHandler_.find(id);
+    if (iter == quickphraseHandler_.end()) {
+        return {};
+    }
+    if (iter->second.prefixes.empty()) {
+        std::erase(quickphraseAnyPrefix_, id);
+    }
+    for (const auto &prefix : iter->second.prefixes) {
+        auto prefixIter = quickphrasePrefixes_.find(prefix);
+        if (prefixIter == quickphrasePrefixes_.end()) {
+            continue;
+        }
+        std::erase(prefixIter->second, id);
+        if (prefixIter->second.empty()) {
+            quickphrasePrefixes_.erase(prefixIter);
+        }
+    }
+    maxQuickPhrasePrefixLength_ = 0;
+    for (const auto &[prefix, _] : quickphrasePrefixes_) {
+        maxQuickPhrasePrefixLength_ =
+            std::max(maxQuickPhrasePrefixLength_, prefix.size());
+    }
+    quickphraseHandler_.erase(iter);
+    handlerHealth_.erase(id);
     if (quickphraseHandler_.empty()) {
         quickphraseCallback_.reset();
     }
@@ -470,8 +2483,8 @@ std::tuple<> LuaAddonState::removeQuickPhraseHandlerImpl(int id) {
 }
 
 std::tuple<std::vector<std::string>>
-LuaAddonState::standardPathLocateImpl(int type, const char *path,
-                                      const char *suffix) {
+LuaAddonState::standardPathLocateImpl(int type, std::string_view path,
+                                      std::string_view suffix) {
     std::vector<std::string> result;
     auto files = StandardPaths::global().locate(
         static_cast<StandardPathsType>(type), path,
@@ -485,17 +2498,19 @@ LuaAddonState::standardPathLocateImpl(int type, const char *path,
     return {std::move(result)};
 }
 
-std::tuple<std::string> LuaAddonState::UTF16ToUTF8Impl(const char *str) {
-    const auto *data = reinterpret_cast<const uint16_t *>(str);
+std::tuple<std::string> LuaAddonState::UTF16ToUTF8Impl(std::string_view str) {
+    // Lua strings are always aligned for any type.
+    const auto *data = reinterpret_cast<const uint16_t *>(str.data());
+    const size_t length = str.size() / sizeof(uint16_t);
     std::string result;
     size_t i = 0;
-    while (data[i]) {
+    while (i < length && data[i]) {
         uint32_t ucs4 = 0;
         if (data[i] < 0xD800 || data[i] > 0xDFFF) {
             ucs4 = data[i];
             i += 1;
         } else if (0xD800 <= data[i] && data[i] <= 0xDBFF) {
-            if (!data[i + 1]) {
+            if (i + 1 >= length || !data[i + 1]) {
                 return {};
             }
             if (0xDC00 <= data[i + 1] && data[i + 1] <= 0xDFFF) {
@@ -512,13 +2527,12 @@ std::tuple<std::string> LuaAddonState::UTF16ToUTF8Impl(const char *str) {
     return result;
 }
 
-std::tuple<std::string> LuaAddonState::UTF8ToUTF16Impl(const char *str) {
-    std::string s(str);
-    if (!utf8::validate(s)) {
+std::tuple<std::string> LuaAddonState::UTF8ToUTF16Impl(std::string_view str) {
+    if (!utf8::validate(str)) {
         return {};
     }
     std::vector<uint16_t> result;
-    for (const auto ucs4 : utf8::MakeUTF8CharRange(s)) {
+    for (const auto ucs4 : utf8::MakeUTF8CharRange(str)) {
         if (ucs4 < 0x10000) {
             result.push_back(static_cast<uint16_t>(ucs4));
         } else if (ucs4 < 0x110000) {
@@ -533,9 +2547,193 @@ std::tuple<std::string> LuaAddonState::UTF8ToUTF16Impl(const char *str) {
                        result.size() * sizeof(uint16_t));
 }
 
+std::tuple<std::shared_ptr<LogStore>>
+LuaAddonState::openStoreImpl(std::string_view name) {
+    if (name.empty() || name.front() == '.' ||
+        !std::all_of(name.begin(), name.end(), [](char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                   (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+        })) {
+        throw std::runtime_error("Invalid store name.");
+    }
+    const auto storeDirectory =
+        StandardPaths::global().userDirectory(StandardPathsType::PkgData) /
+        "lua/store";
+    const auto directory = storeDirectory / name_;
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    // Stores may keep what the user typed.
+    for (const auto &path : {storeDirectory, directory}) {
+        std::filesystem::permissions(path, std::filesystem::perms::owner_all,
+                                     ec);
+    }
+    return LogStore::open(
+        (directory / (std::string(name) + ".log")).string());
+}
+
+void LuaAddonState::scheduleStoreFlush(const std::shared_ptr<LogStore> &store) {
+    if (std::find(dirtyStores_.begin(), dirtyStores_.end(), store) ==
+        dirtyStores_.end()) {
+        dirtyStores_.push_back(store);
+    }
+    if (std::exchange(storeFlushScheduled_, true)) {
+        return;
+    }
+    registerHandler([this]() {
+        const auto time = now(CLOCK_MONOTONIC) + kStoreFlushDelay;
+        if (storeFlushEvent_) {
+            storeFlushEvent_->setTime(time);
+        } else {
+            storeFlushEvent_ = instance_->eventLoop().addTimeEvent(
+                CLOCK_MONOTONIC, time, 0,
+                [this](EventSourceTime *, uint64_t) {
+                    flushStores(false);
+                    return true;
+                });
+        }
+        storeFlushEvent_->setOneShot();
+    });
+}
+
+void LuaAddonState::flushStores(bool wait) {
+    storeFlushScheduled_ = false;
+    auto stores = std::move(dirtyStores_);
+    dirtyStores_.clear();
+    for (auto &store : stores) {
+        if (wait || !fileIO_) {
+            if (!store->flush()) {
+                FCITX_LUA_ERROR() << "Failed to write lua store.";
+            }
+            continue;
+        }
+        // Compacting the log may take a while, so it is not done in the
+        // event loop.
+        fileIO_->flush(watch(), store,
+                       [this, store](const std::string &error) {
+                           if (error.empty()) {
+                               return;
+                           }
+                           FCITX_LUA_ERROR() << error;
+                           // The changes are kept in the store, try again
+                           // later.
+                           scheduleStoreFlush(store);
+                       });
+    }
+}
+
+std::tuple<> LuaAddonState::readFileAsyncImpl(std::string_view path,
+                                              std::string_view function) {
+    readFile(path, function, false);
+    return {};
+}
+
+std::tuple<> LuaAddonState::readLinesAsyncImpl(std::string_view path,
+                                               std::string_view function) {
+    readFile(path, function, true);
+    return {};
+}
+
+void LuaAddonState::readFile(std::string_view path, std::string_view function,
+                             bool lines) {
+    if (!fileIO_ || sandbox_) {
+        throw std::runtime_error("File I/O is not available.");
+    }
+    // Results can't be delivered before the state is ready.
+    registerHandler([this, path = std::string(path),
+                     function = std::string(function), lines]() {
+        ++pendingFileCallbacks_;
+        fileIO_->read(
+            watch(), path, lines,
+            [this, function, lines](const std::string &chunk) {
+                callAsyncCallback(function, [this, &chunk, lines]() {
+                    if (!lines) {
+                        lua_pushlstring(state_, chunk.data(), chunk.size());
+                        return 1;
+                    }
+                    lua_createtable(
+                        state_, std::count(chunk.begin(), chunk.end(), '\n'),
+                        0);
+                    size_t start = 0;
+                    int index = 0;
+                    while (start < chunk.size()) {
+                        auto end = chunk.find('\n', start);
+                        if (end == std::string::npos) {
+                            end = chunk.size();
+                        }
+                        lua_pushlstring(state_, chunk.data() + start,
+                                        end - start);
+                        lua_rawseti(state_, -2, ++index);
+                        start = end + 1;
+                    }
+                    return 1;
+                });
+            },
+            [this, function](const std::string &error) {
+                --pendingFileCallbacks_;
+                callAsyncCallback(function, [this, &error]() {
+                    lua_pushnil(state_);
+                    if (error.empty()) {
+                        return 1;
+                    }
+                    lua_pushlstring(state_, error.data(), error.size());
+                    return 2;
+                });
+            });
+    });
+}
+
+std::tuple<>
+LuaAddonState::writeFileAsyncImpl(std::string_view path, std::string_view data,
+                                  std::optional<std::string_view> function) {
+    if (!fileIO_ || sandbox_) {
+        throw std::runtime_error("File I/O is not available.");
+    }
+    registerHandler([this, path = std::string(path), data = std::string(data),
+                     function = std::string(function.value_or(""))]() mutable {
+        LuaFileDoneCallback onDone;
+        if (!function.empty()) {
+            ++pendingFileCallbacks_;
+            onDone = [this, function](const std::string &error) {
+                --pendingFileCallbacks_;
+                callAsyncCallback(function, [this, &error]() {
+                    if (error.empty()) {
+                        lua_pushboolean(state_, true);
+                        return 1;
+                    }
+                    lua_pushnil(state_);
+                    lua_pushlstring(state_, error.data(), error.size());
+                    return 2;
+                });
+            };
+        }
+        fileIO_->write(watch(), std::move(path), std::move(data),
+                       std::move(onDone));
+    });
+    return {};
+}
+
+void LuaAddonState::callAsyncCallback(
+    const std::string &function, const std::function<int()> &pushArguments) {
+    if (degraded_) {
+        return;
+    }
+    lua_getglobal(state_, function.data());
+    const int nargs = pushArguments();
+    int rv = protectedCall(nargs, 0);
+    if (rv != LUA_OK) {
+        LuaPError(rv, "lua_pcall() failed");
+        LuaPrintError(state_.get());
+    }
+    lua_pop(state_, lua_gettop(state_));
+    flushUI();
+}
+
 RawConfig LuaAddonState::invokeLuaFunction(InputContext *ic,
                                            const std::string &name,
                                            const RawConfig &config) {
+    if (degraded_) {
+        return {};
+    }
     TrackableObjectReference<InputContext> icRef;
     if (ic) {
         icRef = ic->watch();
@@ -543,7 +2741,7 @@ RawConfig LuaAddonState::invokeLuaFunction(InputContext *ic,
     ScopedICSetter setter(inputContext_, icRef);
     lua_getglobal(state_, name.data());
     rawConfigToLua(state_.get(), config);
-    int rv = lua_pcall(state_, 1, 1, 0);
+    int rv = protectedCall(1, 1);
     RawConfig ret;
     if (rv != 0) {
         LuaPError(rv, "lua_pcall() failed");
@@ -553,6 +2751,62 @@ RawConfig LuaAddonState::invokeLuaFunction(InputContext *ic,
     }
 
     lua_pop(state_, lua_gettop(state_));
+    flushUI();
+    return ret;
+}
+
+std::tuple<std::string_view, int64_t>
+LuaAddonState::textScanImpl(std::string_view str, std::string_view className,
+                            std::optional<int64_t> init) {
+    auto charClass = luatext::charClassFromName(className);
+    if (!charClass) {
+        throw std::runtime_error("Invalid character class");
+    }
+    auto start = init.value_or(1);
+    if (start < 1) {
+        throw std::runtime_error("Invalid start index");
+    }
+    size_t count = 0;
+    auto match =
+        luatext::scan(luatext::sub(str, start, -1), *charClass, count);
+    return {match, start + count};
+}
+
+LuaValue LuaAddonState::invokeLuaFunctionTyped(
+    InputContext *ic, const std::string &name,
+    const std::vector<LuaValue> &args) {
+    if (degraded_) {
+        return {};
+    }
+    if (!lua_checkstack(state_, args.size() + 1)) {
+        FCITX_LUA_ERROR() << "Too many arguments to " << name;
+        return {};
+    }
+    TrackableObjectReference<InputContext> icRef;
+    if (ic) {
+        icRef = ic->watch();
+    }
+    ScopedICSetter setter(inputContext_, icRef);
+    lua_getglobal(state_, name.data());
+    for (const auto &arg : args) {
+        luaValueToLua(state_.get(), arg);
+    }
+    int rv = protectedCall(args.size(), 1);
+    LuaValue ret;
+    if (rv != 0) {
+        LuaPError(rv, "lua_pcall() failed");
+        LuaPrintError(state_.get());
+    } else if (lua_gettop(state_) >= 1) {
+        try {
+            ret = luaToLuaValue(state_.get(), -1);
+        } catch (const std::exception &e) {
+            FCITX_LUA_ERROR() << "Failed to convert the result of " << name
+                              << ": " << e.what();
+        }
+    }
+
+    lua_pop(state_, lua_gettop(state_));
+    flushUI();
     return ret;
 }
 
@@ -8,10 +8,20 @@
 #define _FCITX5_LUA_ADDONLOADER_LUAADDONSTATE_H_
 
 #include "config.h"
+#include "luaaddon_public.h"
+#include "luacommithistory.h"
+#include "luadictionary.h"
+#include "luafileio.h"
+#include "luaprofiler.h"
 #include "luahelper.h"
 #include "luastate.h"
+#include "luastore.h"
+#include "luatext.h"
+#include "mappeddictionary.h"
+#include <cstdint>
 #include <exception>
 #include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/event.h>
 #include <fcitx-utils/handlertable.h>
 #include <fcitx-utils/macros.h>
 #include <fcitx-utils/signals.h>
@@ -22,12 +32,15 @@
 #include <fcitx/addoninstance.h>
 #include <fcitx/addonmanager.h>
 #include <fcitx/event.h>
+#include <fcitx/inputcontextproperty.h>
 #include <fcitx/instance.h>
 #include <functional>
 #include <map>
 #include <memory>
+#include <optional>
 #include <quickphrase_public.h>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
 #include <utility>
@@ -67,16 +80,115 @@ using ScopedICSetter = ScopedSetter<TrackableObjectReference<InputContext>>;
 class EventWatcher {
 public:
     EventWatcher(std::string functionName,
-                 std::unique_ptr<HandlerTableEntry<EventHandler>> handler)
-        : functionName_(std::move(functionName)), handler_(std::move(handler)) {
-    }
+                 std::unique_ptr<HandlerTableEntry<EventHandler>> handler,
+                 bool eventObject = false, bool surroundingTextDelta = false)
+        : functionName_(std::move(functionName)), handler_(std::move(handler)),
+          eventObject_(eventObject),
+          surroundingTextDelta_(surroundingTextDelta) {}
     FCITX_INLINE_DEFINE_DEFAULT_DTOR_AND_MOVE(EventWatcher);
 
     const auto &function() const { return functionName_; }
+    // Whether the function receives the event object instead of positional
+    // arguments.
+    bool eventObject() const { return eventObject_; }
+    // Whether the function receives the change of surrounding text, which
+    // is delivered by LuaAddonState::deliverSurroundingTextDelta.
+    bool surroundingTextDelta() const { return surroundingTextDelta_; }
+    void setHandler(std::unique_ptr<HandlerTableEntry<EventHandler>> handler) {
+        handler_ = std::move(handler);
+    }
+
+    // A coalesced watcher only records the input context when the event
+    // happens, and the flush event delivers them later. The flush event is a
+    // disabled defer event if interval is 0, otherwise a time event.
+    void setFlushEvent(std::unique_ptr<EventSource> flushEvent,
+                       uint64_t interval) {
+        flushEvent_ = std::move(flushEvent);
+        interval_ = interval;
+    }
+    void addPending(InputContext *ic);
+    std::vector<TrackableObjectReference<InputContext>> takePending() {
+        return std::move(pending_);
+    }
 
 private:
     std::string functionName_;
     std::unique_ptr<HandlerTableEntry<EventHandler>> handler_;
+    bool eventObject_ = false;
+    bool surroundingTextDelta_ = false;
+    std::unique_ptr<EventSource> flushEvent_;
+    uint64_t interval_ = 0;
+    std::vector<TrackableObjectReference<InputContext>> pending_;
+};
+
+// The user interface of an input context set by fcitx.ui().
+struct LuaUIState {
+    std::string preedit;
+    // Cursor in bytes, -1 for the end of preedit.
+    int preeditCursor = -1;
+    std::string auxUp;
+    std::string auxDown;
+    std::vector<std::string> candidates;
+
+    bool operator==(const LuaUIState &) const = default;
+};
+
+// The result of the preedit filters for the last client preedit of an input
+// context. Cursors are in bytes, -1 if there is no cursor.
+struct LuaPreeditFilterState {
+    // Generation of the filters when the result is computed, 0 if there is
+    // no reusable result.
+    uint64_t generation = 0;
+    std::string input;
+    int inputCursor = -1;
+    std::string output;
+    int outputCursor = -1;
+    // Whether the client is showing output replaced by the filters.
+    bool shown = false;
+};
+
+// The lua table of an input context returned by icData, it is kept in the lua
+// registry and released together with the input context.
+class LuaInputContextData : public InputContextProperty {
+public:
+    LuaInputContextData(LuaState *state) : state_(state) {}
+    ~LuaInputContextData() {
+        luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
+        luaL_unref(state_, LUA_REGISTRYINDEX, surroundingTextRef_);
+    }
+
+    // Push the table to the stack, the table is created on first use.
+    void push() {
+        if (ref_ == LUA_NOREF) {
+            lua_newtable(state_);
+            ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+        }
+        lua_rawgeti(state_, LUA_REGISTRYINDEX, ref_);
+    }
+
+    // The user interface last flushed to the input context.
+    LuaUIState &ui() { return ui_; }
+
+    // Push text as a lua string, the string pushed last time is reused if
+    // text is not changed.
+    void pushSurroundingText(const std::string &text);
+    // The surrounding text last delivered to the delta watchers.
+    std::string &deltaSurroundingText() { return deltaSurroundingText_; }
+    LuaPreeditFilterState &preeditFilter() { return preeditFilter_; }
+    // Forget what was shown in the input context, which may be cleared by
+    // the input method or the application.
+    void resetShownState() {
+        ui_ = LuaUIState();
+        preeditFilter_ = LuaPreeditFilterState();
+    }
+
+private:
+    LuaState *state_;
+    int ref_ = LUA_NOREF;
+    LuaUIState ui_;
+    int surroundingTextRef_ = LUA_NOREF;
+    std::string deltaSurroundingText_;
+    LuaPreeditFilterState preeditFilter_;
 };
 
 ///
@@ -89,21 +201,172 @@ public:
     FCITX_INLINE_DEFINE_DEFAULT_DTOR_AND_MOVE(Converter);
 
     const auto &function() const { return functionName_; }
+    void setConnection(ScopedConnection connection) {
+        connection_ = std::move(connection);
+    }
 
 private:
     std::string functionName_;
     ScopedConnection connection_;
 };
 
-class LuaAddonState {
+struct QuickPhraseHandler {
+    std::string function;
+    // Only called if the input starts with one of them, empty for any input.
+    std::vector<std::string> prefixes;
+    // Minimum length of input in characters.
+    size_t minLength = 0;
+};
+
+// Number of recent calls used to compute the error rate of a handler.
+constexpr int kHandlerHistorySize = 32;
+// Minimum interval between two identical error messages of a handler.
+constexpr uint64_t kErrorLogInterval = 10000000;
+
+// Failure record of a handler, only exists for handlers failed recently.
+struct HandlerHealth {
+    // Bit 1 for a failed call, the lowest bit is the latest call.
+    uint32_t history = 0;
+    int calls = 0;
+    int consecutiveFailures = 0;
+    // Current backoff in microseconds, non zero if the handler was suspended
+    // and has not succeeded since then.
+    uint64_t backoff = 0;
+    uint64_t suspendedUntil = 0;
+    std::string lastError;
+    uint64_t lastLogged = 0;
+    int suppressedErrors = 0;
+};
+
+struct ErrorPolicy {
+    // Suspend a handler after this many consecutive failures, 0 to disable.
+    int maxConsecutiveFailures = 5;
+    // Suspend a handler if the percentage of failures in the recent calls is
+    // larger or equal to this, 0 to disable.
+    int maxErrorPercent = 50;
+    // Backoff in microseconds, doubled every time a handler is suspended again.
+    uint64_t backoff = 1000000;
+    uint64_t maxBackoff = 300000000;
+};
+
+// A module loaded by require through the fcitx module searcher.
+struct LuaModuleLoadInfo {
+    // Time to locate and compile or load the cached bytecode, in usec.
+    uint64_t time = 0;
+    bool cached = false;
+};
+
+// Time spent in each phase of loading an addon, in usec.
+struct LuaStartupTiming {
+    // Resolve the lua functions and create the lua state.
+    uint64_t createState = 0;
+    // Open the standard libraries and setup the module searcher.
+    uint64_t openLibs = 0;
+    // Load the fcitx modules, including base.lua.
+    uint64_t loadBase = 0;
+    // Compile the addon source.
+    uint64_t loadFile = 0;
+    // Run the top level code of the addon source, which registers the
+    // handlers directly unless the registration is deferred.
+    uint64_t execute = 0;
+    // Register the deferred handlers to fcitx in the main thread.
+    uint64_t registerHandlers = 0;
+    // Heap size of the lua state after loading, in bytes.
+    size_t heapSize = 0;
+
+    uint64_t total() const {
+        return createState + openLibs + loadBase + loadFile + execute +
+               registerHandlers;
+    }
+};
+
+// Limits of an addon running in sandbox. Loading C modules and a few
+// functions that affect the whole process are also disabled in sandbox.
+struct LuaSandboxOptions {
+    // Maximum time of each call from fcitx to lua in usec. The addon is
+    // disabled once a call runs longer than this.
+    uint64_t deadline = 100000;
+    // Maximum time of running the lua source on load in usec. The addon is
+    // not loaded if it runs longer than this.
+    uint64_t loadDeadline = 1000000;
+    // Maximum memory used by the lua state in bytes.
+    size_t memoryLimit = 64 << 20;
+};
+
+// Allocator of a sandboxed lua state, which fails when the memory limit is
+// reached.
+struct LuaSandboxAllocator {
+    lua_Alloc alloc;
+    void *ud;
+    size_t used;
+    size_t limit;
+    // Allocation only fails within calls to lua, because running out of
+    // memory outside of them would abort.
+    bool enforced = false;
+};
+
+// Content of the object returned by fcitx.buffer.
+struct LuaBuffer {
+    std::string data;
+    // Bytes charged to the allocator of sandbox.
+    size_t charged = 0;
+};
+
+class LuaAddonState : public TrackableObject<LuaAddonState> {
 public:
+    // If deferRegistration is true, the state may be constructed outside the
+    // main thread, and any handler registered to fcitx by the lua source is
+    // delayed until registerDeferredHandlers is called.
     LuaAddonState(LibraryPtr luaLibrary, const std::string &name,
-                  const std::string &library, AddonManager *manager);
+                  const std::string &library, AddonManager *manager,
+                  bool deferRegistration = false,
+                  std::optional<LuaSandboxOptions> sandbox = std::nullopt,
+                  LuaCommitHistory *commitHistory = nullptr,
+                  LuaFileIO *fileIO = nullptr);
+    ~LuaAddonState();
 
     operator LuaState *() { return state_.get(); }
 
+    // Register the handlers delayed by construction, must be called from the
+    // main thread.
+    void registerDeferredHandlers();
+
+    // Memory used by the lua state in bytes.
+    size_t heapSize();
+    // Number of garbage collection cycles finished since creation.
+    size_t gcCount() const { return gcCount_; }
+    const LuaStartupTiming &startupTiming() const { return startupTiming_; }
+    // Whether the addon is disabled for missing the deadline of sandbox.
+    bool degraded() const { return degraded_; }
+    // Modules loaded from the PkgData lua directories, indexed by module name.
+    const std::map<std::string, LuaModuleLoadInfo> &moduleLoadInfo() const {
+        return moduleLoadInfo_;
+    }
+
     RawConfig invokeLuaFunction(InputContext *ic, const std::string &name,
                                 const RawConfig &config);
+    LuaValue invokeLuaFunctionTyped(InputContext *ic, const std::string &name,
+                                    const std::vector<LuaValue> &args);
+
+    // Start sampling the lua call stack every interval instructions, the
+    // samples taken so far are dropped if it is already started. The hook is
+    // set on the main thread, and with lua 5.x a coroutine only inherits it
+    // when the coroutine is created, so coroutines created before the
+    // profiler is started are never sampled. Coroutines with an outdated
+    // hook are synced by the hook itself. LuaJIT shares the hook between all
+    // coroutines.
+    void startProfiler(int interval);
+    // Stop sampling and return the profiler with the samples, or nullptr if
+    // it is not started.
+    std::unique_ptr<LuaProfiler> stopProfiler();
+    bool profiling() const { return profiler_ != nullptr; }
+    // Whether anything registered to fcitx, data of input contexts, or a
+    // pending file I/O callback would be lost once the state is destroyed.
+    bool hasRegistrations() const;
+    // Write the changes of store in the file I/O threads after a short
+    // delay, so the changes made in a burst are written and synced together.
+    // A failed write is retried after the same delay.
+    void scheduleStoreFlush(const std::shared_ptr<LogStore> &store);
 
 private:
     InputContext *currentInputContext() { return inputContext_.get(); }
@@ -116,6 +379,14 @@ private:
     // @function lastCommit
     // @treturn string The last commit string from fcitx.
     DEFINE_LUA_FUNCTION(lastCommit);
+    /// Get a recent commit of the current input context.
+    // At most 32 commits are kept for each input context. Use recentCommits
+    // to iterate over them. Commits are recorded since the first call to
+    // commitHistory or recentCommits.
+    // @function commitHistory
+    // @int n 1 for the most recent commit, 2 for the one before it, etc.
+    // @treturn string The commit string, or nil if there is none.
+    DEFINE_LUA_FUNCTION(commitHistory);
     /// a helper function to split the string by delimiter.
     // @function splitString
     // @string str string to be split.
@@ -131,9 +402,63 @@ private:
     // @function watchEvent
     // @int event Event Type.
     // @string function the function name.
+    // @tparam[opt] table options if options.coalesce is true, the event is
+    // watched with watchEventCoalesced, with options.interval as interval.
+    // Otherwise if options.object is true, the event is watched with
+    // watchEventObject. If options.delta is true, SurroundingTextUpdated is
+    // watched with watchSurroundingTextDelta.
     // @return A unique integer identifier.
     // @see EventType
+    // @see watchEventCoalesced
+    // @see watchEventObject
+    // @see watchSurroundingTextDelta
     DEFINE_LUA_FUNCTION(watchEvent);
+    /// Watch for a event from fcitx, and coalesce the event per input context.
+    // The function is called without argument at most once per input context
+    // in every event loop iteration, or every interval milliseconds if
+    // interval is not 0. Only SurroundingTextUpdated, CursorRectChanged and
+    // UpdatePreedit can be coalesced.
+    // @function watchEventCoalesced
+    // @int event Event Type.
+    // @string function the function name.
+    // @int[opt=0] interval minimum interval between two calls in
+    // milliseconds.
+    // @return A unique integer identifier.
+    // @see watchEvent
+    DEFINE_LUA_FUNCTION(watchEventCoalesced);
+    /// Watch for a event from fcitx, and pass an event object to the function.
+    // The function is called with a single event object, whose fields are
+    // computed on first access and cached during this call. The object is
+    // reused by every call, and all fields are nil once the call returns.
+    //
+    // Fields available for every event: type, program, inputMethod, uuid,
+    // preedit, surroundingText, cursor, anchor.
+    //
+    // KeyEvent: sym, state, release, key.
+    //
+    // CommitString: text.
+    //
+    // InputMethodActivated, InputMethodDeactivated: name.
+    //
+    // SwitchInputMethod: oldInputMethod.
+    // @function watchEventObject
+    // @int event Event Type.
+    // @string function the function name.
+    // @return A unique integer identifier.
+    // @see watchEvent
+    DEFINE_LUA_FUNCTION(watchEventObject);
+    /// Watch for the change of surrounding text.
+    // Instead of the whole text, the function is called with the range
+    // changed since the last call for the same input context: offset,
+    // removed, inserted, cursor, anchor. The characters from offset to
+    // offset + removed are replaced by the string inserted. The first call
+    // for an input context inserts the whole text. Offset, length and cursor
+    // are in characters.
+    // @function watchSurroundingTextDelta
+    // @string function the function name.
+    // @return A unique integer identifier.
+    // @see watchEvent
+    DEFINE_LUA_FUNCTION(watchSurroundingTextDelta);
     /// Unwatch a certain event.
     // @function unwatchEvent
     // @int id id of the watcher.
@@ -146,6 +471,8 @@ private:
     /// Change the current input method
     // @function setCurrentInputMethod
     // @string name the unique string of the input method name.
+    // @bool[opt=false] local only change the input method of current input
+    // context when input method state is shared.
     DEFINE_LUA_FUNCTION(setCurrentInputMethod);
     /// Return the current program name
     // @function currentProgram
@@ -161,10 +488,34 @@ private:
     // @int id id of this converter.
     // @see addConverter
     DEFINE_LUA_FUNCTION(removeConverter);
+    /// Add a filter of the preedit shown in the application.
+    // The function is called with the preedit text and cursor in bytes (-1
+    // if there is no cursor) before it is sent to the application, and may
+    // return a replacement text with an optional cursor. Returning nil keeps
+    // the preedit. Filters are called in the order of registration, each
+    // with the output of the previous one. The filters are not called again
+    // if the preedit is not changed since the last call for the same input
+    // context.
+    // @function addPreeditFilter
+    // @string function the function name.
+    // @treturn int A unique integer identifier.
+    DEFINE_LUA_FUNCTION(addPreeditFilter);
+    /// Remove a preedit filter.
+    // @function removePreeditFilter
+    // @int id id of this filter.
+    // @see addPreeditFilter
+    DEFINE_LUA_FUNCTION(removePreeditFilter);
     /// Add a quick phrase handler.
+    // The handlers are called in the order of registration, and a handler
+    // returning Break stops the rest.
     // @function addQuickPhraseHandler
     // @string function the function name.
+    // @tparam[opt] table options with optional fields prefixes (an array of
+    // string, the handler is only called when the input starts with one of
+    // them) and minLength (the handler is only called when the input has at
+    // least this many characters).
     // @treturn int A unique integer identifier.
+    // @see QuickPhraseAction
     DEFINE_LUA_FUNCTION(addQuickPhraseHandler);
     /// Remove a quickphrase handler.
     // @function removeQuickPhraseHandler
@@ -193,6 +544,180 @@ private:
     // @string str UTF8 string.
     // @treturn string UTF16 string or empty string if it fails.
     DEFINE_LUA_FUNCTION(UTF8ToUTF16)
+    /// Remove Unicode white space on both sides of the string.
+    // Functions of fcitx.text count characters instead of bytes, and index
+    // starts from 1.
+    // @function text.trim
+    // @string str
+    // @treturn string
+    DEFINE_LUA_FUNCTION(textTrim)
+    /// Remove Unicode white space on the left of the string.
+    // @function text.trimLeft
+    // @string str
+    // @treturn string
+    DEFINE_LUA_FUNCTION(textTrimLeft)
+    /// Remove Unicode white space on the right of the string.
+    // @function text.trimRight
+    // @string str
+    // @treturn string
+    DEFINE_LUA_FUNCTION(textTrimRight)
+    /// Return the number of characters in the string.
+    // @function text.length
+    // @string str
+    // @treturn int The length, or nil if str is not valid UTF-8.
+    DEFINE_LUA_FUNCTION(textLength)
+    /// Return the substring from character i to j, like string.sub.
+    // @function text.sub
+    // @string str
+    // @int i index of the first character, negative to count from the end.
+    // @int[opt=-1] j index of the last character, negative to count from the
+    // end.
+    // @treturn string
+    DEFINE_LUA_FUNCTION(textSub)
+    /// Return the number of columns to display the string.
+    // Wide and fullwidth characters take two columns, control and combining
+    // characters take none.
+    // @function text.width
+    // @string str
+    // @treturn int
+    DEFINE_LUA_FUNCTION(textWidth)
+    /// Match the characters of a class from a position.
+    // Class is one of space, digit, alpha, alnum, punct, han, ascii and wide.
+    // Digit, alpha and alnum only match ASCII characters, while space and
+    // punct also match the Unicode ones.
+    // @function text.scan
+    // @string str
+    // @string class the name of the character class.
+    // @int[opt=1] init the index of character to start from.
+    // @treturn string The characters matched, may be empty.
+    // @treturn int The index of the character after the match.
+    DEFINE_LUA_FUNCTION(textScan)
+    /// Open a dictionary file built by fcitx5-lua-dictc.
+    // The file is memory mapped and shared by every lua state that opens it.
+    // The returned object supports `dict:lookup(key)`, `dict:prefix(prefix)`
+    // which returns an iterator of key and value, `dict:size()`, `#dict` and
+    // `dict[key]`. Method names take precedence over keys with `dict[key]`.
+    // @function openDictionary
+    // @string path path to the dictionary file.
+    // @return A dictionary object.
+    DEFINE_LUA_FUNCTION(openDictionary)
+    /// Read a file without blocking fcitx.
+    // The file is read in another thread, and delivered to the function in
+    // chunks of at most 64KiB. The function is called with each chunk as a
+    // string, and with nil at the end, followed by the error message if the
+    // read failed. Chunks delivered before an error are still valid. Not
+    // available in sandbox.
+    // @function readFileAsync
+    // @string path path to the file.
+    // @string function the function name.
+    DEFINE_LUA_FUNCTION(readFileAsync)
+    /// Read a file line by line without blocking fcitx.
+    // Same as readFileAsync, except the function is called with a table of
+    // the complete lines in each chunk, without the newline characters.
+    // @function readLinesAsync
+    // @string path path to the file.
+    // @string function the function name.
+    // @see readFileAsync
+    DEFINE_LUA_FUNCTION(readLinesAsync)
+    /// Replace the content of a file without blocking fcitx.
+    // The data is written to a temporary file which is renamed to path, so
+    // the file is never left half written. Writes to the same file happen in
+    // order, and a write is skipped if a newer one to the same file is
+    // requested before it starts. Pending writes are finished before fcitx
+    // exits. Not available in sandbox.
+    // @function writeFileAsync
+    // @string path path to the file.
+    // @string data the new content.
+    // @string[opt] function the function name, called with true on success,
+    // or nil and the error message.
+    DEFINE_LUA_FUNCTION(writeFileAsync)
+    /// Open a persistent key value store of the user.
+    // The store is saved under the fcitx data directory of the user, and
+    // only readable by the user. Each addon has its own stores, the same name
+    // opened by another addon is a different store. Changes are
+    // appended to a log on disk shortly after they are made, and the log is
+    // compacted once it is mostly outdated. The returned object has methods
+    // `store:get(key)`, `store:put(key, value)`, `store:delete(key)` which
+    // returns whether the key existed, `store:prefix(prefix)` which returns
+    // an iterator of key and value in key order, `store:size()`, `#store` and
+    // `store:flush()` to write the changes immediately. Keys and values are
+    // strings.
+    // @function openStore
+    // @string name name of the store, which may only contain letters,
+    // digits, "_", "-" and ".", and can't start with ".".
+    // @return A store object.
+    DEFINE_LUA_FUNCTION(openStore)
+    /// Return a table that belongs to the current input context.
+    // The same table is returned for the same input context, and it is
+    // released when the input context is destroyed, so it can be used to keep
+    // per input context state without leaking.
+    // @function icData
+    // @treturn table The table of current input context, or nil if there is no
+    // current input context.
+    static int icData(lua_State *lua);
+    /// Return the surrounding text of the current input context.
+    // The same lua string is returned until the text changes.
+    // @function surroundingText
+    // @treturn string The text, or nil if the surrounding text is not
+    // available.
+    // @treturn int The cursor in characters.
+    // @treturn int The anchor in characters.
+    static int surroundingText(lua_State *lua);
+    /// Return the user interface builder of the current input context.
+    // The builder has methods setPreedit(text, [cursor]), setAuxUp(text),
+    // setAuxDown(text), setCandidates(table of string) and clear(), each
+    // returns the builder itself so they can be chained. The changes are
+    // applied together when the current handler returns, and nothing is sent
+    // if the result is the same as the last one. Selecting a candidate
+    // commits it and clears the user interface.
+    // @function ui
+    // @return The builder object.
+    static int ui(lua_State *lua);
+    /// Create a string buffer.
+    // Appending to the buffer takes amortized constant time, unlike
+    // concatenating lua strings repeatedly. The buffer has methods
+    // add(...) to append strings or numbers, addf(format, ...) to append
+    // like string.format, rep(str, n) to append str n times and clear(),
+    // each returns the buffer itself so they can be chained. Use
+    // tostring() or the method of the same name to get the content, and the
+    // length operator to get its length in bytes. In sandbox, the memory of
+    // buffers counts towards the memory limit.
+    // @function buffer
+    // @return The buffer object.
+    static int buffer(lua_State *lua);
+    /// Convert a value to a readable string.
+    // Table keys are sorted, with numbers before strings. A table that
+    // contains itself is shown as <cycle>, and the tables nested deeper than
+    // the limit as {...}.
+    // @function dump
+    // @param value the value to dump.
+    // @int[opt=16] depth the maximum depth of nested tables, at most 1000.
+    // @treturn string The string form of value.
+    static int dump(lua_State *lua);
+    /// Return the handlers suspended because of repeated failures.
+    // A handler, which may be an event watcher, a converter or a quick
+    // phrase handler, is suspended after a number of consecutive failures or
+    // when it fails too often. A suspended handler is skipped until the
+    // backoff expires, and the backoff is doubled if it fails again right
+    // after that.
+    // @function suspendedHandlers
+    // @treturn table An array of table with id, function, failures, remaining
+    // (the remaining time in milliseconds) and error (last error message).
+    // @see resumeHandler
+    // @see setErrorPolicy
+    static int suspendedHandlers(lua_State *lua);
+    /// Resume a suspended handler immediately and clear its failure record.
+    // @function resumeHandler
+    // @int id id of the handler.
+    // @treturn boolean Whether the handler was suspended.
+    DEFINE_LUA_FUNCTION(resumeHandler);
+    /// Change when a failing handler is suspended.
+    // @function setErrorPolicy
+    // @tparam table policy with optional fields maxConsecutiveFailures (0
+    // to disable, default 5), maxErrorPercent (percentage of failures within
+    // the last 32 calls, 0 to disable, default 50), backoff (initial suspend
+    // time in milliseconds, default 1000) and maxBackoff (default 300000).
+    DEFINE_LUA_FUNCTION(setErrorPolicy);
 
     template <typename T>
     std::unique_ptr<HandlerTableEntry<EventHandler>> watchEvent(
@@ -204,50 +729,268 @@ private:
 
     std::tuple<std::string> versionImpl() { return Instance::version(); }
 
-    std::tuple<std::string> lastCommitImpl() { return lastCommit_; }
-    std::tuple<> logImpl(const char *msg);
-    std::tuple<int> watchEventImpl(int eventType, const char *function);
+    std::tuple<std::string_view> lastCommitImpl();
+    std::tuple<std::optional<std::string_view>> commitHistoryImpl(int64_t n);
+    std::tuple<> logImpl(std::string_view msg);
+    std::tuple<int> watchEventImpl(int eventType, std::string_view function) {
+        return addEventWatcher(eventType, function, false);
+    }
+    std::tuple<int> watchEventObjectImpl(int eventType,
+                                         std::string_view function) {
+        return addEventWatcher(eventType, function, true);
+    }
+    std::tuple<int> addEventWatcher(int eventType, std::string_view function,
+                                    bool eventObject);
+    std::tuple<int> watchSurroundingTextDeltaImpl(std::string_view function);
+    void deliverSurroundingTextDelta(InputContext *ic);
+    std::tuple<int> watchEventCoalescedImpl(int eventType,
+                                            std::string_view function,
+                                            std::optional<int> interval);
     std::tuple<> unwatchEventImpl(int id);
     std::tuple<std::string> currentInputMethodImpl();
-    std::tuple<> setCurrentInputMethodImpl(const char *str, bool local);
-    std::tuple<std::string> currentProgramImpl();
+    std::tuple<> setCurrentInputMethodImpl(std::string_view name,
+                                           std::optional<bool> local);
+    std::tuple<std::string_view> currentProgramImpl();
 
-    std::tuple<int> addConverterImpl(const char *function);
+    std::tuple<int> addConverterImpl(std::string_view function);
     std::tuple<> removeConverterImpl(int id);
 
-    std::tuple<int> addQuickPhraseHandlerImpl(const char *function);
+    std::tuple<int> addPreeditFilterImpl(std::string_view function);
+    std::tuple<> removePreeditFilterImpl(int id);
+    void filterPreedit(InputContextEvent &event);
+
+    std::tuple<int> addQuickPhraseHandlerImpl(
+        std::string_view function,
+        std::optional<std::vector<std::string>> prefixes,
+        std::optional<int> minLength);
     std::tuple<> removeQuickPhraseHandlerImpl(int id);
 
-    std::tuple<std::vector<std::string>> splitStringImpl(const char *str,
-                                                         const char *delim) {
+    std::tuple<std::vector<std::string>>
+    splitStringImpl(std::string_view str, std::string_view delim) {
         return stringutils::split(str, delim);
     }
 
-    std::tuple<std::string> UTF8ToUTF16Impl(const char *str);
-    std::tuple<std::string> UTF16ToUTF8Impl(const char *str);
+    std::tuple<std::string> UTF8ToUTF16Impl(std::string_view str);
+    std::tuple<std::string> UTF16ToUTF8Impl(std::string_view str);
+
+    std::tuple<std::string_view> textTrimImpl(std::string_view str) {
+        return {luatext::trim(str)};
+    }
+    std::tuple<std::string_view> textTrimLeftImpl(std::string_view str) {
+        return {luatext::trim(str, true, false)};
+    }
+    std::tuple<std::string_view> textTrimRightImpl(std::string_view str) {
+        return {luatext::trim(str, false, true)};
+    }
+    std::tuple<std::optional<int64_t>> textLengthImpl(std::string_view str) {
+        if (auto length = luatext::length(str)) {
+            return {*length};
+        }
+        return {std::nullopt};
+    }
+    std::tuple<std::string_view> textSubImpl(std::string_view str, int64_t i,
+                                             std::optional<int64_t> j) {
+        return {luatext::sub(str, i, j.value_or(-1))};
+    }
+    std::tuple<int64_t> textWidthImpl(std::string_view str) {
+        return {luatext::width(str)};
+    }
+    std::tuple<std::string_view, int64_t>
+    textScanImpl(std::string_view str, std::string_view className,
+                 std::optional<int64_t> init);
+
+    std::tuple<std::shared_ptr<const MappedDictionary>>
+    openDictionaryImpl(std::string_view path) {
+        return MappedDictionary::open(std::string(path));
+    }
+    std::tuple<std::shared_ptr<LogStore>> openStoreImpl(std::string_view name);
+    // Write the dirty stores, in the file I/O threads unless wait is true.
+    void flushStores(bool wait);
+    std::tuple<> readFileAsyncImpl(std::string_view path,
+                                   std::string_view function);
+    std::tuple<> readLinesAsyncImpl(std::string_view path,
+                                    std::string_view function);
+    std::tuple<> writeFileAsyncImpl(std::string_view path,
+                                    std::string_view data,
+                                    std::optional<std::string_view> function);
+    // Start reading for readFileAsync and readLinesAsync.
+    void readFile(std::string_view path, std::string_view function,
+                  bool lines);
+    // Call the function from the main loop without input context, with the
+    // arguments pushed by pushArguments, which returns the number of them.
+    void callAsyncCallback(const std::string &function,
+                           const std::function<int()> &pushArguments);
 
     std::tuple<std::vector<std::string>>
-    standardPathLocateImpl(int type, const char *path, const char *suffix);
+    standardPathLocateImpl(int type, std::string_view path,
+                           std::string_view suffix);
 
-    std::tuple<> commitStringImpl(const char *str);
+    std::tuple<> commitStringImpl(std::string_view str);
+
+    LuaInputContextData *inputContextData(InputContext *ic);
+    LuaInputContextData *currentInputContextData() {
+        return inputContextData(inputContext_.get());
+    }
+
+    static int uiSetPreedit(lua_State *lua);
+    static int uiSetAuxUp(lua_State *lua);
+    static int uiSetAuxDown(lua_State *lua);
+    static int uiSetCandidates(lua_State *lua);
+    static int uiClear(lua_State *lua);
+    static LuaBuffer *checkBuffer(lua_State *lua);
+    // Append to the buffer, the memory is charged to the memory limit of
+    // sandbox.
+    static void appendBuffer(lua_State *lua, LuaBuffer *buffer,
+                             std::string_view str, size_t count = 1);
+    static int bufferAdd(lua_State *lua);
+    static int bufferAddf(lua_State *lua);
+    static int bufferRep(lua_State *lua);
+    static int bufferClear(lua_State *lua);
+    static int bufferToString(lua_State *lua);
+    static int bufferLength(lua_State *lua);
+    static int bufferGC(lua_State *lua);
+    // The pending user interface of current input context, or nullptr if
+    // there is no current input context.
+    LuaUIState *pendingUI();
+    // Apply the pending user interface to the input context.
+    void flushUI();
+    void clearUI(InputContext *ic);
+    // Reset the shown state of input contexts whenever the input method or
+    // the application may clear what is shown.
+    void watchShownStateReset();
     FCITX_ADDON_DEPENDENCY_LOADER(quickphrase, instance_->addonManager());
 
     bool handleQuickPhrase(InputContext *ic, const std::string &input,
                            const QuickPhraseAddCandidateCallback &callback);
+    // Ids of quick phrase handlers that may handle the input, in order.
+    std::vector<int> matchQuickPhraseHandlers(std::string_view input) const;
+    void flushCoalescedEvent(int id);
+
+    std::tuple<bool> resumeHandlerImpl(int id);
+    std::tuple<> setErrorPolicyImpl(std::optional<int> maxConsecutiveFailures,
+                                    std::optional<int> maxErrorPercent,
+                                    std::optional<int> backoff,
+                                    std::optional<int> maxBackoff);
+    std::string handlerFunction(int id) const;
+    bool isHandlerSuspended(int id) const;
+    // Call the function on the stack like lua_pcall, and keep track of the
+    // failure of the handler.
+    int callHandler(int id, int nargs, int nresults);
+    // lua_pcall with the deadline of sandbox.
+    int protectedCall(int nargs, int nresults);
+    void setupSandbox();
+    // Install the count hook shared by sandbox and profiler, with the
+    // smallest count needed by them, or remove it if neither needs it.
+    void updateHook();
+    static void countHook(lua_State *lua, lua_Debug *debug);
+    // Whether the call in progress missed the deadline, used by the sandbox
+    // to rethrow the error caught by pcall.
+    static int sandboxExpired(lua_State *lua);
+    // Turn on or off JIT of LuaJIT, a no-op with other lua implementations.
+    void setJitEnabled(bool enabled);
+    // Start recording the commit history for the addon, return whether it can
+    // be read now. It can't be read until the handlers are registered.
+    bool useCommitHistory();
+
+    int pushEventObject();
+    static int eventObjectIndex(lua_State *lua);
+    bool pushEventField(std::string_view field);
+    // Call registration immediately, or queue it until
+    // registerDeferredHandlers if the state is still being constructed.
+    void registerHandler(std::function<void()> registration);
+    // Add searchModule to the searchers of require, right after the preload
+    // searcher.
+    void installModuleSearcher();
+    static int searchModule(lua_State *lua);
+    // Push the chunk of the module and its path and return 2, or push why it
+    // is not found and return 1. Return -1 with the error pushed if the module
+    // fails to load.
+    int loadModule(std::string_view name);
+    // Create a garbage object whose finalizer counts the collection cycles.
+    void newGCSentinel();
+    static int gcSentinel(lua_State *lua);
+
+    // Name of the addon.
+    const std::string name_;
     Instance *instance_;
+    // Owned by the loader.
+    LuaCommitHistory *commitHistory_;
+    bool commitHistoryRequested_ = false;
+    bool commitHistoryRef_ = false;
+    // Owned by the loader.
+    LuaFileIO *fileIO_;
+    // File I/O requests whose callback is not called yet.
+    size_t pendingFileCallbacks_ = 0;
+    // Used by state_ until it is closed.
+    std::unique_ptr<LuaSandboxAllocator> allocator_;
     std::unique_ptr<LuaState> state_;
     TrackableObjectReference<InputContext> inputContext_;
 
     std::unordered_map<int, EventWatcher> eventHandler_;
     std::unordered_map<int, Converter> converter_;
-    std::map<int, std::string> quickphraseHandler_;
+    std::map<int, std::string> preeditFilter_;
+    // Changed whenever a filter is added or removed, so the cached results
+    // are not reused.
+    uint64_t preeditFilterGeneration_ = 1;
+    bool filteringPreedit_ = false;
+    std::unique_ptr<HandlerTableEntry<EventHandler>> preeditFilterWatcher_;
+    std::map<int, QuickPhraseHandler> quickphraseHandler_;
+    // Handlers with prefixes, indexed by the prefix.
+    std::map<std::string, std::vector<int>, std::less<>> quickphrasePrefixes_;
+    size_t maxQuickPhrasePrefixLength_ = 0;
+    // Handlers called for any input.
+    std::vector<int> quickphraseAnyPrefix_;
 
     std::unique_ptr<HandlerTableEntry<QuickPhraseProviderCallback>>
         quickphraseCallback_;
-    std::unique_ptr<HandlerTableEntry<EventHandler>> commitHandler_;
+    std::unique_ptr<HandlerTableEntry<EventHandler>>
+        surroundingTextDeltaHandler_;
 
     int currentId_ = 0;
-    std::string lastCommit_;
+
+    std::optional<LuaUIState> pendingUI_;
+    TrackableObjectReference<InputContext> pendingUIContext_;
+    std::vector<std::unique_ptr<HandlerTableEntry<EventHandler>>>
+        shownStateWatchers_;
+    int uiObjectRef_ = LUA_NOREF;
+
+    ErrorPolicy errorPolicy_;
+    std::unordered_map<int, HandlerHealth> handlerHealth_;
+
+    // The event being dispatched to lua, and a serial that identifies the
+    // dispatch, used to invalidate the cached fields of event object.
+    Event *currentEvent_ = nullptr;
+    uint64_t currentEventSerial_ = 0;
+    uint64_t eventSerial_ = 0;
+    uint64_t cachedEventSerial_ = 0;
+    int eventObjectRef_ = LUA_NOREF;
+
+    size_t gcCount_ = 0;
+    LuaStartupTiming startupTiming_;
+    std::map<std::string, LuaModuleLoadInfo> moduleLoadInfo_;
+
+    bool deferRegistration_ = false;
+    std::vector<std::function<void()>> deferredHandlers_;
+
+    std::optional<LuaSandboxOptions> sandbox_;
+    // Deadline of the outermost call in progress, 0 if there is none.
+    uint64_t deadline_ = 0;
+    bool deadlineExceeded_ = false;
+    bool degraded_ = false;
+
+    std::unique_ptr<LuaProfiler> profiler_;
+    // Count of the installed hook, 0 if there is none.
+    int hookCount_ = 0;
+
+    // Stores changed since the last flush.
+    std::vector<std::shared_ptr<LogStore>> dirtyStores_;
+    bool storeFlushScheduled_ = false;
+    std::unique_ptr<EventSourceTime> storeFlushEvent_;
+
+    // Registered on first use of icData. It needs to be destroyed before
+    // state_, since the property releases the reference from the lua state.
+    std::unique_ptr<LambdaInputContextPropertyFactory<LuaInputContextData>>
+        icDataFactory_;
 };
 
 } // namespace fcitx
@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luacommithistory.h"
+#include <cstddef>
+#include <fcitx/event.h>
+#include <fcitx/inputcontext.h>
+#include <fcitx/inputcontextmanager.h>
+#include <fcitx/instance.h>
+#include <memory>
+#include <string>
+
+namespace fcitx {
+
+void LuaCommitRing::push(const std::string &text) {
+    entries_[next_].assign(text);
+    next_ = (next_ + 1) % kCommitHistorySize;
+    if (size_ < kCommitHistorySize) {
+        size_ += 1;
+    }
+}
+
+const std::string *LuaCommitRing::at(size_t n) const {
+    if (n < 1 || n > size_) {
+        return nullptr;
+    }
+    return &entries_[(next_ + kCommitHistorySize - n) % kCommitHistorySize];
+}
+
+LuaCommitHistory::LuaCommitHistory(Instance *instance) : instance_(instance) {
+    commitHandler_ = instance_->watchEvent(
+        EventType::InputContextCommitString, EventWatcherPhase::PreInputMethod,
+        [this](Event &event) {
+            auto &commitEvent = static_cast<CommitStringEvent &>(event);
+            lastCommit_.assign(commitEvent.text());
+            if (refCount_) {
+                commitEvent.inputContext()
+                    ->propertyFor(factory_.get())
+                    ->push(commitEvent.text());
+            }
+        });
+}
+
+void LuaCommitHistory::ref() {
+    if (refCount_++ || factory_) {
+        return;
+    }
+    factory_ =
+        std::make_unique<LambdaInputContextPropertyFactory<LuaCommitRing>>(
+            [](InputContext &) { return new LuaCommitRing; });
+    instance_->inputContextManager().registerProperty("luaCommitHistory",
+                                                      factory_.get());
+}
+
+void LuaCommitHistory::unref() {
+    if (--refCount_) {
+        return;
+    }
+    // Nobody reads the history now, and it would be stale once recording
+    // starts again.
+    instance_->inputContextManager().foreach([this](InputContext *ic) {
+        ic->propertyFor(factory_.get())->clear();
+        return true;
+    });
+}
+
+const std::string *LuaCommitHistory::at(InputContext *ic, size_t n) {
+    if (!ic || !factory_) {
+        return nullptr;
+    }
+    return ic->propertyFor(factory_.get())->at(n);
+}
+
+} // namespace fcitx
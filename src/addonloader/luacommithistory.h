@@ -0,0 +1,68 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUACOMMITHISTORY_H_
+#define _FCITX5_LUA_ADDONLOADER_LUACOMMITHISTORY_H_
+
+#include <array>
+#include <cstddef>
+#include <fcitx-utils/handlertable.h>
+#include <fcitx/event.h>
+#include <fcitx/inputcontext.h>
+#include <fcitx/inputcontextproperty.h>
+#include <fcitx/instance.h>
+#include <memory>
+#include <string>
+
+namespace fcitx {
+
+inline constexpr size_t kCommitHistorySize = 32;
+
+// Most recent commits of an input context, older ones are overwritten once
+// it is full.
+class LuaCommitRing : public InputContextProperty {
+public:
+    void push(const std::string &text);
+    // Return the nth most recent commit, starting from 1, or nullptr if
+    // there is none.
+    const std::string *at(size_t n) const;
+    void clear() { size_ = 0; }
+
+private:
+    // Strings are assigned in place to reuse their buffers.
+    std::array<std::string, kCommitHistorySize> entries_;
+    size_t next_ = 0;
+    size_t size_ = 0;
+};
+
+// Commit history shared by all lua addons of the loader. The last commit is
+// always tracked, while the commits of each input context are only recorded
+// while some addon holds a reference, so nothing is copied for the addons
+// that never read the history. Only used in the main thread.
+class LuaCommitHistory {
+public:
+    explicit LuaCommitHistory(Instance *instance);
+
+    void ref();
+    void unref();
+
+    // Return the nth most recent commit of ic, starting from 1, or nullptr
+    // if there is none.
+    const std::string *at(InputContext *ic, size_t n);
+    // The last commit of all input contexts.
+    const std::string &lastCommit() const { return lastCommit_; }
+
+private:
+    Instance *instance_;
+    size_t refCount_ = 0;
+    std::string lastCommit_;
+    std::unique_ptr<HandlerTableEntry<EventHandler>> commitHandler_;
+    std::unique_ptr<LambdaInputContextPropertyFactory<LuaCommitRing>> factory_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUACOMMITHISTORY_H_
@@ -0,0 +1,5 @@
+FOREACH_LUA_FUNCTION(lua_rawlen)
+FOREACH_LUA_FUNCTION(luaL_len)
+FOREACH_LUA_FUNCTION(lua_newuserdatauv)
+FOREACH_LUA_FUNCTION(luaL_requiref)
+FOREACH_LUA_FUNCTION(lua_isinteger)
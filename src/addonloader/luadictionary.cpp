@@ -0,0 +1,119 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luadictionary.h"
+#include "luaaddonstate.h"
+#include "luahelper.h"
+#include "luastate.h"
+#include "mappeddictionary.h"
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+namespace fcitx {
+
+namespace {
+
+using LuaDictionary = std::shared_ptr<const MappedDictionary>;
+using StringViewTraits = LuaArgTypeTraits<std::string_view>;
+
+struct LuaDictionaryIterator {
+    size_t current;
+    size_t end;
+};
+
+LuaState *luaState(lua_State *lua) { return *GetLuaAddonState(lua); }
+
+const MappedDictionary &checkDictionary(LuaState *state, int arg) {
+    return **LuaArgTypeTraits<LuaDictionary>::checkUserdata(state, arg);
+}
+
+int dictionaryLookup(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &dict = checkDictionary(state, 1);
+    if (auto value = dict.lookup(StringViewTraits::check(state, 2))) {
+        StringViewTraits::ret(state, *value);
+    } else {
+        lua_pushnil(state);
+    }
+    return 1;
+}
+
+int dictionaryPrefixNext(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &dict = *static_cast<LuaDictionary *>(
+        lua_touserdata(state, lua_upvalueindex(1)));
+    auto *iter = static_cast<LuaDictionaryIterator *>(
+        lua_touserdata(state, lua_upvalueindex(2)));
+    if (iter->current >= iter->end) {
+        return 0;
+    }
+    StringViewTraits::ret(state, dict->key(iter->current));
+    StringViewTraits::ret(state, dict->value(iter->current));
+    ++iter->current;
+    return 2;
+}
+
+int dictionaryPrefix(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &dict = checkDictionary(state, 1);
+    std::string_view prefix;
+    if (lua_gettop(state) >= 2) {
+        prefix = StringViewTraits::check(state, 2);
+    }
+    auto [first, last] = dict.prefixRange(prefix);
+    // Keep the dictionary alive as long as the iterator.
+    lua_pushvalue(state, 1);
+    auto *iter = static_cast<LuaDictionaryIterator *>(
+        lua_newuserdata(state, sizeof(LuaDictionaryIterator)));
+    iter->current = first;
+    iter->end = last;
+    lua_pushcclosure(state, &dictionaryPrefixNext, 2);
+    return 1;
+}
+
+int dictionarySize(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &dict = checkDictionary(state, 1);
+    lua_pushinteger(state, dict.size());
+    return 1;
+}
+
+int dictionaryIndex(lua_State *lua) {
+    auto *state = luaState(lua);
+    checkDictionary(state, 1);
+    // Methods take precedence over dictionary keys.
+    lua_pushvalue(state, 2);
+    lua_rawget(state, lua_upvalueindex(1));
+    if (lua_type(state, -1) != LUA_TNIL) {
+        return 1;
+    }
+    lua_pop(state, 1);
+    if (lua_type(state, 2) != LUA_TSTRING) {
+        lua_pushnil(state);
+        return 1;
+    }
+    return dictionaryLookup(lua);
+}
+
+} // namespace
+
+void LuaUserdataTraits<const MappedDictionary>::setup(LuaState *lua) {
+    static const luaL_Reg methods[] = {
+        {"lookup", &dictionaryLookup},
+        {"prefix", &dictionaryPrefix},
+        {"size", &dictionarySize},
+        {nullptr, nullptr},
+    };
+    luaL_newlib(lua, methods);
+    lua_pushcclosure(lua, &dictionaryIndex, 1);
+    lua_setfield(lua, -2, "__index");
+    lua_pushcclosure(lua, &dictionarySize, 0);
+    lua_setfield(lua, -2, "__len");
+}
+
+} // namespace fcitx
@@ -0,0 +1,25 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUADICTIONARY_H_
+#define _FCITX5_LUA_ADDONLOADER_LUADICTIONARY_H_
+
+#include "luahelper.h"
+#include "luastate.h"
+#include "mappeddictionary.h"
+#include <memory>
+
+namespace fcitx {
+
+template <>
+struct LuaUserdataTraits<const MappedDictionary> {
+    static constexpr char metatable[] = "fcitx.Dictionary";
+    static void setup(LuaState *lua);
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUADICTIONARY_H_
@@ -0,0 +1,232 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luafileio.h"
+#include "logstore.h"
+#include <cerrno>
+#include <cstddef>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/unixfd.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+namespace fcitx {
+
+namespace {
+
+std::string errorMessage(const std::string &path) {
+    return path + ": " + std::system_category().message(errno);
+}
+
+// Write data to a temporary file next to path, and rename it to path once
+// it is on disk, so path always holds either the old or the new content.
+std::string writeFileAtomically(const std::string &path,
+                                const std::string &data) {
+    std::string tempPath = path + ".XXXXXX";
+    UnixFD fd = UnixFD::own(mkostemp(tempPath.data(), O_CLOEXEC));
+    if (!fd.isValid()) {
+        return errorMessage(path);
+    }
+    // mkstemp creates the file only readable by the owner, keep the mode of
+    // the file being replaced instead.
+    struct stat st;
+    mode_t mode = stat(path.data(), &st) == 0 ? st.st_mode & 07777 : 0644;
+    bool success = fchmod(fd.fd(), mode) == 0;
+    size_t written = 0;
+    while (success && written < data.size()) {
+        auto n = fs::safeWrite(fd.fd(), data.data() + written,
+                               data.size() - written);
+        success = n > 0;
+        if (success) {
+            written += n;
+        }
+    }
+    success = success && fsync(fd.fd()) == 0;
+    fd.reset();
+    if (!success || rename(tempPath.data(), path.data()) != 0) {
+        auto error = errorMessage(path);
+        unlink(tempPath.data());
+        return error;
+    }
+    // The rename is only on disk once the directory is synced.
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    UnixFD dirFD = UnixFD::own(
+        open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!dirFD.isValid() || fsync(dirFD.fd()) != 0) {
+        return errorMessage(directory.string());
+    }
+    return {};
+}
+
+} // namespace
+
+LuaFileIO::LuaFileIO(Instance *instance) {
+    dispatcher_.attach(&instance->eventLoop());
+}
+
+LuaFileIO::~LuaFileIO() = default;
+
+void LuaFileIO::read(TrackableObjectReference<LuaAddonState> context,
+                     std::string path, bool lines,
+                     LuaFileChunkCallback onChunk,
+                     LuaFileDoneCallback onDone) {
+    auto read = std::make_shared<PendingRead>();
+    read->context = std::move(context);
+    read->path = std::move(path);
+    read->lines = lines;
+    read->onChunk = std::move(onChunk);
+    read->onDone = std::move(onDone);
+    pool_.submit([this, read]() { runRead(read); });
+}
+
+void LuaFileIO::write(TrackableObjectReference<LuaAddonState> context,
+                      std::string path, std::string data,
+                      LuaFileDoneCallback onDone) {
+    {
+        std::lock_guard lock(writeMutex_);
+        auto [iter, inserted] = writes_.try_emplace(path);
+        if (!inserted) {
+            // The running task picks it up once the current write is done.
+            auto &pending = iter->second;
+            if (!pending) {
+                pending.emplace();
+            }
+            pending->data = std::move(data);
+            pending->callbacks.emplace_back(std::move(context),
+                                            std::move(onDone));
+            return;
+        }
+    }
+    PendingWrite write;
+    write.data = std::move(data);
+    write.callbacks.emplace_back(std::move(context), std::move(onDone));
+    pool_.submit([this, path = std::move(path),
+                  write = std::move(write)]() mutable {
+        runWrite(path, std::move(write));
+    });
+}
+
+void LuaFileIO::flush(TrackableObjectReference<LuaAddonState> context,
+                      std::shared_ptr<LogStore> store,
+                      LuaFileDoneCallback onDone) {
+    pool_.submit([this, context = std::move(context), store = std::move(store),
+                  onDone = std::move(onDone)]() mutable {
+        std::string error;
+        if (!store->flush()) {
+            error = "Failed to write lua store.";
+        }
+        dispatcher_.scheduleWithContext(
+            context, [onDone = std::move(onDone), error = std::move(error)]() {
+                onDone(error);
+            });
+    });
+}
+
+void LuaFileIO::runRead(const std::shared_ptr<PendingRead> &read) {
+    if (!read->context.isValid()) {
+        return;
+    }
+    if (!read->fd.isValid()) {
+        read->fd = UnixFD::own(open(read->path.data(), O_RDONLY | O_CLOEXEC));
+        if (!read->fd.isValid()) {
+            finishRead(read, errorMessage(read->path));
+            return;
+        }
+    }
+    auto &pending = read->pending;
+    while (true) {
+        const auto size = pending.size();
+        const auto readSize =
+            size < kFileChunkSize ? kFileChunkSize - size : kFileChunkSize;
+        pending.resize(size + readSize);
+        auto n = fs::safeRead(read->fd.fd(), pending.data() + size, readSize);
+        pending.resize(size + (n > 0 ? n : 0));
+        if (n < 0) {
+            finishRead(read, errorMessage(read->path));
+            return;
+        }
+        if (n == 0) {
+            finishRead(read, {});
+            return;
+        }
+        if (!read->lines) {
+            deliverChunk(read, std::exchange(pending, {}));
+            return;
+        }
+        auto end = pending.rfind('\n');
+        if (end == std::string::npos) {
+            continue;
+        }
+        auto chunk = pending.substr(0, end + 1);
+        pending.erase(0, end + 1);
+        deliverChunk(read, std::move(chunk));
+        return;
+    }
+}
+
+void LuaFileIO::deliverChunk(const std::shared_ptr<PendingRead> &read,
+                             std::string chunk) {
+    dispatcher_.scheduleWithContext(
+        read->context, [this, read, chunk = std::move(chunk)]() {
+            read->onChunk(chunk);
+            pool_.submit([this, read]() { runRead(read); });
+        });
+}
+
+void LuaFileIO::finishRead(const std::shared_ptr<PendingRead> &read,
+                           std::string error) {
+    read->fd.reset();
+    // Chunks delivered before an error are still valid, but not the
+    // incomplete line.
+    std::string chunk;
+    if (error.empty()) {
+        chunk = std::exchange(read->pending, {});
+    }
+    dispatcher_.scheduleWithContext(
+        read->context,
+        [read, chunk = std::move(chunk), error = std::move(error)]() {
+            if (!chunk.empty()) {
+                read->onChunk(chunk);
+            }
+            read->onDone(error);
+        });
+}
+
+void LuaFileIO::runWrite(const std::string &path, PendingWrite write) {
+    while (true) {
+        auto error = writeFileAtomically(path, write.data);
+        for (auto &[context, onDone] : write.callbacks) {
+            if (!onDone) {
+                continue;
+            }
+            dispatcher_.scheduleWithContext(
+                context, [onDone = std::move(onDone), error]() {
+                    onDone(error);
+                });
+        }
+        std::lock_guard lock(writeMutex_);
+        auto iter = writes_.find(path);
+        if (!iter->second) {
+            writes_.erase(iter);
+            return;
+        }
+        write = std::move(*iter->second);
+        iter->second.reset();
+    }
+}
+
+} // namespace fcitx
@@ -0,0 +1,115 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUAFILEIO_H_
+#define _FCITX5_LUA_ADDONLOADER_LUAFILEIO_H_
+
+#include "threadpool.h"
+#include <cstddef>
+#include <fcitx-utils/eventdispatcher.h>
+#include <fcitx-utils/trackableobject.h>
+#include <fcitx-utils/unixfd.h>
+#include <fcitx/instance.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fcitx {
+
+class LuaAddonState;
+class LogStore;
+
+// Maximum size of a chunk delivered by LuaFileIO::read, unless a line is
+// longer than this.
+inline constexpr size_t kFileChunkSize = 64 * 1024;
+// Number of threads used for file I/O of all lua addons.
+inline constexpr size_t kFileIOThreads = 2;
+
+// Called in the main thread with a chunk of the file.
+using LuaFileChunkCallback = std::function<void(const std::string &chunk)>;
+// Called in the main thread once the operation finishes, with the error
+// message, or an empty string on success.
+using LuaFileDoneCallback = std::function<void(const std::string &error)>;
+
+// Reads and writes files for the lua addons in a small thread pool, so a
+// slow disk doesn't block the main thread. The results are delivered to the
+// main thread, and dropped if the state that requested them is destroyed.
+// The functions may be called from any thread.
+class LuaFileIO {
+public:
+    explicit LuaFileIO(Instance *instance);
+    ~LuaFileIO();
+
+    // Read the file in chunks. onChunk is called for each chunk, then onDone
+    // is called. If lines is true, every chunk but the last one ends with a
+    // newline. The next chunk is only read once the previous one is
+    // delivered, so the file is never queued in memory as a whole. Reading
+    // stops early if context is destroyed.
+    void read(TrackableObjectReference<LuaAddonState> context,
+              std::string path, bool lines, LuaFileChunkCallback onChunk,
+              LuaFileDoneCallback onDone);
+    // Replace the file with data atomically, by writing a temporary file in
+    // the same directory and renaming it over the file. Writes to the same
+    // path are done in order, and the data of a write that is replaced by a
+    // newer one before it starts is never written. The write is finished
+    // even if context is destroyed, only onDone is dropped.
+    void write(TrackableObjectReference<LuaAddonState> context,
+               std::string path, std::string data, LuaFileDoneCallback onDone);
+    // Write the pending changes of store, which may compact its log. The
+    // flush is finished even if context is destroyed, only onDone is
+    // dropped.
+    void flush(TrackableObjectReference<LuaAddonState> context,
+               std::shared_ptr<LogStore> store, LuaFileDoneCallback onDone);
+
+private:
+    struct PendingRead {
+        TrackableObjectReference<LuaAddonState> context;
+        std::string path;
+        bool lines;
+        LuaFileChunkCallback onChunk;
+        LuaFileDoneCallback onDone;
+        UnixFD fd;
+        // Data read but not delivered yet, which is an incomplete line in
+        // line mode.
+        std::string pending;
+    };
+
+    struct PendingWrite {
+        std::string data;
+        std::vector<std::pair<TrackableObjectReference<LuaAddonState>,
+                              LuaFileDoneCallback>>
+            callbacks;
+    };
+
+    // Read the next chunk in the thread pool.
+    void runRead(const std::shared_ptr<PendingRead> &read);
+    // Deliver the chunk to the main thread, and read the next one after
+    // that.
+    void deliverChunk(const std::shared_ptr<PendingRead> &read,
+                      std::string chunk);
+    // Deliver the rest of the file if there is no error, and finish reading.
+    void finishRead(const std::shared_ptr<PendingRead> &read,
+                    std::string error);
+    void runWrite(const std::string &path, PendingWrite write);
+
+    // Destroyed after pool_, which may still deliver results.
+    EventDispatcher dispatcher_;
+    std::mutex writeMutex_;
+    // Paths being written, with the latest write waiting for it if any.
+    std::unordered_map<std::string, std::optional<PendingWrite>> writes_;
+    // Pending tasks are finished before it is destroyed, so no write is lost
+    // on exit.
+    ThreadPool pool_{kFileIOThreads};
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUAFILEIO_H_
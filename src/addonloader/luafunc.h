@@ -3,18 +3,35 @@ FOREACH_LUA_FUNCTION(luaL_openselectedlibs)
 #else
 FOREACH_LUA_FUNCTION(luaL_openlibs)
 #endif
+#ifndef USE_LUAJIT
 FOREACH_LUA_FUNCTION(luaL_requiref)
+#endif
 #ifdef lua_newuserdata
 FOREACH_LUA_FUNCTION(lua_newuserdatauv)
 #else
 FOREACH_LUA_FUNCTION(lua_newuserdata)
 #endif
+#ifdef USE_LUAJIT
+FOREACH_LUA_FUNCTION(lua_pcall)
+FOREACH_LUA_FUNCTION(lua_call)
+FOREACH_LUA_FUNCTION(lua_remove)
+FOREACH_LUA_FUNCTION(lua_objlen)
+FOREACH_LUA_FUNCTION(lua_tointeger)
+FOREACH_LUA_FUNCTION(lua_tonumber)
+#else
 FOREACH_LUA_FUNCTION(lua_setglobal)
-FOREACH_LUA_FUNCTION(luaL_loadfilex)
+FOREACH_LUA_FUNCTION(lua_getglobal)
 FOREACH_LUA_FUNCTION(lua_pcallk)
+FOREACH_LUA_FUNCTION(lua_rawlen)
+FOREACH_LUA_FUNCTION(luaL_len)
+FOREACH_LUA_FUNCTION(luaL_checkversion_)
+FOREACH_LUA_FUNCTION(lua_tonumberx)
+FOREACH_LUA_FUNCTION(lua_isinteger)
+#endif
+FOREACH_LUA_FUNCTION(luaL_loadfilex)
 FOREACH_LUA_FUNCTION(lua_gettop)
 FOREACH_LUA_FUNCTION(lua_tolstring)
-FOREACH_LUA_FUNCTION(lua_getglobal)
+FOREACH_LUA_FUNCTION(lua_getfield)
 FOREACH_LUA_FUNCTION(lua_pushinteger)
 FOREACH_LUA_FUNCTION(lua_pushboolean)
 FOREACH_LUA_FUNCTION(lua_toboolean)
@@ -26,13 +43,35 @@ FOREACH_LUA_FUNCTION(lua_gettable)
 FOREACH_LUA_FUNCTION(lua_tointegerx)
 FOREACH_LUA_FUNCTION(lua_pushnil)
 FOREACH_LUA_FUNCTION(lua_next)
-FOREACH_LUA_FUNCTION(lua_rawlen)
-FOREACH_LUA_FUNCTION(luaL_len)
 FOREACH_LUA_FUNCTION(lua_createtable)
 FOREACH_LUA_FUNCTION(lua_rawset)
-FOREACH_LUA_FUNCTION(luaL_checkversion_)
 FOREACH_LUA_FUNCTION(luaL_setfuncs)
 FOREACH_LUA_FUNCTION(luaL_loadstring)
 FOREACH_LUA_FUNCTION(luaL_checkinteger)
 FOREACH_LUA_FUNCTION(luaL_checklstring)
 FOREACH_LUA_FUNCTION(lua_rawseti)
+FOREACH_LUA_FUNCTION(lua_touserdata)
+FOREACH_LUA_FUNCTION(lua_pushvalue)
+FOREACH_LUA_FUNCTION(lua_pushcclosure)
+FOREACH_LUA_FUNCTION(lua_setfield)
+FOREACH_LUA_FUNCTION(lua_rawget)
+FOREACH_LUA_FUNCTION(lua_setmetatable)
+FOREACH_LUA_FUNCTION(luaL_newmetatable)
+FOREACH_LUA_FUNCTION(luaL_checkudata)
+FOREACH_LUA_FUNCTION(lua_rawgeti)
+FOREACH_LUA_FUNCTION(luaL_ref)
+FOREACH_LUA_FUNCTION(luaL_unref)
+FOREACH_LUA_FUNCTION(luaL_checknumber)
+FOREACH_LUA_FUNCTION(lua_pushnumber)
+FOREACH_LUA_FUNCTION(luaL_checktype)
+FOREACH_LUA_FUNCTION(lua_checkstack)
+FOREACH_LUA_FUNCTION(lua_error)
+FOREACH_LUA_FUNCTION(lua_dump)
+FOREACH_LUA_FUNCTION(luaL_loadbufferx)
+FOREACH_LUA_FUNCTION(lua_sethook)
+FOREACH_LUA_FUNCTION(lua_gethookcount)
+FOREACH_LUA_FUNCTION(lua_getallocf)
+FOREACH_LUA_FUNCTION(lua_setallocf)
+FOREACH_LUA_FUNCTION(lua_topointer)
+FOREACH_LUA_FUNCTION(lua_getstack)
+FOREACH_LUA_FUNCTION(lua_getinfo)
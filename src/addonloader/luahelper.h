@@ -11,8 +11,17 @@
 #include <cstdint>
 #include <fcitx-utils/log.h>
 #include <fcitx-utils/macros.h>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace fcitx {
 
@@ -21,6 +30,8 @@ class LuaAddonState;
 template <typename Arg>
 struct LuaArgTypeTraits;
 
+extern decltype(&::lua_touserdata) _fcitx_lua_touserdata;
+
 template <>
 struct LuaArgTypeTraits<int> {
     static int check(LuaState *lua, int arg) {
@@ -29,6 +40,20 @@ struct LuaArgTypeTraits<int> {
     static void ret(LuaState *lua, int v) { lua_pushinteger(lua, v); }
 };
 template <>
+struct LuaArgTypeTraits<int64_t> {
+    static int64_t check(LuaState *lua, int arg) {
+        return luaL_checkinteger(lua, arg);
+    }
+    static void ret(LuaState *lua, int64_t v) { lua_pushinteger(lua, v); }
+};
+template <>
+struct LuaArgTypeTraits<double> {
+    static double check(LuaState *lua, int arg) {
+        return luaL_checknumber(lua, arg);
+    }
+    static void ret(LuaState *lua, double v) { lua_pushnumber(lua, v); }
+};
+template <>
 struct LuaArgTypeTraits<bool> {
     static bool check(LuaState *lua, int arg) {
         return lua_toboolean(lua, arg);
@@ -42,22 +67,143 @@ struct LuaArgTypeTraits<const char *> {
     }
     static void ret(LuaState *lua, const char *s) { lua_pushstring(lua, s); }
 };
+// Points to the string owned by lua, only valid until the function returns.
+template <>
+struct LuaArgTypeTraits<std::string_view> {
+    static std::string_view check(LuaState *lua, int arg) {
+        size_t length = 0;
+        const char *s = luaL_checklstring(lua, arg, &length);
+        return {s, length};
+    }
+    static void ret(LuaState *lua, std::string_view s) {
+        lua_pushlstring(lua, s.data(), s.size());
+    }
+};
 template <>
 struct LuaArgTypeTraits<std::string> {
+    static std::string check(LuaState *lua, int arg) {
+        size_t length = 0;
+        const char *s = luaL_checklstring(lua, arg, &length);
+        return {s, length};
+    }
     static void ret(LuaState *lua, const std::string &s) {
         lua_pushlstring(lua, s.data(), s.size());
     }
 };
-template <>
-struct LuaArgTypeTraits<std::vector<std::string>> {
-    static void ret(LuaState *lua, const std::vector<std::string> &s) {
-        lua_createtable(lua, s.size(), 0);
-        for (size_t i = 0; i < s.size(); i++) {
-            lua_pushlstring(lua, s[i].data(), s[i].size());
+// Missing or nil argument, and it may only be followed by other optional
+// arguments.
+template <typename T>
+struct LuaArgTypeTraits<std::optional<T>> {
+    static std::optional<T> check(LuaState *lua, int arg) {
+        if (lua_isnoneornil(lua, arg)) {
+            return std::nullopt;
+        }
+        return LuaArgTypeTraits<T>::check(lua, arg);
+    }
+    static void ret(LuaState *lua, const std::optional<T> &v) {
+        if (v) {
+            LuaArgTypeTraits<T>::ret(lua, *v);
+        } else {
+            lua_pushnil(lua);
+        }
+    }
+};
+template <typename T>
+struct LuaArgTypeTraits<std::vector<T>> {
+    static std::vector<T> check(LuaState *lua, int arg) {
+        luaL_checktype(lua, arg, LUA_TTABLE);
+        auto len = luaL_len(lua, arg);
+        std::vector<T> result;
+        result.reserve(len);
+        for (decltype(len) i = 1; i <= len; ++i) {
+            lua_rawgeti(lua, arg, i);
+            result.push_back(LuaArgTypeTraits<T>::check(lua, lua_gettop(lua)));
+            lua_pop(lua, 1);
+        }
+        return result;
+    }
+    static void ret(LuaState *lua, const std::vector<T> &v) {
+        lua_createtable(lua, v.size(), 0);
+        for (size_t i = 0; i < v.size(); i++) {
+            LuaArgTypeTraits<T>::ret(lua, v[i]);
             lua_rawseti(lua, -2, i + 1); /* In lua indices start at 1 */
         }
     }
 };
+template <typename Map>
+struct LuaMapArgTypeTraits {
+    static void ret(LuaState *lua, const Map &map) {
+        lua_createtable(lua, 0, map.size());
+        for (const auto &[key, value] : map) {
+            LuaArgTypeTraits<typename Map::key_type>::ret(lua, key);
+            LuaArgTypeTraits<typename Map::mapped_type>::ret(lua, value);
+            lua_rawset(lua, -3);
+        }
+    }
+};
+template <typename K, typename V>
+struct LuaArgTypeTraits<std::map<K, V>>
+    : LuaMapArgTypeTraits<std::map<K, V>> {};
+template <typename K, typename V>
+struct LuaArgTypeTraits<std::unordered_map<K, V>>
+    : LuaMapArgTypeTraits<std::unordered_map<K, V>> {};
+
+// Expose a C++ object to lua as a userdata holding std::shared_ptr<T>.
+// The specialization provides the name of the metatable as metatable, and
+// void setup(LuaState *) to fill the methods into the new metatable on the
+// top of the stack. __gc is set up by LuaArgTypeTraits.
+template <typename T>
+struct LuaUserdataTraits;
+
+template <typename T>
+struct LuaArgTypeTraits<std::shared_ptr<T>> {
+    static std::shared_ptr<T> check(LuaState *lua, int arg) {
+        return *checkUserdata(lua, arg);
+    }
+    static void ret(LuaState *lua, const std::shared_ptr<T> &v) {
+        if (!v) {
+            lua_pushnil(lua);
+            return;
+        }
+        auto *data = static_cast<std::shared_ptr<T> *>(
+            lua_newuserdata(lua, sizeof(std::shared_ptr<T>)));
+        new (data) std::shared_ptr<T>(v);
+        if (luaL_newmetatable(lua, LuaUserdataTraits<T>::metatable)) {
+            lua_pushcclosure(lua, &gc, 0);
+            lua_setfield(lua, -2, "__gc");
+            LuaUserdataTraits<T>::setup(lua);
+        }
+        lua_setmetatable(lua, -2);
+    }
+    // Check the argument without copying the shared pointer.
+    static std::shared_ptr<T> *checkUserdata(LuaState *lua, int arg) {
+        return static_cast<std::shared_ptr<T> *>(
+            luaL_checkudata(lua, arg, LuaUserdataTraits<T>::metatable));
+    }
+
+private:
+    static int gc(lua_State *lua) {
+        using Pointer = std::shared_ptr<T>;
+        static_cast<Pointer *>(_fcitx_lua_touserdata(lua, 1))->~Pointer();
+        return 0;
+    }
+};
+
+template <typename T>
+struct LuaIsOptionalArgument : std::false_type {};
+template <typename T>
+struct LuaIsOptionalArgument<std::optional<T>> : std::true_type {};
+
+// Arguments after the last non-optional argument may be omitted.
+template <typename... Args>
+constexpr int LuaRequiredArgumentCount() {
+    int required = 0;
+    int index = 0;
+    ((++index, required = LuaIsOptionalArgument<Args>::value ? required
+                                                             : index),
+     ...);
+    return required;
+}
 
 template <typename TraitsTuple, std::size_t... I>
 auto LuaCheckArgumentImpl(LuaState *lua, std::index_sequence<I...>) {
@@ -68,9 +214,16 @@ auto LuaCheckArgumentImpl(LuaState *lua, std::index_sequence<I...>) {
 
 template <typename Ret, typename... Args, typename T>
 std::tuple<Args...> LuaCheckArgument(LuaState *lua, Ret (T::*)(Args...)) {
-    if (auto argnum = lua_gettop(lua); argnum != sizeof...(Args)) {
-        luaL_error(lua, "Wrong argument number %d, expecting %d", argnum,
-                   sizeof...(Args));
+    constexpr int required = LuaRequiredArgumentCount<Args...>();
+    constexpr int total = sizeof...(Args);
+    if (auto argnum = lua_gettop(lua); argnum < required || argnum > total) {
+        if constexpr (required == total) {
+            luaL_error(lua, "Wrong argument number %d, expecting %d", argnum,
+                       total);
+        } else {
+            luaL_error(lua, "Wrong argument number %d, expecting %d to %d",
+                       argnum, required, total);
+        }
     }
 
     using tupleType = std::tuple<LuaArgTypeTraits<Args>...>;
@@ -97,8 +250,7 @@ int LuaReturn(LuaState *s, const std::tuple<Args...> &args) {
 constexpr char kLuaModuleName[] = "__fcitx_luaaddon";
 
 extern decltype(&::luaL_newstate) _fcitx_luaL_newstate;
-extern decltype(&::lua_getglobal) _fcitx_lua_getglobal;
-extern decltype(&::lua_touserdata) _fcitx_lua_touserdata;
+extern decltype(&::lua_getfield) _fcitx_lua_getfield;
 extern decltype(&::lua_settop) _fcitx_lua_settop;
 extern decltype(&::lua_close) _fcitx_lua_close;
 
@@ -0,0 +1,148 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUAKEYSTREAM_H_
+#define _FCITX5_LUA_ADDONLOADER_LUAKEYSTREAM_H_
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Format of the input stream recorded by the lua addon loader when
+// FCITX_LUA_RECORD is set, and played by fcitx5-lua-replay.
+//
+// The stream starts with kKeyStreamMagic, followed by records of:
+//   type (1 byte), time in usec since recording started (varint)
+// and the payload depending on type:
+//   Key: sym (varint), states (varint), release (1 byte)
+//   Commit: length of text (varint), text
+//   FocusIn: length of program name (varint), program name
+//   FocusOut: nothing
+// All varints are unsigned LEB128.
+
+namespace fcitx {
+
+inline constexpr char kKeyStreamMagic[] = {'F', 'L', 'K', 'S', 0, 1};
+
+enum class KeyStreamRecordType : uint8_t {
+    Key = 0,
+    Commit = 1,
+    FocusIn = 2,
+    FocusOut = 3,
+};
+
+struct KeyStreamRecord {
+    KeyStreamRecordType type = KeyStreamRecordType::Key;
+    uint64_t time = 0;
+    uint32_t sym = 0;
+    uint32_t states = 0;
+    bool release = false;
+    // Committed text for Commit, program name for FocusIn.
+    std::string text;
+};
+
+inline void writeKeyStreamVarint(std::ostream &out, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            byte |= 0x80;
+        }
+        out.put(static_cast<char>(byte));
+    } while (value);
+}
+
+inline bool readKeyStreamVarint(std::istream &in, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char c;
+        if (!in.get(c)) {
+            return false;
+        }
+        auto byte = static_cast<uint8_t>(c);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void writeKeyStreamHeader(std::ostream &out) {
+    out.write(kKeyStreamMagic, sizeof(kKeyStreamMagic));
+}
+
+inline bool readKeyStreamHeader(std::istream &in) {
+    char magic[sizeof(kKeyStreamMagic)];
+    return in.read(magic, sizeof(magic)) &&
+           memcmp(magic, kKeyStreamMagic, sizeof(magic)) == 0;
+}
+
+inline void writeKeyStreamRecord(std::ostream &out,
+                                 const KeyStreamRecord &record) {
+    out.put(static_cast<char>(record.type));
+    writeKeyStreamVarint(out, record.time);
+    switch (record.type) {
+    case KeyStreamRecordType::Key:
+        writeKeyStreamVarint(out, record.sym);
+        writeKeyStreamVarint(out, record.states);
+        out.put(record.release ? 1 : 0);
+        break;
+    case KeyStreamRecordType::Commit:
+    case KeyStreamRecordType::FocusIn:
+        writeKeyStreamVarint(out, record.text.size());
+        out.write(record.text.data(), record.text.size());
+        break;
+    case KeyStreamRecordType::FocusOut:
+        break;
+    }
+}
+
+// Return false on the end of stream or malformed data.
+inline bool readKeyStreamRecord(std::istream &in, KeyStreamRecord &record) {
+    char type;
+    if (!in.get(type) || !readKeyStreamVarint(in, record.time)) {
+        return false;
+    }
+    record.type = static_cast<KeyStreamRecordType>(type);
+    record.text.clear();
+    uint64_t value;
+    switch (record.type) {
+    case KeyStreamRecordType::Key: {
+        if (!readKeyStreamVarint(in, value)) {
+            return false;
+        }
+        record.sym = value;
+        if (!readKeyStreamVarint(in, value)) {
+            return false;
+        }
+        record.states = value;
+        char release;
+        if (!in.get(release)) {
+            return false;
+        }
+        record.release = release;
+        return true;
+    }
+    case KeyStreamRecordType::Commit:
+    case KeyStreamRecordType::FocusIn:
+        // Text is never that long, treat it as corrupted data.
+        if (!readKeyStreamVarint(in, value) || value > 0x100000) {
+            return false;
+        }
+        record.text.resize(value);
+        return static_cast<bool>(in.read(record.text.data(), value));
+    case KeyStreamRecordType::FocusOut:
+        return true;
+    }
+    return false;
+}
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUAKEYSTREAM_H_
@@ -0,0 +1,109 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luamodulecache.h"
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <system_error>
+
+namespace fcitx {
+
+LuaModuleCache &LuaModuleCache::global() {
+    static LuaModuleCache cache;
+    return cache;
+}
+
+LuaBytecode LuaModuleCache::get(const std::filesystem::path &path,
+                                const std::function<LuaBytecode()> &compile,
+                                bool &cached) {
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        mtime = std::filesystem::file_time_type::min();
+    }
+
+    const auto key = path.string();
+    std::unique_lock lock(mutex_);
+    auto iter = entries_.find(key);
+    if (iter != entries_.end() && iter->second.mtime == mtime) {
+        iter->second.lastUse = ++serial_;
+        auto future = iter->second.bytecode;
+        lock.unlock();
+        if (auto bytecode = future.get()) {
+            cached = true;
+            return bytecode;
+        }
+        // Compilation failed for the other caller, compile again to get the
+        // error for this one.
+        cached = false;
+        return compile();
+    }
+
+    if (iter != entries_.end()) {
+        size_ -= iter->second.size;
+    }
+    std::promise<LuaBytecode> promise;
+    auto future = promise.get_future().share();
+    const auto serial = ++serial_;
+    entries_[key] = Entry{mtime, future, serial, 0, serial};
+    lock.unlock();
+
+    LuaBytecode bytecode;
+    try {
+        bytecode = compile();
+    } catch (...) {
+        // Waiting callers see a failed compilation and compile themselves.
+        promise.set_value(nullptr);
+        lock.lock();
+        iter = entries_.find(key);
+        if (iter != entries_.end() && iter->second.serial == serial) {
+            entries_.erase(iter);
+        }
+        throw;
+    }
+    promise.set_value(bytecode);
+    cached = false;
+
+    lock.lock();
+    iter = entries_.find(key);
+    if (iter == entries_.end() || iter->second.serial != serial) {
+        return bytecode;
+    }
+    if (!bytecode) {
+        entries_.erase(iter);
+        return bytecode;
+    }
+    iter->second.size = bytecode->size();
+    size_ += bytecode->size();
+    evict();
+    return bytecode;
+}
+
+void LuaModuleCache::evict() {
+    while (entries_.size() > kModuleCacheMaxEntries ||
+           size_ > kModuleCacheMaxSize) {
+        // Entries being compiled have no size yet, and are kept for the
+        // callers waiting for them.
+        auto oldest = entries_.end();
+        for (auto iter = entries_.begin(); iter != entries_.end(); ++iter) {
+            if (iter->second.size &&
+                (oldest == entries_.end() ||
+                 iter->second.lastUse < oldest->second.lastUse)) {
+                oldest = iter;
+            }
+        }
+        if (oldest == entries_.end()) {
+            return;
+        }
+        size_ -= oldest->second.size;
+        entries_.erase(oldest);
+    }
+}
+
+} // namespace fcitx
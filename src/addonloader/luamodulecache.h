@@ -0,0 +1,67 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUAMODULECACHE_H_
+#define _FCITX5_LUA_ADDONLOADER_LUAMODULECACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fcitx {
+
+using LuaBytecode = std::shared_ptr<const std::string>;
+
+// The least recently used modules are dropped once the cache holds more
+// modules or bytecode than these.
+inline constexpr size_t kModuleCacheMaxEntries = 256;
+inline constexpr size_t kModuleCacheMaxSize = 16 * 1024 * 1024;
+
+// Process wide cache of the compiled lua modules loaded by require, shared by
+// all lua addon states. Entries are keyed by path, and invalidated when the
+// modification time of the file changes.
+class LuaModuleCache {
+public:
+    static LuaModuleCache &global();
+
+    // Return the bytecode of the module at path. If it is not cached, compile
+    // is called to produce it, and other callers asking for the same module in
+    // the meantime wait for the result instead of compiling it again. A null
+    // result of compile is not cached. cached is set to whether the result
+    // comes from the cache. If compile throws, the exception is passed to the
+    // caller, and other callers waiting for it compile the module themselves.
+    LuaBytecode get(const std::filesystem::path &path,
+                    const std::function<LuaBytecode()> &compile, bool &cached);
+
+private:
+    struct Entry {
+        std::filesystem::file_time_type mtime;
+        std::shared_future<LuaBytecode> bytecode;
+        uint64_t serial;
+        // Size of the bytecode, 0 until it is compiled.
+        size_t size = 0;
+        uint64_t lastUse = 0;
+    };
+
+    // Called with mutex_ held.
+    void evict();
+
+    std::mutex mutex_;
+    uint64_t serial_ = 0;
+    std::unordered_map<std::string, Entry> entries_;
+    // Total size of the compiled bytecode in entries_.
+    size_t size_ = 0;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUAMODULECACHE_H_
@@ -0,0 +1,90 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luaprofiler.h"
+#include "luastate.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace fcitx {
+
+LuaProfiler::LuaProfiler(int interval)
+    : interval_(std::max(interval, kProfilerMinInterval)) {}
+
+void LuaProfiler::tick(LuaState *state, lua_State *thread, int count) {
+    pending_ += count;
+    if (pending_ < interval_) {
+        return;
+    }
+    pending_ %= interval_;
+    sample(state, thread);
+}
+
+void LuaProfiler::sample(LuaState *state, lua_State *thread) {
+    lua_Debug debug;
+    int depth = 0;
+    while (depth < kProfilerMaxDepth &&
+           state->lua_getstackOnThread(thread, depth, &debug)) {
+        state->lua_getinfoOnThread(thread, "Sn", &debug);
+        if (frames_.size() <= static_cast<size_t>(depth)) {
+            frames_.emplace_back();
+        }
+        auto &frame = frames_[depth];
+        if (debug.name) {
+            frame.assign(debug.name);
+        } else if (std::strcmp(debug.what, "main") == 0) {
+            frame.assign("main chunk");
+        } else {
+            frame.assign("?");
+        }
+        if (std::strcmp(debug.what, "C") == 0) {
+            frame.append(" [C]");
+        } else {
+            frame.append(" (");
+            frame.append(debug.short_src);
+            frame.append(":");
+            frame.append(std::to_string(debug.linedefined));
+            frame.append(")");
+        }
+        // Semicolon separates the frames.
+        std::replace(frame.begin(), frame.end(), ';', ':');
+        ++depth;
+    }
+    if (!depth) {
+        return;
+    }
+    stack_.clear();
+    for (auto i = depth; i-- > 0;) {
+        stack_.append(frames_[i]);
+        if (i) {
+            stack_.push_back(';');
+        }
+    }
+    ++stacks_[stack_];
+    ++samples_;
+}
+
+std::string LuaProfiler::folded() const {
+    std::vector<std::pair<std::string_view, uint64_t>> stacks(stacks_.begin(),
+                                                              stacks_.end());
+    std::sort(stacks.begin(), stacks.end());
+    std::string result;
+    for (const auto &[stack, count] : stacks) {
+        result.append(stack);
+        result.push_back(' ');
+        result.append(std::to_string(count));
+        result.push_back('\n');
+    }
+    return result;
+}
+
+} // namespace fcitx
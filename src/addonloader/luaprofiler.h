@@ -0,0 +1,59 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUAPROFILER_H_
+#define _FCITX5_LUA_ADDONLOADER_LUAPROFILER_H_
+
+#include "luastate.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fcitx {
+
+// Default number of lua instructions between two samples.
+inline constexpr int kProfilerDefaultInterval = 10000;
+// Smaller intervals make the hook too expensive to keep it running.
+inline constexpr int kProfilerMinInterval = 100;
+// Frames deeper than this are dropped from a sample, starting from the
+// outermost one.
+inline constexpr int kProfilerMaxDepth = 64;
+
+// Sampling profiler of a lua state, driven by the count hook. Samples are
+// aggregated by call stack in memory, so the cost of a sample is walking the
+// stack and one hash table lookup.
+class LuaProfiler {
+public:
+    explicit LuaProfiler(int interval);
+
+    int interval() const { return interval_; }
+    size_t samples() const { return samples_; }
+
+    // Called from the count hook after count instructions of thread.
+    void tick(LuaState *state, lua_State *thread, int count);
+    // The samples in the folded stack format used by flamegraph tools, one
+    // line per call stack with the frames from the outermost one, separated
+    // by semicolons, followed by the number of samples.
+    std::string folded() const;
+
+private:
+    void sample(LuaState *state, lua_State *thread);
+
+    const int interval_;
+    // Instructions since the last sample.
+    int64_t pending_ = 0;
+    size_t samples_ = 0;
+    std::unordered_map<std::string, uint64_t> stacks_;
+    // Reused by sample to avoid allocation.
+    std::vector<std::string> frames_;
+    std::string stack_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUAPROFILER_H_
@@ -7,6 +7,7 @@
 #include "luastate.h"
 #include "config.h"
 #include "luahelper.h"
+#include <cmath>
 #include <stdexcept>
 
 #ifdef USE_DLOPEN
@@ -28,6 +29,43 @@ LuaState::LuaState(LibraryPtr library)
     }
 #include "luafunc.h"
 #undef FOREACH_LUA_FUNCTION
+    FILL_LUA_API(luaL_error);
+    FILL_LUA_API(lua_gc);
+    if (!luaL_error_ || !lua_gc_) {
+        throw std::runtime_error("Failed to resolve lua function");
+    }
     state_.reset(_fcitx_luaL_newstate());
 }
+
+#ifdef USE_LUAJIT
+void LuaState::luaL_requiref(const char *modname, lua_CFunction openf,
+                             int glb) {
+    lua_getfield(LUA_REGISTRYINDEX, "_LOADED");
+    lua_getfield(-1, modname);
+    if (!lua_toboolean(-1)) {
+        lua_settop(-2);
+        lua_pushcclosure(openf, 0);
+        lua_pushstring(modname);
+        lua_call(1, 1);
+        lua_pushvalue(-1);
+        lua_setfield(-3, modname);
+    }
+    lua_remove(-2);
+    if (glb) {
+        lua_pushvalue(-1);
+        lua_setfield(LUA_GLOBALSINDEX, modname);
+    }
+}
+
+int LuaState::lua_isinteger(int idx) {
+    if (lua_type(idx) != LUA_TNUMBER) {
+        return 0;
+    }
+    // LuaJIT has no integer subtype, treat integral numbers in the range of
+    // lua_Integer as integer.
+    lua_Number number = lua_tonumber(idx);
+    return std::floor(number) == number && number >= -0x1p63 &&
+           number < 0x1p63;
+}
+#endif
 } // namespace fcitx
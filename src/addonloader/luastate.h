@@ -13,12 +13,24 @@
 #include <lua.hpp> // IWYU pragma: export
 #include <memory>
 
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#ifndef luaL_newlib
+#define luaL_newlibtable(L, l)                                                 \
+    lua_createtable(L, 0, sizeof(l) / sizeof((l)[0]) - 1)
+#define luaL_newlib(L, l) (luaL_newlibtable(L, l), luaL_setfuncs(L, l, 0))
+#endif
+
 namespace fcitx {
 
 struct LuaState {
 public:
     LuaState(LibraryPtr library);
 
+    LibraryPtr library() const { return luaLibrary_; }
+
 #define FOREACH_LUA_FUNCTION DEFINE_LUA_API_FUNCTION
 #include "luafunc.h"
 #undef FOREACH_LUA_FUNCTION
@@ -28,6 +40,55 @@ public:
         return luaL_error_(state_.get(), std::forward<Args>(args)...);
     }
 
+    // Raise the error on another thread of the state, e.g. the coroutine
+    // that runs a hook.
+    template <typename... Args>
+    auto luaL_errorOnThread(lua_State *thread, Args &&...args) {
+        return luaL_error_(thread, std::forward<Args>(args)...);
+    }
+
+    // Inspect the call stack of another thread of the state.
+    int lua_getstackOnThread(lua_State *thread, int level, lua_Debug *debug) {
+        return lua_getstack_(thread, level, debug);
+    }
+    int lua_getinfoOnThread(lua_State *thread, const char *what,
+                            lua_Debug *debug) {
+        return lua_getinfo_(thread, what, debug);
+    }
+
+    // Change the hook of a coroutine, which keeps the hook it had when it
+    // was created with lua 5.x.
+    int lua_gethookcountOnThread(lua_State *thread) {
+        return lua_gethookcount_(thread);
+    }
+    void lua_sethookOnThread(lua_State *thread, lua_Hook hook, int mask,
+                             int count) {
+        lua_sethook_(thread, hook, mask, count);
+    }
+
+    // Get the argument of a finalizer, which may not run on the main thread,
+    // e.g. when LuaJIT closes the state.
+    void *lua_touserdataOnThread(lua_State *thread, int index) {
+        return lua_touserdata_(thread, index);
+    }
+
+    template <typename... Args>
+    auto lua_gc(Args &&...args) {
+        return lua_gc_(state_.get(), std::forward<Args>(args)...);
+    }
+
+#ifdef USE_LUAJIT
+    // LuaJIT implements Lua 5.1 API with a few extensions, emulate the Lua
+    // 5.3 functions that are missing there.
+    size_t lua_rawlen(int idx) { return lua_objlen(idx); }
+    lua_Integer luaL_len(int idx) { return lua_objlen(idx); }
+    void *lua_newuserdatauv(size_t size, int /*nuvalue*/) {
+        return lua_newuserdata(size);
+    }
+    void luaL_requiref(const char *modname, lua_CFunction openf, int glb);
+    int lua_isinteger(int idx);
+#endif
+
 private:
     LibraryPtr luaLibrary_ [[maybe_unused]];
 
@@ -35,21 +96,30 @@ private:
 #include "luafunc.h"
 #undef FOREACH_LUA_FUNCTION
     decltype(&::luaL_error) luaL_error_ = nullptr;
+    decltype(&::lua_gc) lua_gc_ = nullptr;
     std::unique_ptr<lua_State, std::function<void(lua_State *)>> state_;
 };
 
 #define FOREACH_LUA_FUNCTION DEFINE_BRIDGE_LUA_API_FUNCTION
 #include "luafunc.h"
+#ifdef USE_LUAJIT
+#include "luacompatfunc.h"
+#endif
 #undef FOREACH_LUA_FUNCTION
 
-// luaL_error is vaarg function, which won't work with the type cast and we
-// don't need to handle that for it either. So just manually define the
-// redirection here.
+// luaL_error and lua_gc (since 5.4) are vaarg functions, which won't work
+// with the type cast and we don't need to handle that for them either. So
+// just manually define the redirection here.
 template <typename StatePtr, typename... Args>
 auto luaL_error(const StatePtr &state, Args &&...args) {
     return state->luaL_error(std::forward<Args>(args)...);
 }
 
+template <typename StatePtr, typename... Args>
+auto lua_gc(const StatePtr &state, Args &&...args) {
+    return state->lua_gc(std::forward<Args>(args)...);
+}
+
 } // namespace fcitx
 
 #endif // _FCITX5_LUA_ADDONLOADER_LUASTATE_H_
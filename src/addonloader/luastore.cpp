@@ -0,0 +1,129 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luastore.h"
+#include "logstore.h"
+#include "luaaddonstate.h"
+#include "luahelper.h"
+#include "luastate.h"
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace fcitx {
+
+namespace {
+
+using LuaStore = std::shared_ptr<LogStore>;
+using StringViewTraits = LuaArgTypeTraits<std::string_view>;
+
+LuaState *luaState(lua_State *lua) { return *GetLuaAddonState(lua); }
+
+LuaStore &checkStore(LuaState *state, int arg) {
+    return *LuaArgTypeTraits<LuaStore>::checkUserdata(state, arg);
+}
+
+int storeGet(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &store = checkStore(state, 1);
+    if (auto value = store->get(StringViewTraits::check(state, 2))) {
+        StringViewTraits::ret(state, *value);
+    } else {
+        lua_pushnil(state);
+    }
+    return 1;
+}
+
+int storePut(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &store = checkStore(state, 1);
+    store->put(StringViewTraits::check(state, 2),
+               StringViewTraits::check(state, 3));
+    GetLuaAddonState(lua)->scheduleStoreFlush(store);
+    return 0;
+}
+
+int storeDelete(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &store = checkStore(state, 1);
+    const bool removed = store->remove(StringViewTraits::check(state, 2));
+    if (removed) {
+        GetLuaAddonState(lua)->scheduleStoreFlush(store);
+    }
+    lua_pushboolean(state, removed);
+    return 1;
+}
+
+// Stateless iterator, which finds the entry after the key returned last
+// time, so it keeps working if the store is changed during the iteration.
+int storePrefixNext(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &store = *static_cast<LuaStore *>(
+        lua_touserdata(state, lua_upvalueindex(2)));
+    size_t length = 0;
+    const char *prefix = lua_tolstring(state, lua_upvalueindex(1), &length);
+    std::optional<std::string> last;
+    if (lua_type(state, 2) == LUA_TSTRING) {
+        last.emplace(StringViewTraits::check(state, 2));
+    }
+    auto entry = store->next(std::string_view(prefix, length),
+                             last ? &*last : nullptr);
+    if (!entry) {
+        return 0;
+    }
+    StringViewTraits::ret(state, entry->first);
+    StringViewTraits::ret(state, entry->second);
+    return 2;
+}
+
+int storePrefix(lua_State *lua) {
+    auto *state = luaState(lua);
+    checkStore(state, 1);
+    std::string_view prefix;
+    if (lua_gettop(state) >= 2) {
+        prefix = StringViewTraits::check(state, 2);
+    }
+    StringViewTraits::ret(state, prefix);
+    // Keep the store alive as long as the iterator.
+    lua_pushvalue(state, 1);
+    lua_pushcclosure(state, &storePrefixNext, 2);
+    return 1;
+}
+
+int storeSize(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &store = checkStore(state, 1);
+    lua_pushinteger(state, store->size());
+    return 1;
+}
+
+int storeFlush(lua_State *lua) {
+    auto *state = luaState(lua);
+    const auto &store = checkStore(state, 1);
+    lua_pushboolean(state, store->flush());
+    return 1;
+}
+
+} // namespace
+
+void LuaUserdataTraits<LogStore>::setup(LuaState *lua) {
+    static const luaL_Reg methods[] = {
+        {"get", &storeGet},
+        {"put", &storePut},
+        {"delete", &storeDelete},
+        {"prefix", &storePrefix},
+        {"size", &storeSize},
+        {"flush", &storeFlush},
+        {nullptr, nullptr},
+    };
+    luaL_newlib(lua, methods);
+    lua_setfield(lua, -2, "__index");
+    lua_pushcclosure(lua, &storeSize, 0);
+    lua_setfield(lua, -2, "__len");
+}
+
+} // namespace fcitx
@@ -0,0 +1,24 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUASTORE_H_
+#define _FCITX5_LUA_ADDONLOADER_LUASTORE_H_
+
+#include "logstore.h"
+#include "luahelper.h"
+#include "luastate.h"
+
+namespace fcitx {
+
+template <>
+struct LuaUserdataTraits<LogStore> {
+    static constexpr char metatable[] = "fcitx.Store";
+    static void setup(LuaState *lua);
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUASTORE_H_
@@ -0,0 +1,309 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "luatext.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcitx-utils/utf8.h>
+#include <iterator>
+#include <optional>
+#include <string_view>
+
+namespace fcitx::luatext {
+
+namespace {
+
+struct CharRange {
+    uint32_t first;
+    uint32_t last;
+};
+
+constexpr uint32_t kInvalidChar = 0xFFFFFFFF;
+
+// Combining marks, zero width spaces and format characters.
+constexpr CharRange kZeroWidth[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489}, {0x0591, 0x05BD},
+    {0x0610, 0x061A},   {0x064B, 0x065F}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF},   {0x200B, 0x200F}, {0x202A, 0x202E},
+    {0x2060, 0x2064},   {0x20D0, 0x20FF}, {0x302A, 0x302D},
+    {0x3099, 0x309A},   {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF},   {0xE0100, 0xE01EF},
+};
+
+// East Asian wide and fullwidth characters, and emoji presentation.
+constexpr CharRange kWide[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x1F300, 0x1F64F},
+    {0x1F900, 0x1F9FF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+constexpr CharRange kHan[] = {
+    {0x3005, 0x3007},   {0x3021, 0x3029},   {0x3038, 0x303B},
+    {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},   {0xF900, 0xFAFF},
+    {0x20000, 0x2FA1F}, {0x30000, 0x3134F},
+};
+
+// Punctuation outside of ASCII, mostly CJK and fullwidth forms.
+constexpr CharRange kPunct[] = {
+    {0x00A1, 0x00BF}, {0x2010, 0x2027}, {0x2030, 0x205E},
+    {0x3001, 0x3003}, {0x3008, 0x3011}, {0x3014, 0x301F},
+    {0xFE10, 0xFE19}, {0xFE30, 0xFE4F}, {0xFF01, 0xFF0F},
+    {0xFF1A, 0xFF20}, {0xFF3B, 0xFF40}, {0xFF5B, 0xFF65},
+};
+
+template <size_t N>
+bool inRanges(const CharRange (&ranges)[N], uint32_t ch) {
+    const auto *iter = std::upper_bound(
+        std::begin(ranges), std::end(ranges), ch,
+        [](uint32_t ch, const CharRange &range) { return ch < range.first; });
+    return iter != std::begin(ranges) && ch <= std::prev(iter)->last;
+}
+
+bool isContinuation(char c) {
+    return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+// Decode the character at offset, and set next to the offset after it. Return
+// kInvalidChar and skip one byte if it is malformed.
+uint32_t decode(std::string_view str, size_t offset, size_t &next) {
+    auto c = static_cast<unsigned char>(str[offset]);
+    next = offset + 1;
+    if (c < 0x80) {
+        return c;
+    }
+    size_t length;
+    uint32_t ch;
+    if ((c & 0xE0) == 0xC0) {
+        length = 2;
+        ch = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+        length = 3;
+        ch = c & 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+        length = 4;
+        ch = c & 0x07;
+    } else {
+        return kInvalidChar;
+    }
+    if (offset + length > str.size()) {
+        return kInvalidChar;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if (!isContinuation(str[offset + i])) {
+            return kInvalidChar;
+        }
+        ch = (ch << 6) | (static_cast<unsigned char>(str[offset + i]) & 0x3F);
+    }
+    next = offset + length;
+    return ch;
+}
+
+// Return the offset of the character that ends at offset.
+size_t previous(std::string_view str, size_t offset) {
+    size_t start = offset - 1;
+    while (start > 0 && offset - start < 4 && isContinuation(str[start])) {
+        --start;
+    }
+    size_t next;
+    if (decode(str, start, next) == kInvalidChar || next != offset) {
+        return offset - 1;
+    }
+    return start;
+}
+
+size_t asciiPrefixLength(std::string_view str) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= str.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, str.data() + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+    while (i < str.size() && !(static_cast<unsigned char>(str[i]) & 0x80)) {
+        ++i;
+    }
+    return i;
+}
+
+size_t countChars(std::string_view str) {
+    size_t offset = asciiPrefixLength(str);
+    size_t count = offset;
+    while (offset < str.size()) {
+        decode(str, offset, offset);
+        ++count;
+    }
+    return count;
+}
+
+// Move offset forward by n characters, stop at the end of str.
+size_t advance(std::string_view str, size_t offset, uint64_t n) {
+    for (; n > 0 && offset < str.size(); --n) {
+        decode(str, offset, offset);
+    }
+    return offset;
+}
+
+bool isSpace(uint32_t ch) {
+    if (ch < 0x80) {
+        return ch == ' ' || (ch >= '\t' && ch <= '\r');
+    }
+    return ch == 0x85 || ch == 0xA0 || ch == 0x1680 ||
+           (ch >= 0x2000 && ch <= 0x200A) || ch == 0x2028 || ch == 0x2029 ||
+           ch == 0x202F || ch == 0x205F || ch == 0x3000;
+}
+
+bool isDigit(uint32_t ch) { return ch >= '0' && ch <= '9'; }
+
+bool isAlpha(uint32_t ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+}
+
+size_t charWidth(uint32_t ch) {
+    if (ch < 0x80) {
+        return ch >= 0x20 && ch != 0x7F;
+    }
+    if (ch == kInvalidChar) {
+        return 1;
+    }
+    if (ch < 0xA0 || inRanges(kZeroWidth, ch)) {
+        return 0;
+    }
+    return inRanges(kWide, ch) ? 2 : 1;
+}
+
+bool matches(uint32_t ch, CharClass charClass) {
+    switch (charClass) {
+    case CharClass::Space:
+        return isSpace(ch);
+    case CharClass::Digit:
+        return isDigit(ch);
+    case CharClass::Alpha:
+        return isAlpha(ch);
+    case CharClass::Alnum:
+        return isAlpha(ch) || isDigit(ch);
+    case CharClass::Punct:
+        if (ch < 0x80) {
+            return ch > ' ' && ch < 0x7F && !isAlpha(ch) && !isDigit(ch);
+        }
+        return ch != kInvalidChar && inRanges(kPunct, ch);
+    case CharClass::Han:
+        return ch != kInvalidChar && inRanges(kHan, ch);
+    case CharClass::Ascii:
+        return ch < 0x80;
+    case CharClass::Wide:
+        return charWidth(ch) == 2;
+    }
+    return false;
+}
+
+} // namespace
+
+std::optional<CharClass> charClassFromName(std::string_view name) {
+    static constexpr std::pair<std::string_view, CharClass> names[] = {
+        {"space", CharClass::Space}, {"digit", CharClass::Digit},
+        {"alpha", CharClass::Alpha}, {"alnum", CharClass::Alnum},
+        {"punct", CharClass::Punct}, {"han", CharClass::Han},
+        {"ascii", CharClass::Ascii}, {"wide", CharClass::Wide},
+    };
+    for (const auto &[className, charClass] : names) {
+        if (className == name) {
+            return charClass;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view trim(std::string_view str, bool left, bool right) {
+    size_t start = 0;
+    size_t end = str.size();
+    if (left) {
+        size_t next;
+        while (start < end && isSpace(decode(str, start, next))) {
+            start = next;
+        }
+    }
+    if (right) {
+        while (end > start) {
+            auto prev = previous(str, end);
+            size_t next;
+            if (prev < start || !isSpace(decode(str, prev, next))) {
+                break;
+            }
+            end = prev;
+        }
+    }
+    return str.substr(start, end - start);
+}
+
+std::optional<size_t> length(std::string_view str) {
+    auto ascii = asciiPrefixLength(str);
+    if (ascii == str.size()) {
+        return ascii;
+    }
+    if (!utf8::validate(str.substr(ascii))) {
+        return std::nullopt;
+    }
+    return countChars(str);
+}
+
+std::string_view sub(std::string_view str, int64_t start, int64_t end) {
+    std::optional<int64_t> total;
+    auto count = [&total, str]() {
+        if (!total) {
+            total = countChars(str);
+        }
+        return *total;
+    };
+    if (start < 0) {
+        start = std::max<int64_t>(count() + start + 1, 1);
+    } else if (start == 0) {
+        start = 1;
+    }
+    if (end < 0) {
+        end = count() + end + 1;
+    }
+    if (start > end) {
+        return {};
+    }
+    auto begin = advance(str, 0, start - 1);
+    auto stop = advance(str, begin, end - start + 1);
+    return str.substr(begin, stop - begin);
+}
+
+size_t width(std::string_view str) {
+    size_t result = 0;
+    size_t offset = 0;
+    while (offset < str.size()) {
+        result += charWidth(decode(str, offset, offset));
+    }
+    return result;
+}
+
+std::string_view scan(std::string_view str, CharClass charClass,
+                      size_t &count) {
+    size_t offset = 0;
+    count = 0;
+    while (offset < str.size()) {
+        size_t next;
+        if (!matches(decode(str, offset, next), charClass)) {
+            break;
+        }
+        offset = next;
+        ++count;
+    }
+    return str.substr(0, offset);
+}
+
+} // namespace fcitx::luatext
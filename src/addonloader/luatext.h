@@ -0,0 +1,56 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_LUATEXT_H_
+#define _FCITX5_LUA_ADDONLOADER_LUATEXT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// Text utilities of the fcitx.text lua module. Indices and lengths are in
+// characters unless noted. Malformed UTF-8 does not fail except for length,
+// every byte that can not be decoded is treated as a character.
+namespace fcitx::luatext {
+
+enum class CharClass {
+    Space,
+    Digit,
+    Alpha,
+    Alnum,
+    Punct,
+    Han,
+    Ascii,
+    Wide,
+};
+
+// Return the class named name, the name is the lower case of the enum.
+std::optional<CharClass> charClassFromName(std::string_view name);
+
+// Remove Unicode white space from either side of str.
+std::string_view trim(std::string_view str, bool left = true,
+                      bool right = true);
+
+// Number of characters in str, or nullopt if str is not valid UTF-8.
+std::optional<size_t> length(std::string_view str);
+
+// Characters from start to end, both inclusive, with the same rule of index as
+// string.sub of lua.
+std::string_view sub(std::string_view str, int64_t start, int64_t end);
+
+// Number of terminal columns to display str. Wide and fullwidth characters
+// take two columns, control and combining characters take none.
+size_t width(std::string_view str);
+
+// Return the leading characters of str in charClass, and set count to the
+// number of them.
+std::string_view scan(std::string_view str, CharClass charClass,
+                      size_t &count);
+
+} // namespace fcitx::luatext
+
+#endif // _FCITX5_LUA_ADDONLOADER_LUATEXT_H_
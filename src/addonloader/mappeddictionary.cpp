@@ -0,0 +1,275 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "mappeddictionary.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fcitx {
+
+namespace {
+
+constexpr char kDictionaryMagic[8] = {'F', 'C', 'X', 'L', 'D', 'I', 'C', 'T'};
+constexpr uint32_t kDictionaryVersion = 1;
+constexpr size_t kEntryFields = 4;
+
+struct DictionaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t poolOffset;
+    uint64_t poolSize;
+};
+
+static_assert(sizeof(DictionaryHeader) == 32);
+
+// Write data to a temporary file next to path, and rename it to path once
+// it is on disk. The file may be mapped by a running fcitx, which keeps
+// reading the old file instead of seeing it truncated.
+bool writeFileAtomically(const std::string &path, const std::string &data) {
+    std::string tempPath = path + ".XXXXXX";
+    int fd = mkostemp(tempPath.data(), O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    // mkstemp creates the file only readable by the owner, keep the mode of
+    // the file being replaced instead.
+    struct stat st;
+    mode_t mode = stat(path.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644;
+    bool success = fchmod(fd, mode) == 0;
+    size_t written = 0;
+    while (success && written < data.size()) {
+        auto n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        success = n > 0;
+        if (success) {
+            written += n;
+        }
+    }
+    success = success && fsync(fd) == 0;
+    close(fd);
+    if (!success || rename(tempPath.c_str(), path.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+    // The rename is only on disk once the directory is synced.
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    int dirFD = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFD < 0) {
+        return false;
+    }
+    success = fsync(dirFD) == 0;
+    close(dirFD);
+    return success;
+}
+
+} // namespace
+
+MappedDictionary::MappedDictionary(const void *data, size_t size)
+    : data_(data), size_(size) {
+    DictionaryHeader header;
+    if (size_ < sizeof(header)) {
+        throw std::runtime_error("Dictionary file is too small.");
+    }
+    memcpy(&header, data_, sizeof(header));
+    if (memcmp(header.magic, kDictionaryMagic, sizeof(kDictionaryMagic)) !=
+            0 ||
+        header.version != kDictionaryVersion) {
+        throw std::runtime_error("Invalid dictionary file.");
+    }
+    const uint64_t tableEnd =
+        sizeof(header) +
+        static_cast<uint64_t>(header.count) * kEntryFields * sizeof(uint32_t);
+    if (tableEnd > header.poolOffset || header.poolOffset > size_ ||
+        header.poolSize > size_ - header.poolOffset) {
+        throw std::runtime_error("Corrupted dictionary file.");
+    }
+    const auto *bytes = static_cast<const char *>(data_);
+    entries_ = reinterpret_cast<const uint32_t *>(bytes + sizeof(header));
+    pool_ = bytes + header.poolOffset;
+    poolSize_ = header.poolSize;
+    count_ = header.count;
+}
+
+MappedDictionary::~MappedDictionary() {
+    munmap(const_cast<void *>(data_), size_);
+}
+
+std::shared_ptr<const MappedDictionary>
+MappedDictionary::open(const std::string &path) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string,
+                              std::weak_ptr<const MappedDictionary>>
+        cache;
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open dictionary: " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to stat dictionary: " + path);
+    }
+    // Key on the file identity, so a replaced file gets mapped again.
+    auto key = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) +
+               ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+               std::to_string(st.st_mtim.tv_nsec);
+
+    std::lock_guard lock(mutex);
+    if (auto iter = cache.find(key); iter != cache.end()) {
+        if (auto dict = iter->second.lock()) {
+            close(fd);
+            return dict;
+        }
+    }
+
+    const auto size = static_cast<size_t>(st.st_size);
+    void *data = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                      : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map dictionary: " + path);
+    }
+    std::shared_ptr<const MappedDictionary> dict;
+    try {
+        dict.reset(new MappedDictionary(data, size));
+    } catch (...) {
+        munmap(data, size);
+        throw;
+    }
+    std::erase_if(cache,
+                  [](const auto &item) { return item.second.expired(); });
+    cache[key] = dict;
+    return dict;
+}
+
+void MappedDictionary::write(
+    const std::string &path,
+    std::vector<std::pair<std::string, std::string>> entries) {
+    std::stable_sort(
+        entries.begin(), entries.end(),
+        [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+    // Keep the last value of duplicated keys.
+    std::vector<std::pair<std::string, std::string>> unique;
+    unique.reserve(entries.size());
+    for (auto &entry : entries) {
+        if (!unique.empty() && unique.back().first == entry.first) {
+            unique.back().second = std::move(entry.second);
+        } else {
+            unique.push_back(std::move(entry));
+        }
+    }
+
+    std::vector<uint32_t> table;
+    table.reserve(unique.size() * kEntryFields);
+    std::string pool;
+    auto append = [&table, &pool](const std::string &str) {
+        if (pool.size() + str.size() > UINT32_MAX) {
+            throw std::runtime_error("Dictionary is too large.");
+        }
+        table.push_back(pool.size());
+        table.push_back(str.size());
+        pool.append(str);
+    };
+    for (const auto &[key, value] : unique) {
+        append(key);
+        append(value);
+    }
+
+    DictionaryHeader header;
+    memcpy(header.magic, kDictionaryMagic, sizeof(kDictionaryMagic));
+    header.version = kDictionaryVersion;
+    header.count = unique.size();
+    header.poolOffset = sizeof(header) + table.size() * sizeof(uint32_t);
+    header.poolSize = pool.size();
+
+    std::string data(reinterpret_cast<const char *>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char *>(table.data()),
+                table.size() * sizeof(uint32_t));
+    data.append(pool);
+    if (!writeFileAtomically(path, data)) {
+        throw std::runtime_error("Failed to write dictionary: " + path);
+    }
+}
+
+std::string_view MappedDictionary::string(uint32_t offset,
+                                          uint32_t length) const {
+    if (offset > poolSize_ || length > poolSize_ - offset) {
+        return {};
+    }
+    return {pool_ + offset, length};
+}
+
+std::string_view MappedDictionary::key(size_t index) const {
+    const auto *entry = entries_ + index * kEntryFields;
+    return string(entry[0], entry[1]);
+}
+
+std::string_view MappedDictionary::value(size_t index) const {
+    const auto *entry = entries_ + index * kEntryFields;
+    return string(entry[2], entry[3]);
+}
+
+size_t MappedDictionary::lowerBound(std::string_view key) const {
+    size_t first = 0;
+    size_t count = count_;
+    while (count > 0) {
+        size_t step = count / 2;
+        size_t middle = first + step;
+        if (this->key(middle) < key) {
+            first = middle + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    return first;
+}
+
+std::optional<std::string_view>
+MappedDictionary::lookup(std::string_view key) const {
+    auto index = lowerBound(key);
+    if (index < count_ && this->key(index) == key) {
+        return value(index);
+    }
+    return std::nullopt;
+}
+
+std::pair<size_t, size_t>
+MappedDictionary::prefixRange(std::string_view prefix) const {
+    auto first = lowerBound(prefix);
+    auto last = first;
+    while (last < count_ && key(last).starts_with(prefix)) {
+        ++last;
+    }
+    return {first, last};
+}
+
+} // namespace fcitx
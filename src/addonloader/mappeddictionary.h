@@ -0,0 +1,73 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_MAPPEDDICTIONARY_H_
+#define _FCITX5_LUA_ADDONLOADER_MAPPEDDICTIONARY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace fcitx {
+
+// On disk layout of the dictionary, all integers are in native byte order.
+//
+// Header:
+//   char[8]  magic "FCXLDICT"
+//   uint32_t version
+//   uint32_t number of entries
+//   uint64_t offset of string pool
+//   uint64_t size of string pool
+// Entry table, sorted by key in byte order:
+//   uint32_t key offset, key length, value offset, value length
+// String pool:
+//   Key and value bytes, offsets are relative to the start of the pool.
+class MappedDictionary {
+public:
+    ~MappedDictionary();
+
+    // Map the dictionary file at given path. The same file is only mapped once
+    // per process and shared by every caller until all references are gone.
+    static std::shared_ptr<const MappedDictionary>
+    open(const std::string &path);
+
+    // Write entries into a dictionary file. Entries do not need to be sorted,
+    // and the last value wins if a key is duplicated. The file is replaced
+    // by rename, so processes that have the old one open keep using it.
+    // Throw std::runtime_error if it can't be written.
+    static void write(const std::string &path,
+                      std::vector<std::pair<std::string, std::string>> entries);
+
+    size_t size() const { return count_; }
+    std::string_view key(size_t index) const;
+    std::string_view value(size_t index) const;
+
+    std::optional<std::string_view> lookup(std::string_view key) const;
+    // Return the index range [first, last) of keys starting with prefix.
+    std::pair<size_t, size_t> prefixRange(std::string_view prefix) const;
+
+private:
+    MappedDictionary(const void *data, size_t size);
+
+    size_t lowerBound(std::string_view key) const;
+    std::string_view string(uint32_t offset, uint32_t length) const;
+
+    const void *data_;
+    size_t size_;
+    const uint32_t *entries_ = nullptr;
+    const char *pool_ = nullptr;
+    uint64_t poolSize_ = 0;
+    size_t count_ = 0;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_MAPPEDDICTIONARY_H_
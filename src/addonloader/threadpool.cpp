@@ -0,0 +1,58 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "threadpool.h"
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+namespace fcitx {
+
+ThreadPool::ThreadPool(size_t maxThreads)
+    : maxThreads_(std::max<size_t>(maxThreads, 1)) {}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+void ThreadPool::enqueue(std::function<void()> task) {
+    {
+        std::lock_guard lock(mutex_);
+        tasks_.push_back(std::move(task));
+        if (idle_ < tasks_.size() && threads_.size() < maxThreads_) {
+            threads_.emplace_back(&ThreadPool::run, this);
+        }
+    }
+    condition_.notify_one();
+}
+
+void ThreadPool::run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        ++idle_;
+        condition_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+        --idle_;
+        if (tasks_.empty()) {
+            return;
+        }
+        auto task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+} // namespace fcitx
@@ -0,0 +1,60 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _FCITX5_LUA_ADDONLOADER_THREADPOOL_H_
+#define _FCITX5_LUA_ADDONLOADER_THREADPOOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fcitx {
+
+// A small fixed size thread pool. Threads are only spawned when there is no
+// idle thread to pick up a new task, and the pending tasks are drained before
+// the pool is destroyed.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t maxThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    template <typename F>
+    auto submit(F &&f) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        using ResultType = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<ResultType()>>(
+            std::forward<F>(f));
+        auto future = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return future;
+    }
+
+private:
+    void enqueue(std::function<void()> task);
+    void run();
+
+    const size_t maxThreads_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> threads_;
+    size_t idle_ = 0;
+    bool stop_ = false;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_LUA_ADDONLOADER_THREADPOOL_H_
@@ -0,0 +1,83 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "mappeddictionary.h"
+#include <exception>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+void usage(const char *argv0) {
+    std::cout << "Usage: " << argv0 << " [-s separator] <input> <output>"
+              << std::endl
+              << "Build a dictionary for fcitx.openDictionary from a text "
+                 "file."
+              << std::endl
+              << "Each line of input is a key and a value, split by the "
+                 "first separator."
+              << std::endl
+              << "\t-s <separator>\tkey value separator, default is space"
+              << std::endl
+              << "\t-h\t\tshow this help" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::string separator = " ";
+    int c;
+    while ((c = getopt(argc, argv, "s:h")) != -1) {
+        switch (c) {
+        case 's':
+            separator = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 2 != argc || separator.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::ifstream in(argv[optind]);
+    if (!in) {
+        std::cerr << "Failed to open " << argv[optind] << std::endl;
+        return 1;
+    }
+
+    std::vector<std::pair<std::string, std::string>> entries;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        auto pos = line.find(separator);
+        if (pos == std::string::npos || pos == 0) {
+            continue;
+        }
+        entries.emplace_back(line.substr(0, pos),
+                             line.substr(pos + separator.size()));
+    }
+
+    try {
+        fcitx::MappedDictionary::write(argv[optind + 1], std::move(entries));
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
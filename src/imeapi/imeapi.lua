@@ -127,7 +127,16 @@ function candidateTrigger(input)
     return result
 end
 
-local function registerQuickPhrase()
+-- Commands are routed by their prefix, so handleQuickPhrase is only called
+-- for every input if there is any trigger.
+local function registerQuickPhraseCommand(command_name)
+    return fcitx.addQuickPhraseHandler("handleQuickPhrase", {
+        prefixes = { command_name },
+        minLength = 2,
+    })
+end
+
+local function registerQuickPhraseTrigger()
     if state.quickphrase == nil then
         state.quickphrase = fcitx.addQuickPhraseHandler("handleQuickPhrase")
     end
@@ -150,7 +159,7 @@ function ime.register_command(
         fcitx.log("Already registered command: " .. command_name)
         return
     end
-    registerQuickPhrase()
+    registerQuickPhraseCommand(command_name)
     commands[command_name] = {
         func = lua_function_name,
         leading = leading,
@@ -167,7 +176,7 @@ function ime.register_trigger(
     input_trigger_strings, -- A table of string to match input trigger.
     candidate_trigger_strings -- A table of string ot match candidate.
 )
-    registerQuickPhrase()
+    registerQuickPhraseTrigger()
     table.insert(triggers, {func = lua_function_name, description = description, input_trigger_strings = input_trigger_strings, candidate_trigger_strings = candidate_trigger_strings})
 end
 
@@ -250,23 +259,21 @@ end
 -- @string s
 -- @treturn string
 function ime.trim_string(s)
-    return (s:gsub("^%s*(.-)%s*$", "%1"))
+    return fcitx.text.trim(s)
 end
 
 --- Trim the white space on the left.
 -- @string s
 -- @treturn string
 function ime.trim_string_left(s)
-    return (s:gsub("^%s*", ""))
+    return fcitx.text.trimLeft(s)
 end
 
 --- Trim the white space on the right.
 -- @string s
 -- @treturn string
 function ime.trim_string_right(s)
-    local n = #s
-    while n > 0 and s:find("^%s", n) do n = n - 1 end
-    return s:sub(1, n)
+    return fcitx.text.trimRight(s)
 end
 
 --- Helper function to convert UTF16 string to UTF8.
@@ -42,3 +42,11 @@ assert(_MAPPING["b"][2] == "吧")
 assert(_MAPPING["c"][1] == "从")
 assert(_MAPPING["c"][2] == "穿")
 assert(_MAPPING["c"][3] == "出")
+
+-- Called after testlua requires the same module, so it comes from the cache
+-- shared by all lua addons.
+function testSharedRequire()
+    local testmodule = require("testlua.testmodule")
+    assert(testmodule.add(1, 2) == 3)
+    return "True"
+end
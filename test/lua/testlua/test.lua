@@ -9,6 +9,12 @@ fcitx.log("ABCD");
 
 fcitx.watchEvent(fcitx.EventType.KeyEvent, "key_logger")
 fcitx.addConverter("convert")
+fcitx.watchEvent(fcitx.EventType.CursorRectChanged, "cursor_rect_changed", { coalesce = true })
+fcitx.watchEvent(fcitx.EventType.KeyEvent, "key_object_logger", { object = true })
+fcitx.watchEvent(fcitx.EventType.KeyEvent, "failing_key_handler")
+fcitx.setErrorPolicy({ maxConsecutiveFailures = 3 })
+
+local cursorRectChanged = 0
 
 function key_logger(sym, state, release)
     if state == fcitx.KeyState.Ctrl then
@@ -17,6 +23,26 @@ function key_logger(sym, state, release)
     return false
 end
 
+local lastKeyEvent = nil
+local lastKeyObject = ""
+
+function key_object_logger(event)
+    if not event.release then
+        assert(event.sym == event.sym)
+        lastKeyObject = event.key .. " " .. event.program
+        lastKeyEvent = event
+    end
+    return false
+end
+
+function failing_key_handler()
+    error("failing_key_handler always fails")
+end
+
+function cursor_rect_changed()
+    cursorRectChanged = cursorRectChanged + 1
+end
+
 function convert(str)
     print("Convert called")
     str = string.gsub(str, "([abc])", string.upper)
@@ -56,3 +82,348 @@ end
 function testUtf8Conversion(str)
     return fcitx.UTF16ToUTF8(str)
 end
+
+function testDictionary(path)
+    local dict = fcitx.openDictionary(path)
+    assert(dict:size() == 4)
+    assert(#dict == 4)
+    assert(dict:lookup("a") == "啊")
+    assert(dict["b"] == "不,吧")
+    assert(dict:lookup("d") == nil)
+    local keys = {}
+    for key, value in dict:prefix("a") do
+        table.insert(keys, key)
+    end
+    assert(#keys == 2)
+    assert(keys[1] == "a")
+    assert(keys[2] == "ab")
+    -- The same file is shared.
+    local other = fcitx.openDictionary(path)
+    assert(other:lookup("c") == "从,穿,出")
+    return "True"
+end
+
+function testCoalescedEvent()
+    return tostring(cursorRectChanged)
+end
+
+function testICData()
+    local data = fcitx.icData()
+    data.count = (data.count or 0) + 1
+    return tostring(data.count)
+end
+
+function testEventObject()
+    -- Event object is not accessible after the call.
+    assert(lastKeyEvent.key == nil)
+    return lastKeyObject
+end
+
+function testSuspendedHandlers()
+    local handlers = fcitx.suspendedHandlers()
+    assert(#handlers == 1)
+    assert(handlers[1]["function"] == "failing_key_handler")
+    assert(handlers[1].failures == 3)
+    assert(fcitx.resumeHandler(handlers[1].id))
+    assert(not fcitx.resumeHandler(handlers[1].id))
+    assert(#fcitx.suspendedHandlers() == 0)
+    return "True"
+end
+
+function testUI()
+    local ui = fcitx.ui()
+    assert(ui == fcitx.ui())
+    ui:setAuxUp("aux"):setCandidates({ "a", "b" })
+    return "True"
+end
+
+function testArguments()
+    -- Trailing optional argument can be omitted.
+    local id = fcitx.watchEventCoalesced(fcitx.EventType.CursorRectChanged,
+                                         "cursor_rect_changed")
+    fcitx.unwatchEvent(id)
+    assert(not pcall(fcitx.watchEventCoalesced,
+                     fcitx.EventType.CursorRectChanged))
+    assert(not pcall(fcitx.unwatchEvent, id, id))
+    -- Strings are passed with length.
+    local parts = fcitx.splitString("a,b\0c", ",")
+    assert(#parts == 2)
+    assert(parts[2] == "b\0c")
+    return "True"
+end
+
+local quickphraseCalls = {}
+local quickphraseHandlers = {}
+
+local function recordQuickPhrase(name, input)
+    table.insert(quickphraseCalls, name .. ":" .. input)
+end
+
+function quickphrase_handler(input)
+    return nil
+end
+
+function quickphrase_any(input)
+    recordQuickPhrase("any", input)
+end
+
+function quickphrase_ab(input)
+    recordQuickPhrase("ab", input)
+    if input == "abz" then
+        return { { "", "", fcitx.QuickPhraseAction.Break } }
+    end
+end
+
+function quickphrase_cd(input)
+    recordQuickPhrase("cd", input)
+end
+
+function quickphrase_last(input)
+    recordQuickPhrase("last", input)
+end
+
+function testQuickPhraseHandler()
+    assert(not pcall(fcitx.addQuickPhraseHandler, "quickphrase_handler",
+                     { prefixes = "ab" }))
+    assert(not pcall(fcitx.addQuickPhraseHandler, "quickphrase_handler",
+                     { minLength = -1 }))
+    local id = fcitx.addQuickPhraseHandler("quickphrase_handler", {
+        prefixes = { "ab", "cd" },
+        minLength = 3,
+    })
+    fcitx.removeQuickPhraseHandler(id)
+    quickphraseHandlers = {
+        fcitx.addQuickPhraseHandler("quickphrase_any"),
+        fcitx.addQuickPhraseHandler("quickphrase_ab", { prefixes = { "ab" } }),
+        fcitx.addQuickPhraseHandler("quickphrase_cd", {
+            prefixes = { "cd" },
+            minLength = 3,
+        }),
+        fcitx.addQuickPhraseHandler("quickphrase_last"),
+    }
+    return "True"
+end
+
+-- Return the handlers called since the last call, in call order.
+function testQuickPhraseHandlerResult()
+    local result = table.concat(quickphraseCalls, ",")
+    quickphraseCalls = {}
+    return result
+end
+
+function testQuickPhraseHandlerRemove()
+    for _, id in ipairs(quickphraseHandlers) do
+        fcitx.removeQuickPhraseHandler(id)
+    end
+    return "True"
+end
+
+function testTypedInvoke(number, list, map)
+    assert(math.type == nil or math.type(number) == "integer")
+    assert(number == 42)
+    assert(#list == 3 and list[1] == true and list[2] == 1.5)
+    assert(list[3] == "a")
+    assert(map.key == "value")
+    return { number + 1, 0.5, "b", { x = false, [3] = "c" }, {} }
+end
+
+function testTypedInvokeFloatKey()
+    return { x = 1, [1.5] = "a" }
+end
+
+function testRequire()
+    local testmodule = require("testlua.testmodule")
+    assert(testmodule.add(1, 2) == 3)
+    assert(require("testlua.testmodule") == testmodule)
+    local ok, err = pcall(require, "testlua.nonexistent")
+    assert(not ok and err:find("fcitx lua directories"))
+    return "True"
+end
+
+local surroundingDeltas = {}
+
+function surrounding_delta(offset, removed, inserted, cursor, anchor)
+    table.insert(surroundingDeltas, string.format("%d,%d,%s,%d,%d", offset,
+                                                  removed, inserted, cursor,
+                                                  anchor))
+end
+
+function testWatchSurroundingText()
+    fcitx.watchEvent(fcitx.EventType.SurroundingTextUpdated,
+                     "surrounding_delta", { delta = true })
+    return "True"
+end
+
+function testSurroundingText()
+    local text, cursor, anchor = fcitx.surroundingText()
+    assert(fcitx.surroundingText() == text)
+    return table.concat(surroundingDeltas, ";") .. "|" ..
+        string.format("%s,%d,%d", text, cursor, anchor)
+end
+
+function testText()
+    local text = fcitx.text
+    assert(text.trim(" \t你好 世界\u{3000}\n") == "你好 世界")
+    assert(text.trimLeft("  ab  ") == "ab  ")
+    assert(text.trimRight("  ab\u{3000}") == "  ab")
+    assert(text.length("a你好") == 3)
+    assert(text.length("\xff") == nil)
+    assert(text.sub("a你好世界", 2, 3) == "你好")
+    assert(text.sub("a你好世界", -2) == "世界")
+    assert(text.sub("a你好世界", 4, 2) == "")
+    assert(text.width("a你好\u{301}") == 5)
+    local match, next = text.scan("123abc你好", "digit")
+    assert(match == "123" and next == 4)
+    match, next = text.scan("123abc你好", "han", 7)
+    assert(match == "你好" and next == 9)
+    assert(not pcall(text.scan, "abc", "unknown"))
+    return "True"
+end
+
+function testCommitHistory()
+    local commits = {}
+    for _, text in fcitx.recentCommits() do
+        table.insert(commits, text)
+    end
+    assert(fcitx.commitHistory(#commits + 1) == nil)
+    return table.concat(commits, ",") .. "|" .. fcitx.lastCommit()
+end
+
+function testBuffer()
+    local buffer = fcitx.buffer()
+    buffer:add("a", 1):addf("%02d", 3):rep("xy", 2)
+    assert(#buffer == 8)
+    assert(tostring(buffer) == "a103xyxy")
+    assert(buffer:clear():tostring() == "")
+    return "True"
+end
+
+function testDump()
+    local t = {1, "a\n", x = {y = true}}
+    t.self = t
+    assert(fcitx.dump(t) ==
+           '{ [1] = 1, [2] = "a\\n", ["self"] = <cycle>, ["x"] = { ["y"] = true } }')
+    assert(fcitx.dump(t, 1) ==
+           '{ [1] = 1, [2] = "a\\n", ["self"] = <cycle>, ["x"] = {...} }')
+    assert(fcitx.dump({}) == "{}")
+    assert(fcitx.dump("s") == '"s"')
+    local nested = {}
+    for _ = 1, 2000 do
+        nested = {nested}
+    end
+    assert(fcitx.dump(nested, 1e9):find("{...}", 1, true))
+    return "True"
+end
+
+function testSandbox()
+    assert(os.exit == nil)
+    assert(package.loadlib == nil)
+    assert(jit == nil and debug == nil and string.dump == nil)
+    assert(io.open == nil and os.remove == nil and os.rename == nil)
+    assert(not load("\27Lua"))
+    assert(load("return 1")() == 1)
+    assert(not pcall(fcitx.writeFileAsync, "sandbox.txt", ""))
+    assert(not pcall(fcitx.buffer().rep, fcitx.buffer(), "x", 1073741824))
+    assert(require("testlua.testmodule"))
+    return "True"
+end
+
+function testDeadline()
+    -- The error of the deadline can't be caught.
+    while true do
+        pcall(function()
+            while true do
+            end
+        end)
+    end
+end
+
+function testAsync(config)
+    return tostring(tonumber(config) * 2)
+end
+
+local fileIOPath
+local fileIOLines = {}
+fileIOResult = nil
+
+function testFileIO(path)
+    fileIOPath = path
+    fcitx.writeFileAsync(path, "a\nb\n\nc", "onFileWritten")
+    return "True"
+end
+
+function onFileWritten(success, err)
+    assert(success, err)
+    fcitx.readLinesAsync(fileIOPath, "onFileLines")
+end
+
+function onFileLines(lines, err)
+    if lines == nil then
+        assert(err == nil, err)
+        fileIOResult = table.concat(fileIOLines, ",")
+        return
+    end
+    for _, line in ipairs(lines) do
+        table.insert(fileIOLines, line)
+    end
+end
+
+function testFileIOResult()
+    return fileIOResult
+end
+
+local function profiledLoop(n)
+    local sum = 0
+    for i = 1, n do
+        sum = sum + i % 7
+    end
+    return sum
+end
+
+function testProfiler()
+    local sum = 0
+    for _ = 1, 10 do
+        sum = sum + profiledLoop(10000)
+    end
+    assert(sum > 0)
+    return "True"
+end
+
+function testStore()
+    local store = fcitx.openStore("testlua")
+    for _, key in ipairs({"b/2", "a/1", "b/1", "c"}) do
+        store:put(key, key .. "!")
+    end
+    assert(store:get("a/1") == "a/1!")
+    assert(store:delete("a/1"))
+    assert(not store:delete("a/1"))
+    assert(store:get("a/1") == nil)
+    local keys = {}
+    for key, value in store:prefix("b/") do
+        assert(value == key .. "!")
+        table.insert(keys, key)
+    end
+    assert(table.concat(keys, ",") == "b/1,b/2")
+    assert(#fcitx.openStore("testlua") == 3)
+    assert(not pcall(fcitx.openStore, "../testlua"))
+    store:flush()
+    return "True"
+end
+
+local preeditFilterCalls = 0
+local preeditFilterId = nil
+
+function upper_preedit(text, cursor)
+    preeditFilterCalls = preeditFilterCalls + 1
+    return string.upper(text)
+end
+
+function testPreeditFilter()
+    preeditFilterId = fcitx.addPreeditFilter("upper_preedit")
+    return "True"
+end
+
+function testPreeditFilterResult()
+    fcitx.removePreeditFilter(preeditFilterId)
+    return tostring(preeditFilterCalls)
+end
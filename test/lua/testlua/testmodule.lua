@@ -0,0 +1,12 @@
+--
+-- SPDX-FileCopyrightText: 2026 Weng Xuetian <wengxt@gmail.com>
+--
+-- SPDX-License-Identifier: LGPL-2.1-or-later
+--
+local testmodule = {}
+
+function testmodule.add(a, b)
+    return a + b
+end
+
+return testmodule
@@ -0,0 +1,232 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+// Replay an input stream recorded with FCITX_LUA_RECORD through the test
+// frontend against a set of lua addons, and report the latency of each type
+// of event together with the memory statistics of the addons.
+//
+// Usage: fcitx5-lua-replay <stream> [lua addon...]
+#include "luaaddon_public.h"
+#include "luakeystream.h"
+#include "testdir.h"
+#include "testfrontend_public.h"
+#include "testim_public.h"
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/eventdispatcher.h>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/log.h>
+#include <fcitx-utils/macros.h>
+#include <fcitx-utils/standardpaths.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx-utils/testing.h>
+#include <fcitx/addonmanager.h>
+#include <fcitx/inputcontext.h>
+#include <fcitx/inputcontextmanager.h>
+#include <fcitx/inputmethodgroup.h>
+#include <fcitx/inputmethodmanager.h>
+#include <fcitx/instance.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace fcitx;
+
+namespace {
+
+const char *recordTypeName(KeyStreamRecordType type) {
+    switch (type) {
+    case KeyStreamRecordType::Key:
+        return "Key";
+    case KeyStreamRecordType::Commit:
+        return "Commit";
+    case KeyStreamRecordType::FocusIn:
+        return "FocusIn";
+    case KeyStreamRecordType::FocusOut:
+        return "FocusOut";
+    }
+    return "Unknown";
+}
+
+long long statValue(const RawConfig &stats, const std::string &name) {
+    const auto *value = stats.valueByPath(name);
+    return value ? std::stoll(*value) : 0;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, int percent) {
+    return sorted[(sorted.size() - 1) * percent / 100];
+}
+
+class Replayer {
+public:
+    Replayer(Instance *instance, std::vector<KeyStreamRecord> records,
+             std::vector<std::string> addons)
+        : instance_(instance), records_(std::move(records)),
+          addons_(std::move(addons)) {}
+
+    void start() {
+        // Route all keys to testim, which accepts nothing, so lua addons see
+        // every key like they do in the recorded session.
+        auto groupName = instance_->inputMethodManager().currentGroup();
+        InputMethodGroup group(groupName);
+        group.inputMethodList().push_back(InputMethodGroupItem("testim"));
+        group.setDefaultInputMethod("testim");
+        instance_->inputMethodManager().setGroup(group);
+        testfrontend_ = instance_->addonManager().addon("testfrontend");
+
+        for (const auto &addon : addons_) {
+            auto *luaaddon = instance_->addonManager().addon(addon);
+            if (!luaaddon) {
+                std::cerr << "Failed to load " << addon << std::endl;
+                instance_->exit();
+                return;
+            }
+            before_[addon] = luaaddon->call<ILuaAddon::stats>();
+        }
+
+        // Play one record per event loop iteration, so deferred and
+        // coalesced work of the addons runs in between like in production.
+        timer_ = instance_->eventLoop().addTimeEvent(
+            CLOCK_MONOTONIC, now(CLOCK_MONOTONIC), 0,
+            [this](EventSourceTime *source, uint64_t) {
+                if (next_ == records_.size()) {
+                    report();
+                    instance_->exit();
+                    return true;
+                }
+                play(records_[next_++]);
+                source->setNextInterval(0);
+                source->setOneShot();
+                return true;
+            });
+    }
+
+private:
+    InputContext *inputContext(const std::string &program) {
+        auto iter = inputContexts_.find(program);
+        if (iter == inputContexts_.end()) {
+            auto uuid =
+                testfrontend_->call<ITestFrontend::createInputContext>(program);
+            iter = inputContexts_.emplace(program, uuid).first;
+        }
+        return instance_->inputContextManager().findByUUID(iter->second);
+    }
+
+    void play(const KeyStreamRecord &record) {
+        if (!current_) {
+            current_ = inputContext("replay");
+        }
+        auto start = now(CLOCK_MONOTONIC);
+        switch (record.type) {
+        case KeyStreamRecordType::Key:
+            testfrontend_->call<ITestFrontend::keyEvent>(
+                current_->uuid(),
+                Key(static_cast<KeySym>(record.sym), KeyStates(record.states)),
+                record.release);
+            break;
+        case KeyStreamRecordType::Commit:
+            current_->commitString(record.text);
+            break;
+        case KeyStreamRecordType::FocusIn:
+            current_ = inputContext(record.text);
+            current_->focusIn();
+            break;
+        case KeyStreamRecordType::FocusOut:
+            current_->focusOut();
+            break;
+        }
+        auto latency = now(CLOCK_MONOTONIC) - start;
+        latency_[recordTypeName(record.type)].push_back(latency);
+    }
+
+    void report() {
+        std::cout << "Replayed " << records_.size() << " events" << std::endl;
+        for (auto &[type, samples] : latency_) {
+            std::sort(samples.begin(), samples.end());
+            std::cout << type << ": count=" << samples.size()
+                      << " p50=" << percentile(samples, 50) << "us"
+                      << " p99=" << percentile(samples, 99) << "us"
+                      << " max=" << samples.back() << "us" << std::endl;
+        }
+        for (const auto &addon : addons_) {
+            auto *luaaddon = instance_->addonManager().addon(addon);
+            auto after = luaaddon->call<ILuaAddon::stats>();
+            const auto &before = before_[addon];
+            auto heapBefore = statValue(before, "HeapSize");
+            auto heapAfter = statValue(after, "HeapSize");
+            auto gcCount =
+                statValue(after, "GCCount") - statValue(before, "GCCount");
+            std::cout << addon << ": heap=" << heapAfter << " bytes ("
+                      << (heapAfter >= heapBefore ? "+" : "")
+                      << heapAfter - heapBefore
+                      << ") gc=" << gcCount << std::endl;
+        }
+    }
+
+    Instance *instance_;
+    AddonInstance *testfrontend_ = nullptr;
+    std::vector<KeyStreamRecord> records_;
+    std::vector<std::string> addons_;
+    size_t next_ = 0;
+    InputContext *current_ = nullptr;
+    std::unordered_map<std::string, ICUUID> inputContexts_;
+    std::map<std::string, std::vector<uint64_t>> latency_;
+    std::unordered_map<std::string, RawConfig> before_;
+    std::unique_ptr<EventSourceTime> timer_;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <stream> [lua addon...]"
+                  << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in || !readKeyStreamHeader(in)) {
+        std::cerr << "Invalid input stream " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<KeyStreamRecord> records;
+    KeyStreamRecord record;
+    while (readKeyStreamRecord(in, record)) {
+        records.push_back(record);
+    }
+    std::vector<std::string> addons(argv + 2, argv + argc);
+    if (addons.empty()) {
+        addons.push_back("testlua");
+    }
+
+    setupTestingEnvironmentPath(
+        TESTING_BINARY_DIR, {"bin"},
+        {"test", TESTING_SOURCE_DIR "/test",
+         StandardPaths::fcitxPath("pkgdatadir", "testing")});
+
+    fcitx::Log::setLogRule("default=3,lua=3");
+    std::string arg0 = "fcitx5-lua-replay";
+    std::string arg1 = "--disable=all";
+    std::string arg2 = "--enable=testim,testfrontend,luaaddonloader," +
+                       stringutils::join(addons, ",");
+    char *instanceArgv[] = {arg0.data(), arg1.data(), arg2.data()};
+    Instance instance(FCITX_ARRAY_SIZE(instanceArgv), instanceArgv);
+    instance.addonManager().registerDefaultLoader(nullptr);
+    Replayer replayer(&instance, std::move(records), std::move(addons));
+    EventDispatcher dispatcher;
+    dispatcher.attach(&instance.eventLoop());
+    dispatcher.schedule([&replayer]() { replayer.start(); });
+    instance.exec();
+
+    return 0;
+}
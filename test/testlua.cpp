@@ -5,31 +5,49 @@
  *
  */
 #include "luaaddon_public.h"
+#include "luakeystream.h"
+#include "quickphrase_public.h"
 #include "testdir.h"
 #include "testfrontend_public.h"
 #include "testim_public.h"
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
 #include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/event.h>
 #include <fcitx-utils/eventdispatcher.h>
 #include <fcitx-utils/key.h>
 #include <fcitx-utils/keysym.h>
 #include <fcitx-utils/log.h>
 #include <fcitx-utils/macros.h>
+#include <fcitx-utils/rect.h>
 #include <fcitx-utils/standardpaths.h>
 #include <fcitx-utils/testing.h>
 #include <fcitx/addonmanager.h>
+#include <fcitx/candidatelist.h>
 #include <fcitx/event.h>
+#include <fcitx/inputcontext.h>
 #include <fcitx/inputmethodgroup.h>
 #include <fcitx/inputmethodmanager.h>
+#include <fcitx/inputpanel.h>
 #include <fcitx/instance.h>
+#include <fcitx/text.h>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 using namespace fcitx;
 
 void scheduleEvent(EventDispatcher *dispatcher, Instance *instance) {
+    std::promise<AddonInstance *> ready;
     dispatcher->schedule([instance]() {
         auto *luaaddonloader =
             instance->addonManager().addon("luaaddonloader", true);
@@ -39,7 +57,7 @@ void scheduleEvent(EventDispatcher *dispatcher, Instance *instance) {
         auto *imeapi = instance->addonManager().addon("imeapi");
         FCITX_ASSERT(imeapi);
     });
-    dispatcher->schedule([dispatcher, instance]() {
+    dispatcher->schedule([instance, &ready]() {
         // Setup the input method group with two input method
         auto groupName = instance->inputMethodManager().currentGroup();
         InputMethodGroup group(groupName);
@@ -74,8 +92,38 @@ void scheduleEvent(EventDispatcher *dispatcher, Instance *instance) {
         testfrontend->call<ITestFrontend::keyEvent>(uuid, Key("c"), false);
         testfrontend->call<ITestFrontend::keyEvent>(uuid, Key("d"), false);
 
-        // Test lua currentInputMethod
+        // Test preedit filter, which is only called when the preedit changes.
+        ic->setCapabilityFlags(ic->capabilityFlags() | CapabilityFlag::Preedit);
         auto ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testPreeditFilter", RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        for (const auto *preedit : {"abc", "abc", "abd"}) {
+            Text text(preedit);
+            text.setCursor(2);
+            ic->inputPanel().setClientPreedit(text);
+            ic->updatePreedit();
+            ic->updatePreedit();
+        }
+        FCITX_ASSERT(ic->inputPanel().clientPreedit().toString() == "ABD");
+        FCITX_ASSERT(ic->inputPanel().clientPreedit().cursor() == 2);
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testPreeditFilterResult", RawConfig{});
+        FCITX_ASSERT(ret.value() == "2") << ret;
+        ic->inputPanel().setClientPreedit(Text());
+        ic->updatePreedit();
+
+        // Test event object passed to watcher.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testEventObject", RawConfig{});
+        FCITX_ASSERT(ret.value() == "d testapp") << ret;
+
+        // The failing key handler is suspended after three failures.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testSuspendedHandlers", RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+
+        // Test lua currentInputMethod
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
             ic, "testInputMethod", RawConfig{});
         FCITX_INFO() << ret;
         assert(ret.value() == "keyboard-us");
@@ -126,23 +174,360 @@ void scheduleEvent(EventDispatcher *dispatcher, Instance *instance) {
             ic, "testUtf8Conversion", strConfig);
         FCITX_ASSERT(ret.value() == testString) << ret;
 
-        dispatcher->detach();
-        instance->exit();
+        // Test memory mapped dictionary.
+        RawConfig dictConfig;
+        dictConfig.setValue(TESTING_BINARY_DIR "/test/testdict.dict");
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testDictionary", dictConfig);
+        FCITX_ASSERT(ret.value() == "True") << ret;
+
+        // Test optional and length aware arguments.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testArguments",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+
+        // Test quick phrase handler with prefixes. Handlers run in the order
+        // of registration if the input matches the prefix and minLength, and
+        // Break stops the rest.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testQuickPhraseHandler", RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        auto *quickphrase = instance->addonManager().addon("quickphrase");
+        FCITX_ASSERT(quickphrase);
+        for (const auto &[input, expected] :
+             std::vector<std::pair<std::string, std::string>>{
+                 {"abz", "any:abz,ab:abz"},
+                 {"abc", "any:abc,ab:abc,last:abc"},
+                 {"cd", "any:cd,last:cd"},
+                 {"cde", "any:cde,cd:cde,last:cde"},
+                 {"xy", "any:xy,last:xy"}}) {
+            quickphrase->call<IQuickPhrase::trigger>(ic, "", "", input, "",
+                                                     Key());
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testQuickPhraseHandlerResult", RawConfig{});
+            FCITX_ASSERT(ret.value() == expected) << input << " " << ret;
+            ic->reset();
+        }
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testQuickPhraseHandlerRemove", RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        quickphrase->call<IQuickPhrase::trigger>(ic, "", "", "abz", "", Key());
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testQuickPhraseHandlerResult", RawConfig{});
+        FCITX_ASSERT(ret.value().empty()) << ret;
+        ic->reset();
+
+        // Test invoke with native lua values.
+        auto typed = luaaddon->call<ILuaAddon::invokeLuaFunctionTyped>(
+            ic, "testTypedInvoke",
+            std::vector<LuaValue>{42, LuaValueArray{true, 1.5, "a"},
+                                  LuaValueMap{{"key", "value"}}});
+        const auto *array = typed.get<LuaValueArray>();
+        FCITX_ASSERT(array && array->size() == 5);
+        FCITX_ASSERT((*array)[0] == LuaValue(43));
+        FCITX_ASSERT((*array)[1] == LuaValue(0.5));
+        FCITX_ASSERT((*array)[2] == LuaValue("b"));
+        FCITX_ASSERT((*array)[3] ==
+                     LuaValue(LuaValueMap{{"3", "c"}, {"x", false}}));
+        FCITX_ASSERT((*array)[4] == LuaValue(LuaValueArray{}));
+        // Table with a key that is not a string or an integer is an error.
+        typed = luaaddon->call<ILuaAddon::invokeLuaFunctionTyped>(
+            ic, "testTypedInvokeFloatKey", std::vector<LuaValue>{});
+        FCITX_ASSERT(typed.isNil());
+
+        // Test require through the fcitx module searcher.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testRequire",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        auto stats = luaaddon->call<ILuaAddon::stats>();
+        FCITX_ASSERT(
+            stats.valueByPath("Modules/testlua.testmodule/LoadTime"))
+            << stats;
+        // Another lua addon gets the module compiled by testlua.
+        auto *imeapi = instance->addonManager().addon("imeapi");
+        ret = imeapi->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testSharedRequire", RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        stats = imeapi->call<ILuaAddon::stats>();
+        FCITX_ASSERT(stats.valueByPath("Modules/testlua.testmodule/Cached") &&
+                     *stats.valueByPath("Modules/testlua.testmodule/Cached") ==
+                         "True")
+            << stats;
+
+        // Test the startup report of the loader.
+        auto report = instance->addonManager()
+                          .addon("luaaddonloader")
+                          ->call<ILuaAddonLoaderAddon::startupReport>();
+        FCITX_ASSERT(report.valueByPath("LoaderInit")) << report;
+        FCITX_ASSERT(report.valueByPath("Addons/testlua/Total")) << report;
+        FCITX_ASSERT(report.valueByPath("Addons/testlua/HeapSize")) << report;
+
+        // Test surrounding text and the delta watcher.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testWatchSurroundingText", RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        ic->surroundingText().setText("你好世界", 2, 2);
+        ic->updateSurroundingText();
+        ic->surroundingText().setText("你好新世界", 3, 3);
+        ic->updateSurroundingText();
+        ic->surroundingText().setText("你好界", 2, 2);
+        ic->updateSurroundingText();
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testSurroundingText", RawConfig{});
+        FCITX_ASSERT(ret.value() ==
+                     "0,0,你好世界,2,2;2,0,新,3,3;2,2,,2,2|你好界,2,2")
+            << ret;
+
+        // Test fcitx.text.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testText",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+
+        // Test string buffer and dump.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testBuffer",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testDump",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+
+        // Test commit history, recorded since the first call. The last
+        // commit is always tracked.
+        ic->commitString("z");
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testCommitHistory", RawConfig{});
+        FCITX_ASSERT(ret.value() == "|z") << ret;
+        ic->commitString("a");
+        ic->commitString("b");
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testCommitHistory", RawConfig{});
+        FCITX_ASSERT(ret.value() == "b,a|b") << ret;
+
+        // Test per input context data.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testICData",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "1") << ret;
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testICData",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "2") << ret;
+        auto otherUuid =
+            testfrontend->call<ITestFrontend::createInputContext>("otherapp");
+        auto *otherIc = instance->inputContextManager().findByUUID(otherUuid);
+        FCITX_ASSERT(otherIc);
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            otherIc, "testICData", RawConfig{});
+        FCITX_ASSERT(ret.value() == "1") << ret;
+        testfrontend->call<ITestFrontend::destroyInputContext>(otherUuid);
+
+        // Test batched user interface update.
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testUI",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        FCITX_ASSERT(ic->inputPanel().auxUp().toString() == "aux");
+        FCITX_ASSERT(ic->inputPanel().candidateList()->size() == 2);
+        // The same user interface is shown again after the panel is cleared
+        // by a reset.
+        ic->reset();
+        ic->inputPanel().reset();
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(ic, "testUI",
+                                                           RawConfig{});
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        FCITX_ASSERT(ic->inputPanel().auxUp().toString() == "aux");
+        FCITX_ASSERT(ic->inputPanel().candidateList()->size() == 2);
+        ic->inputPanel().candidateList()->candidate(1).select(ic);
+        FCITX_ASSERT(ic->inputPanel().auxUp().toString().empty());
+        FCITX_ASSERT(!ic->inputPanel().candidateList());
+
+        // Test coalesced event, only delivered once in the next event loop
+        // iteration.
+        ic->setCursorRect(Rect(0, 0, 1, 1));
+        ic->setCursorRect(Rect(1, 1, 2, 2));
+        ic->setCursorRect(Rect(2, 2, 3, 3));
+        ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            ic, "testCoalescedEvent", RawConfig{});
+        FCITX_ASSERT(ret.value() == "0") << ret;
+        dispatcher->schedule([instance, luaaddon, ic, &ready]() {
+            auto ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testCoalescedEvent", RawConfig{});
+            FCITX_ASSERT(ret.value() == "1") << ret;
+
+            // Test sandbox, the addon is disabled after missing the
+            // deadline.
+            auto *luaaddonloader =
+                instance->addonManager().addon("luaaddonloader");
+            RawConfig config;
+            config.setValueByPath("SandboxedAddons/0", "testlua");
+            config.setValueByPath("SandboxDeadline", "10");
+            luaaddonloader->setConfig(config);
+            luaaddon->reloadConfig();
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testSandbox", RawConfig{});
+            FCITX_ASSERT(ret.value() == "True") << ret;
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testDeadline", RawConfig{});
+            FCITX_ASSERT(ret.value().empty()) << ret;
+            auto stats = luaaddon->call<ILuaAddon::stats>();
+            FCITX_ASSERT(stats.valueByPath("Degraded") &&
+                         *stats.valueByPath("Degraded") == "True")
+                << stats;
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testSandbox", RawConfig{});
+            FCITX_ASSERT(ret.value().empty()) << ret;
+            config = RawConfig();
+            config.setValueByPath("SandboxedAddons", "");
+            luaaddonloader->setConfig(config);
+
+            // Test lazy addon, the state is only created on first call.
+            config = RawConfig();
+            config.setValueByPath("LazyAddons/0", "testlua");
+            luaaddonloader->setConfig(config);
+            luaaddon->reloadConfig();
+            stats = luaaddon->call<ILuaAddon::stats>();
+            FCITX_ASSERT(*stats.valueByPath("Loaded") == "False") << stats;
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testText", RawConfig{});
+            FCITX_ASSERT(ret.value() == "True") << ret;
+            stats = luaaddon->call<ILuaAddon::stats>();
+            FCITX_ASSERT(*stats.valueByPath("Loaded") == "True") << stats;
+            config = RawConfig();
+            config.setValueByPath("LazyAddons", "");
+            luaaddonloader->setConfig(config);
+
+            // Test profiler, the samples are saved as folded stacks.
+            luaaddon->call<ILuaAddon::startProfiler>(100);
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testProfiler", RawConfig{});
+            FCITX_ASSERT(ret.value() == "True") << ret;
+            auto profile = luaaddon->call<ILuaAddon::stopProfiler>();
+            FCITX_ASSERT(!profile.empty());
+            std::ifstream in(profile);
+            std::string folded((std::istreambuf_iterator<char>(in)),
+                               std::istreambuf_iterator<char>());
+            FCITX_ASSERT(folded.find(";profiledLoop (") != std::string::npos)
+                << folded;
+            std::filesystem::remove(profile);
+            FCITX_ASSERT(luaaddon->call<ILuaAddon::stopProfiler>().empty());
+
+            // The profiler is also switched by ProfiledAddons of the loader,
+            // and the profile is saved once the addon is removed from it.
+            config = RawConfig();
+            config.setValueByPath("ProfiledAddons/0", "testlua");
+            config.setValueByPath("ProfilerInterval", "100");
+            luaaddonloader->setConfig(config);
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testProfiler", RawConfig{});
+            FCITX_ASSERT(ret.value() == "True") << ret;
+            config = RawConfig();
+            config.setValueByPath("ProfiledAddons", "");
+            luaaddonloader->setConfig(config);
+            FCITX_ASSERT(std::filesystem::exists(profile));
+            std::filesystem::remove(profile);
+            FCITX_ASSERT(luaaddon->call<ILuaAddon::stopProfiler>().empty());
+
+            ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                ic, "testStore", RawConfig{});
+            FCITX_ASSERT(ret.value() == "True") << ret;
+
+            ready.set_value(luaaddon);
+        });
+    });
+
+    // Test async call from this thread, all of them run in the main thread.
+    auto *luaaddon = ready.get_future().get();
+    std::vector<std::future<RawConfig>> results;
+    for (int i = 0; i < 3; i++) {
+        RawConfig config;
+        config.setValue(std::to_string(i));
+        results.push_back(luaaddon->call<ILuaAddon::invokeLuaFunctionAsync>(
+            "testAsync", config));
+    }
+    for (int i = 0; i < 3; i++) {
+        auto ret = results[i].get();
+        FCITX_ASSERT(ret.value() == std::to_string(i * 2)) << ret;
+    }
+
+    // Test async file I/O, the callbacks are called from the main loop,
+    // which is checked by a timer until the file is read back.
+    dispatcher->schedule([dispatcher, instance, luaaddon]() {
+        RawConfig path;
+        path.setValue(TESTING_BINARY_DIR "/test/testfileio.txt");
+        auto ret = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+            nullptr, "testFileIO", path);
+        FCITX_ASSERT(ret.value() == "True") << ret;
+        static std::unique_ptr<EventSourceTime> timer;
+        timer = instance->eventLoop().addTimeEvent(
+            CLOCK_MONOTONIC, now(CLOCK_MONOTONIC), 10000,
+            [dispatcher, instance, luaaddon, path,
+             checks = 0](EventSourceTime *source, uint64_t) mutable {
+                auto result = luaaddon->call<ILuaAddon::invokeLuaFunction>(
+                    nullptr, "testFileIOResult", RawConfig());
+                if (result.value().empty()) {
+                    FCITX_ASSERT(++checks < 500);
+                    source->setNextInterval(10000);
+                    source->setOneShot();
+                    return true;
+                }
+                FCITX_ASSERT(result.value() == "a,b,,c") << result;
+                std::filesystem::remove(path.value());
+                dispatcher->detach();
+                instance->exit();
+                return true;
+            });
     });
 }
 
 void runInstance() {}
 
+void testKeyStream() {
+    std::vector<KeyStreamRecord> records(4);
+    records[0].type = KeyStreamRecordType::FocusIn;
+    records[0].text = "testapp";
+    records[1].time = 300;
+    records[1].sym = FcitxKey_a;
+    records[1].states = static_cast<uint32_t>(KeyState::Ctrl);
+    records[1].release = true;
+    records[2].type = KeyStreamRecordType::Commit;
+    records[2].time = 1ULL << 40;
+    records[2].text = std::string("a\0b", 3);
+    records[3].type = KeyStreamRecordType::FocusOut;
+    records[3].time = 1ULL << 41;
+
+    std::stringstream stream;
+    writeKeyStreamHeader(stream);
+    for (const auto &record : records) {
+        writeKeyStreamRecord(stream, record);
+    }
+    FCITX_ASSERT(readKeyStreamHeader(stream));
+    KeyStreamRecord record;
+    for (const auto &expected : records) {
+        FCITX_ASSERT(readKeyStreamRecord(stream, record));
+        FCITX_ASSERT(record.type == expected.type);
+        FCITX_ASSERT(record.time == expected.time);
+        FCITX_ASSERT(record.text == expected.text);
+        if (record.type == KeyStreamRecordType::Key) {
+            FCITX_ASSERT(record.sym == expected.sym);
+            FCITX_ASSERT(record.states == expected.states);
+            FCITX_ASSERT(record.release == expected.release);
+        }
+    }
+    FCITX_ASSERT(!readKeyStreamRecord(stream, record));
+}
+
 int main() {
+    testKeyStream();
+
+    // The installed quickphrase addon is used to test quick phrase handlers.
     setupTestingEnvironmentPath(
-        TESTING_BINARY_DIR, {"bin"},
+        TESTING_BINARY_DIR, {"bin", StandardPaths::fcitxPath("addondir")},
         {"test", TESTING_SOURCE_DIR "/test",
-         StandardPaths::fcitxPath("pkgdatadir", "testing")});
+         StandardPaths::fcitxPath("pkgdatadir", "testing"),
+         StandardPaths::fcitxPath("pkgdatadir")});
 
     fcitx::Log::setLogRule("default=5,lua=5");
     char arg0[] = "testlua";
     char arg1[] = "--disable=all";
-    char arg2[] = "--enable=testim,testfrontend,luaaddonloader,imeapi,testlua";
+    char arg2[] = "--enable=testim,testfrontend,luaaddonloader,imeapi,testlua,"
+                  "quickphrase";
     char *argv[] = {arg0, arg1, arg2};
     Instance instance(FCITX_ARRAY_SIZE(argv), argv);
     instance.addonManager().registerDefaultLoader(nullptr);